@@ -1,6 +1,7 @@
 // paging.c
 #include "paging.h"
 #include "pmm.h"
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -10,6 +11,13 @@
 #define PAGE_FLAGS_MASK 0x0000000000000FFF
 #define ALIGN_PAGE(addr) ((addr) & PAGE_MASK)
 
+// Адрес в PDE/PDPTE большой страницы (биты 12 и выше минус PAT и NX)
+#define LARGE_ADDR_MASK_2M 0x000FFFFFFFE00000
+#define LARGE_ADDR_MASK_1G 0x000FFFFFC0000000
+#define ENTRY_NX          (1ULL << 63)
+#define PTE_PAT           (1ULL << 7)   // PAT в PTE 4 KiB
+#define LARGE_PAT         (1ULL << 12)  // PAT в PDE/PDPTE большой страницы
+
 // Макросы для индексов таблиц
 #define PML4_INDEX(addr) (((addr) >> 39) & 0x1FF)
 #define PDPT_INDEX(addr) (((addr) >> 30) & 0x1FF)
@@ -26,100 +34,399 @@ enum {
 
 static page_table_entry* pml4 = NULL;
 
+static inline page_table_entry* table_virt(uint64_t phys) {
+    return (page_table_entry*)(ALIGN_PAGE(phys) + KERNEL_VIRTUAL_BASE);
+}
+
+static inline void invalidate_page(uint64_t virt_addr) {
+    __asm__ volatile("invlpg (%0)" : : "r" (virt_addr) : "memory");
+}
+
+// Кэш трансляций: per-CPU, прямого отображения, ключ - виртуальная страница, тег - CR3,
+// загруженный на этом CPU. Записи действительны только в текущем поколении:
+// любое изменение трансляции (unmap, перезапись записи) увеличивает translation_generation,
+// и все кэши разом устаревают. Запись, заполненная параллельно с unmap, несёт старое
+// поколение и поэтому никогда не будет использована. Как и кэши PMM, берётся try-lock'ом:
+// вложенный вызов из прерывания на том же CPU просто делает полный обход
+#define TRANSLATION_CACHE_SIZE 64 // Степень двойки
+
+typedef struct {
+    uint64_t virt_page;
+    uint64_t phys_page;
+    uint64_t cr3;
+    uint64_t generation;
+} translation_entry;
+
+typedef struct {
+    atomic_flag lock;
+    uint64_t cr3; // Последнее, что загрузил paging_load_directory на этом CPU
+    translation_entry entries[TRANSLATION_CACHE_SIZE];
+} __attribute__((aligned(64))) translation_cache;
+
+static translation_cache translation_caches[PMM_MAX_CPUS];
+static atomic_uint_fast64_t translation_generation = 1; // 0 - признак пустой записи
+
+static inline void translation_cache_invalidate(void) {
+    atomic_fetch_add_explicit(&translation_generation, 1, memory_order_release);
+}
+
+static translation_cache* translation_cache_acquire(void) {
+    uint32_t cpu = pmm_cpu_id();
+    if (cpu >= PMM_MAX_CPUS) return NULL;
+    translation_cache* cache = &translation_caches[cpu];
+    if (atomic_flag_test_and_set_explicit(&cache->lock, memory_order_acquire)) return NULL;
+    return cache;
+}
+
+static inline void translation_cache_release(translation_cache* cache) {
+    atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+}
+
+// Поддерживает ли CPU страницы 1 GiB (CPUID 0x80000001, EDX бит 26)
+static bool cpu_has_1g_pages(void) {
+    static int cached = -1;
+    if (cached < 0) {
+        uint32_t eax = 0x80000000, ebx, ecx, edx;
+        __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+        cached = 0;
+        if (eax >= 0x80000001) {
+            eax = 0x80000001;
+            __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+            cached = (edx >> 26) & 1;
+        }
+    }
+    return cached == 1;
+}
+
+static page_table_entry* alloc_table(void) {
+    uint64_t new_table = (uint64_t)pmm_alloc_block();
+    if (!new_table) return NULL;
+
+    // Очищаем новую таблицу
+    page_table_entry* new_table_ptr = table_virt(new_table);
+    for (size_t i = 0; i < 512; i++) {
+        new_table_ptr[i] = 0;
+    }
+    return new_table_ptr;
+}
+
 static page_table_entry* get_next_level(page_table_entry* table, uint64_t index, bool create, uint64_t flags) {
     if (!(table[index] & PAGE_PRESENT)) {
         if (!create) return NULL;
-        
-        uint64_t new_table = (uint64_t)pmm_alloc_block();
+
+        page_table_entry* new_table = alloc_table();
         if (!new_table) return NULL;
-        
-        // Очищаем новую таблицу
-        page_table_entry* new_table_ptr = (page_table_entry*)new_table;
-        for (size_t i = 0; i < 512; i++) {
-            new_table_ptr[i] = 0;
+
+        table[index] = ((uint64_t)new_table - KERNEL_VIRTUAL_BASE) | (flags & PAGE_FLAGS_MASK & ~PAGE_HUGE) | PAGE_PRESENT;
+    }
+    // Большая страница - следующего уровня нет
+    if (table[index] & PAGE_HUGE) return NULL;
+    return table_virt(table[index]);
+}
+
+// Разбивает большую страницу (2 MiB в PDE или 1 GiB в PDPTE) на 512 страниц
+// следующего размера с теми же флагами. Трансляция адресов не меняется
+static bool split_large_entry(page_table_entry* entry, uint64_t large_size) {
+    page_table_entry* table = alloc_table();
+    if (!table) return false;
+
+    uint64_t old = *entry;
+    uint64_t flags = old & (PAGE_FLAGS_MASK | ENTRY_NX | LARGE_PAT);
+    uint64_t small_size = large_size / 512;
+    uint64_t base = old & (large_size == PAGE_SIZE_1G ? LARGE_ADDR_MASK_1G : LARGE_ADDR_MASK_2M);
+
+    uint64_t child_flags;
+    if (small_size == PAGE_SIZE) {
+        // PTE 4 KiB: PS-бита нет, PAT переезжает из бита 12 в бит 7
+        child_flags = flags & ~(uint64_t)PAGE_HUGE & ~LARGE_PAT;
+        if (flags & LARGE_PAT) child_flags |= PTE_PAT;
+    } else {
+        child_flags = flags; // PDE 2 MiB: формат тот же, что у PDPTE 1 GiB
+    }
+    for (uint64_t i = 0; i < 512; i++) {
+        table[i] = (base + i * small_size) | child_flags;
+    }
+
+    // Таблица получает права большой страницы, окончательные права - в её записях
+    *entry = ((uint64_t)table - KERNEL_VIRTUAL_BASE) | (old & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER));
+    return true;
+}
+
+// Листовая запись для virt без изменений таблиц; *size - размер страницы
+static page_table_entry* lookup_entry(uint64_t virt_addr, uint64_t* size) {
+    page_table_entry* pdpt = get_next_level(pml4, PML4_INDEX(virt_addr), false, 0);
+    if (!pdpt) return NULL;
+
+    page_table_entry* pdpte = &pdpt[PDPT_INDEX(virt_addr)];
+    if (!(*pdpte & PAGE_PRESENT)) return NULL;
+    if (*pdpte & PAGE_HUGE) {
+        *size = PAGE_SIZE_1G;
+        return pdpte;
+    }
+
+    page_table_entry* pd = table_virt(*pdpte);
+    page_table_entry* pde = &pd[PD_INDEX(virt_addr)];
+    if (!(*pde & PAGE_PRESENT)) return NULL;
+    if (*pde & PAGE_HUGE) {
+        *size = PAGE_SIZE_2M;
+        return pde;
+    }
+
+    page_table_entry* pt = table_virt(*pde);
+    page_table_entry* pte = &pt[PT_INDEX(virt_addr)];
+    if (!(*pte & PAGE_PRESENT)) return NULL;
+    *size = PAGE_SIZE;
+    return pte;
+}
+
+// PTE 4 KiB для virt; большие страницы на пути разбиваются. NULL - либо адрес не
+// отображён, либо большую страницу не удалось разбить (нет памяти под таблицу): во
+// втором случае *split_failed = true, и прежняя трансляция остаётся на месте
+static page_table_entry* lookup_pte_split(uint64_t virt_addr, bool* split_failed) {
+    *split_failed = false;
+    page_table_entry* pdpt = get_next_level(pml4, PML4_INDEX(virt_addr), false, 0);
+    if (!pdpt) return NULL;
+
+    page_table_entry* pdpte = &pdpt[PDPT_INDEX(virt_addr)];
+    if (!(*pdpte & PAGE_PRESENT)) return NULL;
+    if (*pdpte & PAGE_HUGE) {
+        if (!split_large_entry(pdpte, PAGE_SIZE_1G)) {
+            *split_failed = true;
+            return NULL;
+        }
+        invalidate_page(virt_addr);
+    }
+
+    page_table_entry* pd = table_virt(*pdpte);
+    page_table_entry* pde = &pd[PD_INDEX(virt_addr)];
+    if (!(*pde & PAGE_PRESENT)) return NULL;
+    if (*pde & PAGE_HUGE) {
+        if (!split_large_entry(pde, PAGE_SIZE_2M)) {
+            *split_failed = true;
+            return NULL;
         }
-        
-        table[index] = ALIGN_PAGE(new_table) | (flags & PAGE_FLAGS_MASK) | PAGE_PRESENT;
+        invalidate_page(virt_addr);
     }
-    return (page_table_entry*)(ALIGN_PAGE(table[index]) + KERNEL_VIRTUAL_BASE);
+
+    page_table_entry* pt = table_virt(*pde);
+    return &pt[PT_INDEX(virt_addr)];
 }
 
 void paging_init(void) {
     // Выделяем выровненную память для PML4
     pml4 = (page_table_entry*)pmm_alloc_block_aligned(PAGE_SIZE);
-    
+
     // Инициализируем PML4 нулями
     for (size_t i = 0; i < 512; i++) {
         pml4[i] = 0;
     }
-    
+
     // Регистрируем PML4
     paging_load_directory((uint64_t)pml4 - KERNEL_VIRTUAL_BASE);
 }
 
 void* paging_map_page(uint64_t phys_addr, uint64_t virt_addr, uint64_t flags) {
     if (phys_addr & ~PAGE_MASK) return NULL;  // Проверка выравнивания
-    
+
     page_table_entry* pdpt = get_next_level(pml4, PML4_INDEX(virt_addr), true, flags);
     if (!pdpt) return NULL;
 
+    // Внутри большой страницы сначала разбиваем её
+    if ((pdpt[PDPT_INDEX(virt_addr)] & (PAGE_PRESENT | PAGE_HUGE)) == (PAGE_PRESENT | PAGE_HUGE) &&
+        !split_large_entry(&pdpt[PDPT_INDEX(virt_addr)], PAGE_SIZE_1G)) return NULL;
     page_table_entry* pd = get_next_level(pdpt, PDPT_INDEX(virt_addr), true, flags);
     if (!pd) return NULL;
 
+    if ((pd[PD_INDEX(virt_addr)] & (PAGE_PRESENT | PAGE_HUGE)) == (PAGE_PRESENT | PAGE_HUGE) &&
+        !split_large_entry(&pd[PD_INDEX(virt_addr)], PAGE_SIZE_2M)) return NULL;
     page_table_entry* pt = get_next_level(pd, PD_INDEX(virt_addr), true, flags);
     if (!pt) return NULL;
 
-    // Устанавливаем запись в таблицу страниц
+    // Устанавливаем запись в таблицу страниц; перезапись прежней трансляции сбрасывает кэши
+    if (pt[PT_INDEX(virt_addr)] & PAGE_PRESENT) translation_cache_invalidate();
     pt[PT_INDEX(virt_addr)] = ALIGN_PAGE(phys_addr) | (flags & PAGE_FLAGS_MASK) | PAGE_PRESENT;
-    
+
     // Инвалидация TLB
-    __asm__ volatile("invlpg (%0)" : : "r" (virt_addr) : "memory");
-    
+    invalidate_page(virt_addr);
+
     return (void*)virt_addr;
 }
 
-void paging_unmap_page(uint64_t virt_addr) {
-    page_table_entry* pdpt = get_next_level(pml4, PML4_INDEX(virt_addr), false, 0);
-    if (!pdpt) return;
+// Отображает одну большую страницу (large_size = 2 MiB или 1 GiB). Не трогает уже
+// существующие таблицы более мелкого уровня - в этом случае возвращает false
+static bool map_large_page(uint64_t phys_addr, uint64_t virt_addr, uint64_t flags, uint64_t large_size) {
+    page_table_entry* pdpt = get_next_level(pml4, PML4_INDEX(virt_addr), true, flags);
+    if (!pdpt) return false;
 
-    page_table_entry* pd = get_next_level(pdpt, PDPT_INDEX(virt_addr), false, 0);
-    if (!pd) return;
+    page_table_entry* entry;
+    if (large_size == PAGE_SIZE_1G) {
+        entry = &pdpt[PDPT_INDEX(virt_addr)];
+    } else {
+        if ((pdpt[PDPT_INDEX(virt_addr)] & (PAGE_PRESENT | PAGE_HUGE)) == (PAGE_PRESENT | PAGE_HUGE)) return false;
+        page_table_entry* pd = get_next_level(pdpt, PDPT_INDEX(virt_addr), true, flags);
+        if (!pd) return false;
+        entry = &pd[PD_INDEX(virt_addr)];
+    }
+    if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) return false;
+    if (*entry & PAGE_PRESENT) translation_cache_invalidate();
 
-    page_table_entry* pt = get_next_level(pd, PD_INDEX(virt_addr), false, 0);
-    if (!pt) return;
+    // PAT для большой страницы - бит 12, а бит 7 это PS
+    uint64_t entry_flags = (flags & PAGE_FLAGS_MASK & ~PTE_PAT) | PAGE_HUGE | PAGE_PRESENT;
+    if (flags & PTE_PAT) entry_flags |= LARGE_PAT;
+    *entry = phys_addr | entry_flags;
 
-    // Очищаем запись и инвалидируем TLB
-    pt[PT_INDEX(virt_addr)] = 0;
-    __asm__ volatile("invlpg (%0)" : : "r" (virt_addr) : "memory");
+    invalidate_page(virt_addr);
+    return true;
 }
 
-bool paging_is_page_present(uint64_t virt_addr) {
-    page_table_entry* pdpt = get_next_level(pml4, PML4_INDEX(virt_addr), false, 0);
-    if (!pdpt) return false;
+// Снимает отображение только на этом CPU; false - большую страницу не удалось разбить
+static bool unmap_page_local(uint64_t virt_addr) {
+    bool split_failed;
+    page_table_entry* pte = lookup_pte_split(virt_addr, &split_failed);
+    if (!pte) return !split_failed;
 
-    page_table_entry* pd = get_next_level(pdpt, PDPT_INDEX(virt_addr), false, 0);
-    if (!pd) return false;
+    // Очищаем запись и инвалидируем TLB и кэши трансляций
+    *pte = 0;
+    translation_cache_invalidate();
+    invalidate_page(virt_addr);
+    return true;
+}
 
-    page_table_entry* pt = get_next_level(pd, PD_INDEX(virt_addr), false, 0);
-    if (!pt) return false;
+// Сброс TLB остальных CPU для [virt_start, virt_start + pages). Сам модуль о других CPU
+// не знает, поэтому по умолчанию сбрасывать нечего; с SMP переопределяется (interrupts.c)
+__attribute__((weak)) bool paging_tlb_shootdown(uint64_t virt_start, size_t pages) {
+    (void)virt_start;
+    (void)pages;
+    return true;
+}
 
-    return (pt[PT_INDEX(virt_addr)] & PAGE_PRESENT) != 0;
+bool paging_unmap_page(uint64_t virt_addr) {
+    return unmap_page_local(virt_addr) && paging_tlb_shootdown(virt_addr, 1);
+}
+
+bool paging_is_page_present(uint64_t virt_addr) {
+    uint64_t size;
+    return lookup_entry(virt_addr, &size) != NULL;
+}
+
+// Полный обход таблиц
+static uint64_t walk_physical_address(uint64_t virt_addr) {
+    uint64_t size;
+    page_table_entry* entry = lookup_entry(virt_addr, &size);
+    if (!entry) return 0;
+
+    if (size == PAGE_SIZE) {
+        return ALIGN_PAGE(*entry) | (virt_addr & ~PAGE_MASK);
+    }
+    uint64_t base = *entry & (size == PAGE_SIZE_1G ? LARGE_ADDR_MASK_1G : LARGE_ADDR_MASK_2M);
+    return base | (virt_addr & (size - 1));
 }
 
 uint64_t paging_get_physical_address(uint64_t virt_addr) {
-    page_table_entry* pdpt = get_next_level(pml4, PML4_INDEX(virt_addr), false, 0);
-    if (!pdpt) return 0;
+    translation_cache* cache = translation_cache_acquire();
+    if (!cache) return walk_physical_address(virt_addr);
 
-    page_table_entry* pd = get_next_level(pdpt, PDPT_INDEX(virt_addr), false, 0);
-    if (!pd) return 0;
+    uint64_t virt_page = ALIGN_PAGE(virt_addr);
+    translation_entry* e = &cache->entries[(virt_page / PAGE_SIZE) & (TRANSLATION_CACHE_SIZE - 1)];
+    // Поколение читается до обхода: unmap во время обхода сделает запись недействительной
+    uint64_t generation = atomic_load_explicit(&translation_generation, memory_order_acquire);
+    if (e->generation == generation && e->virt_page == virt_page && e->cr3 == cache->cr3) {
+        uint64_t phys = e->phys_page | (virt_addr & ~PAGE_MASK);
+        translation_cache_release(cache);
+        return phys;
+    }
 
-    page_table_entry* pt = get_next_level(pd, PD_INDEX(virt_addr), false, 0);
-    if (!pt) return 0;
+    uint64_t phys = walk_physical_address(virt_addr);
+    if (phys) {
+        e->virt_page = virt_page;
+        e->phys_page = ALIGN_PAGE(phys);
+        e->cr3 = cache->cr3;
+        e->generation = generation;
+    }
+    translation_cache_release(cache);
+    return phys;
+}
 
-    return ALIGN_PAGE(pt[PT_INDEX(virt_addr)]) | (virt_addr & ~PAGE_MASK);
+size_t paging_translate_range(uint64_t virt_addr, uint64_t length, paging_phys_run* runs,
+                              size_t max_runs, uint64_t* translated) {
+    size_t count = 0;
+    uint64_t done = 0;
+
+    while (done < length) {
+        uint64_t virt = virt_addr + done;
+
+        // Один спуск по таблицам на лист верхнего уровня или на целую таблицу PT
+        page_table_entry* pdpt = get_next_level(pml4, PML4_INDEX(virt), false, 0);
+        if (!pdpt) break;
+        page_table_entry pdpte = pdpt[PDPT_INDEX(virt)];
+        if (!(pdpte & PAGE_PRESENT)) break;
+
+        uint64_t phys, chunk;
+        if (pdpte & PAGE_HUGE) {
+            phys = (pdpte & LARGE_ADDR_MASK_1G) | (virt & (PAGE_SIZE_1G - 1));
+            chunk = PAGE_SIZE_1G - (virt & (PAGE_SIZE_1G - 1));
+        } else {
+            page_table_entry pde = table_virt(pdpte)[PD_INDEX(virt)];
+            if (!(pde & PAGE_PRESENT)) break;
+            if (pde & PAGE_HUGE) {
+                phys = (pde & LARGE_ADDR_MASK_2M) | (virt & (PAGE_SIZE_2M - 1));
+                chunk = PAGE_SIZE_2M - (virt & (PAGE_SIZE_2M - 1));
+            } else {
+                page_table_entry* pt = table_virt(pde);
+                if (!(pt[PT_INDEX(virt)] & PAGE_PRESENT)) break;
+                phys = ALIGN_PAGE(pt[PT_INDEX(virt)]) | (virt & ~PAGE_MASK);
+                chunk = PAGE_SIZE - (virt & ~PAGE_MASK);
+                // Соседние PTE той же таблицы с продолжающимся физическим адресом - тот же кусок
+                for (uint64_t i = PT_INDEX(virt) + 1; i < 512 && done + chunk < length; i++) {
+                    if (!(pt[i] & PAGE_PRESENT) || ALIGN_PAGE(pt[i]) != ALIGN_PAGE(phys + chunk)) break;
+                    chunk += PAGE_SIZE;
+                }
+            }
+        }
+        if (chunk > length - done) chunk = length - done;
+
+        if (count > 0 && runs[count - 1].phys + runs[count - 1].length == phys) {
+            runs[count - 1].length += chunk;
+        } else {
+            if (count == max_runs) break;
+            runs[count].phys = phys;
+            runs[count].length = chunk;
+            count++;
+        }
+        done += chunk;
+    }
+
+    if (translated) *translated = done;
+    return count;
+}
+
+uint64_t paging_get_page_size(uint64_t virt_addr) {
+    uint64_t size;
+    return lookup_entry(virt_addr, &size) ? size : 0;
+}
+
+bool paging_protect_page(uint64_t virt_addr, uint64_t flags) {
+    bool split_failed;
+    page_table_entry* pte = lookup_pte_split(virt_addr, &split_failed);
+    if (!pte || !(*pte & PAGE_PRESENT)) return false;
+
+    // Меняем только младшие флаги; адрес, PAT и NX остаются
+    *pte = (*pte & ~(PAGE_FLAGS_MASK & ~PTE_PAT)) | (flags & PAGE_FLAGS_MASK & ~(PTE_PAT | PAGE_HUGE)) | PAGE_PRESENT;
+    invalidate_page(virt_addr);
+    return true;
 }
 
 void paging_load_directory(uint64_t pml4_addr) {
+    // Повторная загрузка того же CR3 - явный сброс TLB, его получают и кэши трансляций.
+    // Смена каталога меняет только тег: записи других каталогов остаются в кэше
+    translation_cache* cache = translation_cache_acquire();
+    if (cache) {
+        if (cache->cr3 == pml4_addr) translation_cache_invalidate();
+        cache->cr3 = pml4_addr;
+        translation_cache_release(cache);
+    } else {
+        translation_cache_invalidate();
+    }
     __asm__ volatile("mov %0, %%cr3" : : "r" (pml4_addr) : "memory");
 }
 
@@ -130,14 +437,63 @@ uint64_t paging_get_directory(void) {
 }
 
 // Дополнительные функции
-void paging_map_range(uint64_t phys_start, uint64_t virt_start, size_t pages, uint64_t flags) {
-    for (size_t i = 0; i < pages; i++) {
-        paging_map_page(
-            phys_start + i * PAGE_SIZE,
-            virt_start + i * PAGE_SIZE,
-            flags
-        );
+bool paging_map_range(uint64_t phys_start, uint64_t virt_start, size_t pages, uint64_t flags) {
+    // Большие страницы берутся везде, где физический и виртуальный адрес одинаково
+    // выровнены и осталось достаточно страниц; края диапазона - страницами 4 KiB
+    bool use_1g = cpu_has_1g_pages();
+    size_t done = 0;
+
+    while (done < pages) {
+        uint64_t phys = phys_start + done * PAGE_SIZE;
+        uint64_t virt = virt_start + done * PAGE_SIZE;
+        size_t left = pages - done;
+
+        if (use_1g && left >= PAGES_PER_1G && ((phys | virt) & (PAGE_SIZE_1G - 1)) == 0 &&
+            map_large_page(phys, virt, flags, PAGE_SIZE_1G)) {
+            done += PAGES_PER_1G;
+            continue;
+        }
+        if (left >= PAGES_PER_2M && ((phys | virt) & (PAGE_SIZE_2M - 1)) == 0 &&
+            map_large_page(phys, virt, flags, PAGE_SIZE_2M)) {
+            done += PAGES_PER_2M;
+            continue;
+        }
+        if (!paging_map_page(phys, virt, flags)) {
+            // Отображения только что созданы и ещё никому не отданы - хватит локального сброса
+            paging_unmap_range_local(virt_start, done);
+            return false;
+        }
+        done++;
     }
+    return true;
+}
+
+bool paging_unmap_range_local(uint64_t virt_start, size_t pages) {
+    bool ok = true;
+    size_t done = 0;
+    while (done < pages) {
+        uint64_t virt = virt_start + done * PAGE_SIZE;
+        uint64_t size;
+        page_table_entry* entry = lookup_entry(virt, &size);
+
+        // Большая страница, целиком попадающая в диапазон, снимается одной записью
+        if (entry && size != PAGE_SIZE && (virt & (size - 1)) == 0 && pages - done >= size / PAGE_SIZE) {
+            *entry = 0;
+            translation_cache_invalidate();
+            invalidate_page(virt);
+            done += size / PAGE_SIZE;
+            continue;
+        }
+        if (!unmap_page_local(virt)) ok = false;
+        done++;
+    }
+    return ok;
+}
+
+bool paging_unmap_range(uint64_t virt_start, size_t pages) {
+    // Один раунд IPI на весь диапазон, а не на каждую страницу
+    bool ok = paging_unmap_range_local(virt_start, pages);
+    return paging_tlb_shootdown(virt_start, pages) && ok;
 }
 
 void paging_identity_map(uint64_t start, size_t pages, uint64_t flags) {
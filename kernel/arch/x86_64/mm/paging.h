@@ -9,21 +9,58 @@
 #define PAGE_SIZE 4096
 #define KERNEL_VIRTUAL_BASE 0xFFFF800000000000
 
+// Большие страницы
+#define PAGE_SIZE_2M  0x200000ULL
+#define PAGE_SIZE_1G  0x40000000ULL
+#define PAGES_PER_2M  (PAGE_SIZE_2M / PAGE_SIZE)
+#define PAGES_PER_1G  (PAGE_SIZE_1G / PAGE_SIZE)
+
 typedef uint64_t page_table_entry;
 
 // Основные функции
 void paging_init(void);
 void* paging_map_page(uint64_t phys_addr, uint64_t virt_addr, uint64_t flags);
-void paging_unmap_page(uint64_t virt_addr);
+// Снимает отображение и сбрасывает TLB на всех CPU (paging_tlb_shootdown). false - фрейм
+// освобождать нельзя: либо большую страницу вокруг него не удалось разбить и он остался
+// отображённым, либо сброс не дошёл до какого-то CPU. Неотображённый адрес - не ошибка
+bool paging_unmap_page(uint64_t virt_addr);
 bool paging_is_page_present(uint64_t virt_addr);
 uint64_t paging_get_physical_address(uint64_t virt_addr);
+uint64_t paging_get_page_size(uint64_t virt_addr); // 0, если не отображено
+bool paging_protect_page(uint64_t virt_addr, uint64_t flags);
 void paging_load_directory(uint64_t pml4_addr);
 uint64_t paging_get_directory(void);
 
-// Дополнительные функции
-void paging_map_range(uint64_t phys_start, uint64_t virt_start, size_t pages, uint64_t flags);
+// Дополнительные функции. Диапазоны отображаются страницами 2 MiB (и 1 GiB, если CPU
+// их поддерживает) везде, где позволяет выравнивание; unmap/protect внутри большой
+// страницы сначала разбивают её. paging_map_range при ошибке откатывает сделанное;
+// paging_unmap_range снимает всё, что может, сбрасывает TLB на всех CPU одним раундом
+// и возвращает false, если хоть один фрейм освобождать нельзя (см. paging_unmap_page)
+bool paging_map_range(uint64_t phys_start, uint64_t virt_start, size_t pages, uint64_t flags);
+bool paging_unmap_range(uint64_t virt_start, size_t pages);
+// То же, но TLB сбрасывается только на этом CPU: сброс на остальных (ожидание их ответа)
+// нельзя делать под спинлоком, поэтому вызывающий снимает отображения под своим локом,
+// а после его освобождения вызывает paging_tlb_shootdown для того же диапазона и лишь
+// потом отдаёт фреймы. false - какая-то страница осталась отображённой
+bool paging_unmap_range_local(uint64_t virt_start, size_t pages);
+// Сбрасывает [virt_start, virt_start + pages) в TLB остальных CPU. false - сброс дошёл не
+// до всех, и фреймы из диапазона ещё могут быть доступны через чужой TLB
+bool paging_tlb_shootdown(uint64_t virt_start, size_t pages);
 void paging_identity_map(uint64_t start, size_t pages, uint64_t flags);
 
+// Физически непрерывный кусок трансляции
+typedef struct {
+    uint64_t phys;
+    uint64_t length; // В байтах
+} paging_phys_run;
+
+// Транслирует [virt_addr, virt_addr + length) за один проход по таблицам и склеивает
+// физически смежные страницы в куски. Возвращает число заполненных runs; останавливается
+// на неотображённой странице или когда max_runs исчерпан. В *translated (если не NULL) -
+// сколько байт от начала диапазона покрыто
+size_t paging_translate_range(uint64_t virt_addr, uint64_t length, paging_phys_run* runs,
+                              size_t max_runs, uint64_t* translated);
+
 // Флаги страниц
 enum {
     PAGE_PRESENT  = 1 << 0,
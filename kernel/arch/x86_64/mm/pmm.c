@@ -8,6 +8,7 @@ static atomic_flag lock = ATOMIC_FLAG_INIT;
 
 #define BITMAP_INDEX(block)  ((block) / BLOCKS_PER_LONG)
 #define BITMAP_OFFSET(block) ((block) % BLOCKS_PER_LONG)
+#define BLOCK_NONE           UINT64_MAX
 
 static void pmm_lock() {
     while (atomic_flag_test_and_set(&lock)) {
@@ -22,6 +23,12 @@ static void pmm_unlock() {
     atomic_flag_clear(&lock);
 }
 
+uint64_t pmm_metadata_size(uint64_t mem_size) {
+    uint64_t words = (mem_size / BLOCK_SIZE + BLOCKS_PER_LONG - 1) / BLOCKS_PER_LONG;
+    uint64_t summary = (words + WORDS_PER_SUPERBLOCK - 1) / WORDS_PER_SUPERBLOCK;
+    return (words + 2 * summary) * sizeof(unsigned long) + summary * sizeof(uint32_t);
+}
+
 void pmm_init(uint64_t mem_size, void* bitmap_base) {
     if (state.initialized) return;
 
@@ -30,28 +37,271 @@ void pmm_init(uint64_t mem_size, void* bitmap_base) {
     state.bitmap = (unsigned long*)bitmap_base;
     state.bitmap_size = (state.total_blocks + BLOCKS_PER_LONG - 1) / BLOCKS_PER_LONG;
     state.last_free_block = 0;
+
+    // Сводка лежит сразу за bitmap
+    state.summary_size = (state.bitmap_size + WORDS_PER_SUPERBLOCK - 1) / WORDS_PER_SUPERBLOCK;
+    state.any_free = state.bitmap + state.bitmap_size;
+    state.all_free = state.any_free + state.summary_size;
+    state.super_free = (uint32_t*)(state.all_free + state.summary_size);
     
     // Пометить всю память как занятую
     memset(state.bitmap, 0xFF, state.bitmap_size * sizeof(unsigned long));
+    memset(state.any_free, 0, state.summary_size * sizeof(unsigned long));
+    memset(state.all_free, 0, state.summary_size * sizeof(unsigned long));
+    memset(state.super_free, 0, state.summary_size * sizeof(uint32_t));
     state.used_blocks = state.total_blocks;
     
     state.initialized = true;
 }
 
-static void set_blocks(uint64_t block, size_t count, bool used) {
-    for (size_t i = 0; i < count; i++) {
-        size_t idx = BITMAP_INDEX(block + i);
-        size_t off = BITMAP_OFFSET(block + i);
-        
-        if (used) {
-            state.bitmap[idx] |= (1UL << off);
+// Пересчитывает сводку после изменения слова bitmap
+static void update_summary(uint64_t idx, unsigned long old_word, unsigned long new_word) {
+    uint64_t s = idx / WORDS_PER_SUPERBLOCK;
+    unsigned long bit = 1UL << (idx % WORDS_PER_SUPERBLOCK);
+
+    if (new_word != ~0UL) state.any_free[s] |= bit;
+    else state.any_free[s] &= ~bit;
+    if (new_word == 0) state.all_free[s] |= bit;
+    else state.all_free[s] &= ~bit;
+
+    state.super_free[s] += __builtin_popcountl(old_word) - __builtin_popcountl(new_word);
+}
+
+// Меняет состояние блоков по словам; возвращает число реально изменённых битов
+static uint64_t set_blocks(uint64_t block, size_t count, bool used) {
+    uint64_t changed = 0;
+    while (count > 0) {
+        uint64_t idx = BITMAP_INDEX(block);
+        uint64_t off = BITMAP_OFFSET(block);
+        uint64_t n = BLOCKS_PER_LONG - off;
+        if (n > count) n = count;
+
+        unsigned long mask = (n == BLOCKS_PER_LONG) ? ~0UL : ((1UL << n) - 1) << off;
+        unsigned long old_word = state.bitmap[idx];
+        unsigned long new_word = used ? (old_word | mask) : (old_word & ~mask);
+        if (new_word != old_word) {
+            state.bitmap[idx] = new_word;
+            update_summary(idx, old_word, new_word);
+            changed += __builtin_popcountl(old_word ^ new_word);
+        }
+
+        block += n;
+        count -= n;
+    }
+    return changed;
+}
+
+static uint64_t superblock_words(uint64_t s) {
+    uint64_t words = state.bitmap_size - s * WORDS_PER_SUPERBLOCK;
+    return words < WORDS_PER_SUPERBLOCK ? words : WORDS_PER_SUPERBLOCK;
+}
+
+// Свободных блоков подряд в конце суперблока
+static uint64_t superblock_tail_free(uint64_t s, uint64_t words) {
+    unsigned long all = state.all_free[s];
+    uint64_t w = words;
+    while (w > 0 && (all & (1UL << (w - 1)))) {
+        w--;
+    }
+    uint64_t tail = (words - w) * BLOCKS_PER_LONG;
+    if (w > 0) {
+        unsigned long word = state.bitmap[s * WORDS_PER_SUPERBLOCK + w - 1];
+        if (word != ~0UL) tail += __builtin_clzl(word);
+    }
+    return tail;
+}
+
+// Маска позиций слова, с которых начинается count (< BLOCKS_PER_LONG) свободных блоков подряд
+static unsigned long free_run_starts(unsigned long word, uint64_t count) {
+    unsigned long m = ~word;
+    uint64_t len = 1;
+    while (m && len < count) {
+        uint64_t step = (count - len < len) ? count - len : len;
+        m &= m >> step;
+        len += step;
+    }
+    return m;
+}
+
+// Один свободный блок: идём по сводке any_free начиная со слова hint_word, с переходом через конец
+static uint64_t find_free_block(uint64_t hint_word) {
+    uint64_t s0 = hint_word / WORDS_PER_SUPERBLOCK;
+    for (uint64_t i = 0; i <= state.summary_size; i++) {
+        uint64_t s = (s0 + i) % state.summary_size;
+        unsigned long bits = state.any_free[s];
+        if (i == 0) bits &= ~0UL << (hint_word % WORDS_PER_SUPERBLOCK);
+        if (bits) {
+            uint64_t w = s * WORDS_PER_SUPERBLOCK + __builtin_ctzl(bits);
+            return w * BLOCKS_PER_LONG + __builtin_ctzl(~state.bitmap[w]);
+        }
+    }
+    return BLOCK_NONE;
+}
+
+// count свободных блоков подряд в словах [from, to). Целиком занятые суперблоки
+// и суперблоки, где прогон заведомо не закончится, пропускаются по сводке
+static uint64_t find_free_run(uint64_t from, uint64_t to, uint64_t count) {
+    uint64_t run = 0; // Свободных блоков подряд непосредственно перед словом w
+    uint64_t w = from;
+
+    while (w < to) {
+        if (w % WORDS_PER_SUPERBLOCK == 0) {
+            uint64_t s = w / WORDS_PER_SUPERBLOCK;
+            uint64_t words = superblock_words(s);
+            if (w + words <= to) {
+                if (state.super_free[s] == 0) {
+                    run = 0;
+                    w += words;
+                    continue;
+                }
+                unsigned long all_mask = (words == WORDS_PER_SUPERBLOCK) ? ~0UL : (1UL << words) - 1;
+                if (state.all_free[s] == all_mask) {
+                    if (run + words * BLOCKS_PER_LONG >= count) return w * BLOCKS_PER_LONG - run;
+                    run += words * BLOCKS_PER_LONG;
+                    w += words;
+                    continue;
+                }
+                if (run + state.super_free[s] < count) {
+                    // Внутри суперблока прогон не закончится - переносим только его хвост
+                    run = superblock_tail_free(s, words);
+                    w += words;
+                    continue;
+                }
+            }
+        }
+
+        unsigned long word = state.bitmap[w];
+        if (word == 0) {
+            if (run + BLOCKS_PER_LONG >= count) return w * BLOCKS_PER_LONG - run;
+            run += BLOCKS_PER_LONG;
+        } else if (word == ~0UL) {
+            run = 0;
         } else {
-            state.bitmap[idx] &= ~(1UL << off);
+            if (run + __builtin_ctzl(word) >= count) return w * BLOCKS_PER_LONG - run;
+            if (count < BLOCKS_PER_LONG) {
+                unsigned long starts = free_run_starts(word, count);
+                if (starts) return w * BLOCKS_PER_LONG + __builtin_ctzl(starts);
+            }
+            run = __builtin_clzl(word);
         }
+        w++;
     }
+    return BLOCK_NONE;
+}
+
+// Захватывает count блоков подряд, вызывается под pmm_lock. BLOCK_NONE, если места нет
+static uint64_t alloc_blocks_locked(size_t count) {
+    if (state.total_blocks - state.used_blocks < count) return BLOCK_NONE;
+
+    uint64_t hint_word = BITMAP_INDEX(state.last_free_block);
+    if (hint_word >= state.bitmap_size) hint_word = 0;
+
+    uint64_t first_block;
+    if (count == 1) {
+        first_block = find_free_block(hint_word);
+    } else {
+        // От подсказки до конца, затем с начала - с запасом, чтобы поймать прогон через подсказку
+        first_block = find_free_run(hint_word, state.bitmap_size, count);
+        if (first_block == BLOCK_NONE && hint_word > 0) {
+            uint64_t to = hint_word + (count + BLOCKS_PER_LONG - 1) / BLOCKS_PER_LONG + 1;
+            first_block = find_free_run(0, to < state.bitmap_size ? to : state.bitmap_size, count);
+        }
+    }
+    if (first_block == BLOCK_NONE) return BLOCK_NONE;
+
+    set_blocks(first_block, count, true);
+    state.used_blocks += count;
+    state.last_free_block = first_block + count;
+    return first_block;
+}
+
+// Возвращает блоки в bitmap, вызывается под pmm_lock
+static void free_blocks_locked(uint64_t start, size_t count) {
+    set_blocks(start, count, false);
+    state.used_blocks -= count;
+    
+    if (start < state.last_free_block) {
+        state.last_free_block = start;
+    }
+}
+
+// Per-CPU кэши одиночных блоков. Блоки в кэше помечены занятыми в bitmap.
+// Кэш берётся только try-lock'ом: если он занят (например, прерыванием на том же CPU
+// посреди операции), запрос просто идёт в общий путь под pmm_lock
+typedef struct {
+    atomic_flag lock;
+    uint32_t count;
+    uint64_t blocks[PMM_CPU_CACHE_SIZE];
+} __attribute__((aligned(64))) pmm_cpu_cache_t;
+
+static pmm_cpu_cache_t cpu_caches[PMM_MAX_CPUS];
+
+// Номер текущего CPU. По умолчанию 0 (SMP здесь не поднимается); interrupts.c
+// переопределяет этот символ индексом из kmem_cpu_id (GS-relative)
+__attribute__((weak)) uint32_t pmm_cpu_id(void) {
+    return 0;
+}
+
+static bool cache_trylock(pmm_cpu_cache_t* cache) {
+    return !atomic_flag_test_and_set_explicit(&cache->lock, memory_order_acquire);
+}
+
+static void cache_unlock(pmm_cpu_cache_t* cache) {
+    atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+}
+
+// Сбрасывает весь кэш в bitmap одной критической секцией pmm_lock
+static uint64_t drain_cache(pmm_cpu_cache_t* cache) {
+    if (!cache_trylock(cache)) return 0;
+    uint64_t drained = cache->count;
+    if (drained > 0) {
+        pmm_lock();
+        for (uint32_t i = 0; i < cache->count; i++) {
+            free_blocks_locked(cache->blocks[i], 1);
+        }
+        pmm_unlock();
+        cache->count = 0;
+    }
+    cache_unlock(cache);
+    return drained;
+}
+
+uint64_t pmm_drain_cpu_cache(uint32_t cpu) {
+    if (cpu >= PMM_MAX_CPUS) return 0;
+    return drain_cache(&cpu_caches[cpu]);
+}
+
+uint64_t pmm_drain_all_caches(void) {
+    uint64_t drained = 0;
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        drained += drain_cache(&cpu_caches[cpu]);
+    }
+    return drained;
 }
 
 void* pmm_alloc_block(void) {
+    if (!state.initialized) return NULL;
+
+    uint32_t cpu = pmm_cpu_id();
+    if (cpu < PMM_MAX_CPUS) {
+        pmm_cpu_cache_t* cache = &cpu_caches[cpu];
+        if (cache_trylock(cache)) {
+            if (cache->count == 0) {
+                // Пустой кэш пополняется пачкой за одну критическую секцию
+                pmm_lock();
+                while (cache->count < PMM_CPU_CACHE_BATCH) {
+                    uint64_t block = alloc_blocks_locked(1);
+                    if (block == BLOCK_NONE) break;
+                    cache->blocks[cache->count++] = block;
+                }
+                pmm_unlock();
+            }
+            uint64_t block = cache->count > 0 ? cache->blocks[--cache->count] : BLOCK_NONE;
+            cache_unlock(cache);
+            if (block != BLOCK_NONE) return (void*)(block * BLOCK_SIZE);
+            // Глобально пусто - общий путь ещё попробует забрать блоки из чужих кэшей
+        }
+    }
     return pmm_alloc_blocks(1);
 }
 
@@ -59,46 +309,182 @@ void* pmm_alloc_blocks(size_t count) {
     if (!state.initialized || count == 0) return NULL;
 
     pmm_lock();
-    
-    uint64_t consecutive = 0;
-    uint64_t start_block = state.last_free_block;
-    
-    for (uint64_t i = start_block; i < state.total_blocks; i++) {
-        if (!(state.bitmap[BITMAP_INDEX(i)] & (1UL << BITMAP_OFFSET(i)))) {
-            if (++consecutive == count) {
-                uint64_t first_block = i - count + 1;
-                set_blocks(first_block, count, true);
-                state.used_blocks += count;
-                state.last_free_block = i + 1;
-                pmm_unlock();
-                return (void*)(first_block * BLOCK_SIZE);
-            }
-        } else {
-            consecutive = 0;
+    uint64_t first_block = alloc_blocks_locked(count);
+    pmm_unlock();
+
+    if (first_block == BLOCK_NONE && pmm_drain_all_caches() > 0) {
+        // Памяти мало: блоки, осевшие в per-CPU кэшах, вернулись в bitmap - ещё одна попытка
+        pmm_lock();
+        first_block = alloc_blocks_locked(count);
+        pmm_unlock();
+    }
+
+    if (first_block == BLOCK_NONE) return NULL;
+    return (void*)(first_block * BLOCK_SIZE);
+}
+
+// Первый занятый блок в [start, start + count) или BLOCK_NONE, если все свободны
+static uint64_t range_first_used(uint64_t start, uint64_t count) {
+    uint64_t block = start;
+    uint64_t end = start + count;
+    while (block < end) {
+        uint64_t idx = BITMAP_INDEX(block);
+        uint64_t off = BITMAP_OFFSET(block);
+        if (off == 0 && end - block >= BLOCKS_PER_LONG &&
+            (state.all_free[idx / WORDS_PER_SUPERBLOCK] & (1UL << (idx % WORDS_PER_SUPERBLOCK)))) {
+            block += BLOCKS_PER_LONG; // Целое свободное слово - по сводке, без чтения bitmap
+            continue;
         }
+        uint64_t n = BLOCKS_PER_LONG - off;
+        if (n > end - block) n = end - block;
+        unsigned long mask = (n == BLOCKS_PER_LONG) ? ~0UL : ((1UL << n) - 1) << off;
+        unsigned long used = state.bitmap[idx] & mask;
+        if (used) return idx * BLOCKS_PER_LONG + __builtin_ctzl(used);
+        block += n;
     }
-    
+    return BLOCK_NONE;
+}
+
+// count свободных блоков, начало кратно align_blocks, в диапазоне кандидатов [from, to).
+// Проверяются только выровненные позиции; после неудачи поиск прыгает за первый
+// мешающий занятый блок
+static uint64_t find_aligned_run(uint64_t from, uint64_t to, uint64_t count, uint64_t align_blocks) {
+    uint64_t candidate = (from + align_blocks - 1) / align_blocks * align_blocks;
+    while (candidate < to && candidate + count <= state.total_blocks) {
+        uint64_t used = range_first_used(candidate, count);
+        if (used == BLOCK_NONE) return candidate;
+        candidate = (used / align_blocks + 1) * align_blocks;
+    }
+    return BLOCK_NONE;
+}
+
+// Захватывает count блоков с началом, кратным align_blocks; вызывается под pmm_lock
+static uint64_t alloc_aligned_locked(uint64_t count, uint64_t align_blocks) {
+    if (state.total_blocks - state.used_blocks < count) return BLOCK_NONE;
+
+    uint64_t hint = state.last_free_block;
+    if (hint >= state.total_blocks) hint = 0;
+
+    uint64_t first_block = find_aligned_run(hint, state.total_blocks, count, align_blocks);
+    if (first_block == BLOCK_NONE && hint > 0) {
+        first_block = find_aligned_run(0, hint, count, align_blocks);
+    }
+    if (first_block == BLOCK_NONE) return BLOCK_NONE;
+
+    set_blocks(first_block, count, true);
+    state.used_blocks += count;
+    return first_block;
+}
+
+void* pmm_alloc_blocks_aligned(size_t count, uint64_t alignment) {
+    if (!state.initialized || count == 0) return NULL;
+    assert((alignment % BLOCK_SIZE) == 0 && "Alignment must be multiple of BLOCK_SIZE");
+    assert((alignment & (alignment - 1)) == 0 && "Alignment must be a power of two");
+
+    uint64_t align_blocks = alignment / BLOCK_SIZE;
+    if (align_blocks <= 1) return pmm_alloc_blocks(count);
+
+    pmm_lock();
+    uint64_t first_block = alloc_aligned_locked(count, align_blocks);
     pmm_unlock();
-    return NULL;
+
+    if (first_block == BLOCK_NONE && pmm_drain_all_caches() > 0) {
+        pmm_lock();
+        first_block = alloc_aligned_locked(count, align_blocks);
+        pmm_unlock();
+    }
+
+    if (first_block == BLOCK_NONE) return NULL;
+    return (void*)(first_block * BLOCK_SIZE);
 }
 
+// Блок размером alignment, выровненный на alignment
 void* pmm_alloc_block_aligned(uint64_t alignment) {
     assert((alignment % BLOCK_SIZE) == 0 && "Alignment must be multiple of BLOCK_SIZE");
-    
-    uint64_t align_blocks = alignment / BLOCK_SIZE;
-    uint64_t attempts = 0;
-    
-    while (attempts++ < 3) {
-        void* ptr = pmm_alloc_blocks(align_blocks);
-        if (((uint64_t)ptr % alignment) == 0) {
-            return ptr;
-        }
-        pmm_free_blocks(ptr, align_blocks);
+    if (alignment == BLOCK_SIZE) return pmm_alloc_block();
+    return pmm_alloc_blocks_aligned(alignment / BLOCK_SIZE, alignment);
+}
+
+// Пул зарезервированных 2 MiB фреймов для больших страниц. Пока память не
+// фрагментирована, pmm_huge_reserve откладывает фреймы сюда, и paging/vmm берут
+// их без поиска по bitmap. Защищён pmm_lock
+static uint64_t huge_pool[PMM_HUGE_POOL_SIZE]; // Номера первых блоков
+static uint32_t huge_pool_count = 0;
+static uint32_t huge_pool_target = 0; // Сколько фреймов держать в пуле при освобождении
+
+uint32_t pmm_huge_reserve(uint32_t count) {
+    if (!state.initialized) return 0;
+    if (count > PMM_HUGE_POOL_SIZE) count = PMM_HUGE_POOL_SIZE;
+
+    pmm_lock();
+    huge_pool_target = count;
+    while (huge_pool_count < count) {
+        uint64_t block = alloc_aligned_locked(PMM_HUGE_FRAME_BLOCKS, PMM_HUGE_FRAME_BLOCKS);
+        if (block == BLOCK_NONE) break;
+        huge_pool[huge_pool_count++] = block;
+    }
+    uint32_t reserved = huge_pool_count;
+    pmm_unlock();
+    return reserved;
+}
+
+void* pmm_alloc_huge_frame(void) {
+    if (!state.initialized) return NULL;
+
+    pmm_lock();
+    if (huge_pool_count > 0) {
+        uint64_t block = huge_pool[--huge_pool_count];
+        pmm_unlock();
+        return (void*)(block * BLOCK_SIZE);
+    }
+    pmm_unlock();
+
+    // Пул пуст - обычный выровненный поиск
+    return pmm_alloc_blocks_aligned(PMM_HUGE_FRAME_BLOCKS, PMM_HUGE_FRAME_SIZE);
+}
+
+void pmm_free_huge_frame(void* frame) {
+    if (!frame || !state.initialized) return;
+    assert(((uint64_t)frame % PMM_HUGE_FRAME_SIZE) == 0 && "Huge frame must be 2 MiB aligned");
+
+    uint64_t block = (uint64_t)frame / BLOCK_SIZE;
+    if (block + PMM_HUGE_FRAME_BLOCKS > state.total_blocks) return;
+
+    pmm_lock();
+    if (huge_pool_count < huge_pool_target) {
+        huge_pool[huge_pool_count++] = block; // Остаётся занятым в bitmap
+    } else {
+        free_blocks_locked(block, PMM_HUGE_FRAME_BLOCKS);
     }
-    return NULL;
+    pmm_unlock();
 }
 
 void pmm_free_block(void* block) {
+    if (!block || !state.initialized) return;
+
+    uint64_t index = (uint64_t)block / BLOCK_SIZE;
+    if (index >= state.total_blocks) return;
+
+    uint32_t cpu = pmm_cpu_id();
+    if (cpu < PMM_MAX_CPUS) {
+        pmm_cpu_cache_t* cache = &cpu_caches[cpu];
+        if (cache_trylock(cache)) {
+            if (cache->count == PMM_CPU_CACHE_SIZE) {
+                // Полный кэш: самые старые PMM_CPU_CACHE_BATCH блоков уходят в bitmap
+                pmm_lock();
+                for (uint32_t i = 0; i < PMM_CPU_CACHE_BATCH; i++) {
+                    free_blocks_locked(cache->blocks[i], 1);
+                }
+                pmm_unlock();
+                memmove(cache->blocks, cache->blocks + PMM_CPU_CACHE_BATCH,
+                        (PMM_CPU_CACHE_SIZE - PMM_CPU_CACHE_BATCH) * sizeof(uint64_t));
+                cache->count -= PMM_CPU_CACHE_BATCH;
+            }
+            cache->blocks[cache->count++] = index;
+            cache_unlock(cache);
+            return;
+        }
+    }
     pmm_free_blocks(block, 1);
 }
 
@@ -109,14 +495,7 @@ void pmm_free_blocks(void* block, size_t count) {
     if (start + count > state.total_blocks) return;
 
     pmm_lock();
-    
-    set_blocks(start, count, false);
-    state.used_blocks -= count;
-    
-    if (start < state.last_free_block) {
-        state.last_free_block = start;
-    }
-    
+    free_blocks_locked(start, count);
     pmm_unlock();
 }
 
@@ -126,10 +505,14 @@ void pmm_mark_region(uint64_t base, uint64_t size, bool used) {
     uint64_t blocks = align_size / BLOCK_SIZE;
     
     uint64_t start_block = align_base / BLOCK_SIZE;
+    if (start_block >= state.total_blocks) return;
+    if (blocks > state.total_blocks - start_block) blocks = state.total_blocks - start_block;
     
     pmm_lock();
-    set_blocks(start_block, blocks, used);
-    state.used_blocks += used ? blocks : -blocks;
+    // Считаем только реально изменённые блоки, чтобы перекрывающиеся регионы не портили счётчик
+    uint64_t changed = set_blocks(start_block, blocks, used);
+    if (used) state.used_blocks += changed;
+    else state.used_blocks -= changed;
     pmm_unlock();
 }
 
@@ -9,6 +9,20 @@
 #define BLOCKS_PER_BYTE 8
 #define BLOCKS_PER_LONG (sizeof(unsigned long) * BLOCKS_PER_BYTE)
 
+// Per-CPU кэши одиночных блоков
+#define PMM_MAX_CPUS        32
+#define PMM_CPU_CACHE_SIZE  64  // Блоков в кэше одного CPU
+#define PMM_CPU_CACHE_BATCH 32  // Сколько блоков за раз берётся из bitmap или возвращается туда
+
+// Фреймы для больших (2 MiB) страниц
+#define PMM_HUGE_FRAME_SIZE   (2 * 1024 * 1024)
+#define PMM_HUGE_FRAME_BLOCKS (PMM_HUGE_FRAME_SIZE / BLOCK_SIZE)
+#define PMM_HUGE_POOL_SIZE    64  // Максимум зарезервированных 2 MiB фреймов (128 MiB)
+
+// Суперблок - BLOCKS_PER_LONG слов bitmap, т.е. одно слово сводки (16 MiB при 4 KiB блоках)
+#define WORDS_PER_SUPERBLOCK  BLOCKS_PER_LONG
+#define BLOCKS_PER_SUPERBLOCK (WORDS_PER_SUPERBLOCK * BLOCKS_PER_LONG)
+
 typedef struct {
     uint64_t total_blocks;
     uint64_t used_blocks;
@@ -16,19 +30,41 @@ typedef struct {
     unsigned long* bitmap;
     uint64_t bitmap_size;
     uint64_t last_free_block;
+    // Сводка над bitmap: по биту на слово и счётчик на суперблок
+    unsigned long* any_free;    // Бит w: в слове w есть свободный блок
+    unsigned long* all_free;    // Бит w: слово w целиком свободно
+    uint32_t* super_free;       // Число свободных блоков в суперблоке
+    uint64_t summary_size;      // Слов в any_free/all_free (= число суперблоков)
     bool initialized;
 } pmm_state_t;
 
-// Инициализация PMM
+// Инициализация PMM. По адресу bitmap_base должно быть pmm_metadata_size(mem_size) байт:
+// там размещаются bitmap и сводка над ним
 void pmm_init(uint64_t mem_size, void* bitmap_base);
+uint64_t pmm_metadata_size(uint64_t mem_size);
 
 // Основные операции
 void* pmm_alloc_block(void);
 void* pmm_alloc_blocks(size_t count);
 void* pmm_alloc_block_aligned(uint64_t alignment);
+void* pmm_alloc_blocks_aligned(size_t count, uint64_t alignment);
 void pmm_free_block(void* block);
 void pmm_free_blocks(void* block, size_t count);
 
+// Per-CPU кэши: pmm_alloc_block/pmm_free_block сначала обращаются к кэшу текущего CPU.
+// Блоки в кэшах считаются занятыми; drain-функции возвращают их в bitmap (CPU уходит
+// в idle, памяти мало) и сообщают, сколько блоков вернули
+uint32_t pmm_cpu_id(void);
+uint64_t pmm_drain_cpu_cache(uint32_t cpu);
+uint64_t pmm_drain_all_caches(void);
+
+// Большие фреймы: pmm_huge_reserve заранее откладывает до count выровненных 2 MiB фреймов
+// (возвращает, сколько удалось), pmm_alloc_huge_frame берёт из пула или ищет в bitmap,
+// pmm_free_huge_frame пополняет пул до зарезервированного размера
+uint32_t pmm_huge_reserve(uint32_t count);
+void* pmm_alloc_huge_frame(void);
+void pmm_free_huge_frame(void* frame);
+
 // Информация о состоянии
 uint64_t pmm_get_total_memory(void);
 uint64_t pmm_get_free_memory(void);
@@ -11,7 +11,6 @@ static vmm_address_space kernel_space = {
     .current_brk = KERNEL_VIRTUAL_BASE
 };
 
-static atomic_uintptr_t next_free_page = ATOMIC_VAR_INIT(KERNEL_VIRTUAL_BASE);
 static atomic_flag vmm_lock = ATOMIC_FLAG_INIT;
 
 static void vmm_spin_lock() {
@@ -26,6 +25,391 @@ static void vmm_spin_unlock() {
     atomic_flag_clear(&vmm_lock);
 }
 
+// ---------------------------------------------------------------------------
+// Аллокатор диапазонов виртуальных адресов
+//
+// Свободное виртуальное пространство ядра хранится как набор непересекающихся диапазонов.
+// Каждый диапазон одновременно лежит в двух AVL-деревьях: по адресу (поиск соседей для
+// слияния) и по паре (размер, адрес) (best-fit). Выделение, освобождение и слияние - O(log n).
+// Узлы берутся из статического пула: VMM работает раньше, чем появляется куча.
+// Недавно освобождённые маленькие диапазоны оседают в кэше текущего CPU и переиспользуются
+// без захвата общей блокировки.
+// ---------------------------------------------------------------------------
+
+#define VA_KERNEL_WINDOW_PAGES 512 // Начало kernel_space занято отображением ядра из vmm_init
+#define VA_MAX_NODES 4096          // Максимум одновременно свободных диапазонов
+#define VA_CACHE_MAX_PAGES 16      // Диапазоны не больше этого размера идут в per-CPU кэш
+#define VA_CACHE_SIZE 32
+#define VA_CACHE_BATCH 16          // Сколько диапазонов кэш отдаёт в деревья при переполнении
+
+typedef struct va_avl_node {
+    struct va_avl_node* left;
+    struct va_avl_node* right;
+    int height;
+} va_avl_node;
+
+typedef struct va_range {
+    uint64_t start;  // Виртуальный адрес начала
+    uint64_t pages;  // Размер в страницах
+    va_avl_node by_addr;
+    va_avl_node by_size;
+    struct va_range* next_unused; // Связь в списке свободных узлов пула
+} va_range;
+
+typedef struct {
+    atomic_flag lock;
+    uint32_t count;
+    struct { uint64_t start; uint64_t pages; } ranges[VA_CACHE_SIZE];
+} __attribute__((aligned(64))) va_cpu_cache_t;
+
+static va_range va_nodes[VA_MAX_NODES];
+static va_range* va_unused_nodes;
+static va_avl_node* va_addr_root;
+static va_avl_node* va_size_root;
+static uint64_t va_free_pages;      // Свободно в деревьях (без кэшей)
+static atomic_flag va_lock = ATOMIC_FLAG_INIT;
+static va_cpu_cache_t va_cpu_caches[PMM_MAX_CPUS];
+
+#define VA_FROM_ADDR(n) ((va_range*)((char*)(n) - offsetof(va_range, by_addr)))
+#define VA_FROM_SIZE(n) ((va_range*)((char*)(n) - offsetof(va_range, by_size)))
+
+static void va_spin_lock(void) {
+    while (atomic_flag_test_and_set_explicit(&va_lock, memory_order_acquire)) {
+#ifdef __x86_64__
+        __asm__ volatile("pause");
+#endif
+    }
+}
+
+static void va_spin_unlock(void) {
+    atomic_flag_clear_explicit(&va_lock, memory_order_release);
+}
+
+// Ключи: по адресу - start; по размеру - (pages, start), чтобы ключи были уникальны
+static int va_cmp_addr(const va_avl_node* a, const va_avl_node* b) {
+    uint64_t x = VA_FROM_ADDR(a)->start, y = VA_FROM_ADDR(b)->start;
+    return (x > y) - (x < y);
+}
+
+static int va_cmp_size(const va_avl_node* a, const va_avl_node* b) {
+    const va_range* x = VA_FROM_SIZE(a);
+    const va_range* y = VA_FROM_SIZE(b);
+    if (x->pages != y->pages) return x->pages < y->pages ? -1 : 1;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+typedef int (*va_cmp_fn)(const va_avl_node*, const va_avl_node*);
+
+static int avl_height(const va_avl_node* n) {
+    return n ? n->height : 0;
+}
+
+static void avl_update(va_avl_node* n) {
+    int l = avl_height(n->left), r = avl_height(n->right);
+    n->height = (l > r ? l : r) + 1;
+}
+
+static va_avl_node* avl_rotate_right(va_avl_node* n) {
+    va_avl_node* l = n->left;
+    n->left = l->right;
+    l->right = n;
+    avl_update(n);
+    avl_update(l);
+    return l;
+}
+
+static va_avl_node* avl_rotate_left(va_avl_node* n) {
+    va_avl_node* r = n->right;
+    n->right = r->left;
+    r->left = n;
+    avl_update(n);
+    avl_update(r);
+    return r;
+}
+
+static va_avl_node* avl_balance(va_avl_node* n) {
+    avl_update(n);
+    int balance = avl_height(n->left) - avl_height(n->right);
+    if (balance > 1) {
+        if (avl_height(n->left->left) < avl_height(n->left->right)) {
+            n->left = avl_rotate_left(n->left);
+        }
+        return avl_rotate_right(n);
+    }
+    if (balance < -1) {
+        if (avl_height(n->right->right) < avl_height(n->right->left)) {
+            n->right = avl_rotate_right(n->right);
+        }
+        return avl_rotate_left(n);
+    }
+    return n;
+}
+
+static va_avl_node* avl_insert(va_avl_node* root, va_avl_node* node, va_cmp_fn cmp) {
+    if (!root) {
+        node->left = node->right = NULL;
+        node->height = 1;
+        return node;
+    }
+    if (cmp(node, root) < 0) {
+        root->left = avl_insert(root->left, node, cmp);
+    } else {
+        root->right = avl_insert(root->right, node, cmp);
+    }
+    return avl_balance(root);
+}
+
+// Отцепляет минимальный узел поддерева; сам узел возвращается через *min
+static va_avl_node* avl_remove_min(va_avl_node* root, va_avl_node** min) {
+    if (!root->left) {
+        *min = root;
+        return root->right;
+    }
+    root->left = avl_remove_min(root->left, min);
+    return avl_balance(root);
+}
+
+// Узел обязан быть в дереве: ключи уникальны, поиск идёт по самому узлу
+static va_avl_node* avl_remove(va_avl_node* root, va_avl_node* node, va_cmp_fn cmp) {
+    int c = cmp(node, root);
+    if (c < 0) {
+        root->left = avl_remove(root->left, node, cmp);
+        return avl_balance(root);
+    }
+    if (c > 0) {
+        root->right = avl_remove(root->right, node, cmp);
+        return avl_balance(root);
+    }
+    if (!root->right) {
+        return root->left;
+    }
+    va_avl_node* successor;
+    va_avl_node* right = avl_remove_min(root->right, &successor);
+    successor->left = root->left;
+    successor->right = right;
+    return avl_balance(successor);
+}
+
+static va_range* va_node_alloc(void) {
+    va_range* node = va_unused_nodes;
+    if (node) {
+        va_unused_nodes = node->next_unused;
+    }
+    return node;
+}
+
+static void va_node_free(va_range* node) {
+    node->next_unused = va_unused_nodes;
+    va_unused_nodes = node;
+}
+
+// Наименьший диапазон не короче pages страниц (best-fit), либо NULL
+static va_range* va_find_best_fit(uint64_t pages) {
+    va_avl_node* n = va_size_root;
+    va_range* best = NULL;
+    while (n) {
+        va_range* r = VA_FROM_SIZE(n);
+        if (r->pages >= pages) {
+            best = r;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    return best;
+}
+
+// Ближайшие диапазоны слева (start < addr) и справа (start >= addr) от addr
+static void va_find_neighbours(uint64_t addr, va_range** prev, va_range** next) {
+    va_avl_node* n = va_addr_root;
+    *prev = *next = NULL;
+    while (n) {
+        va_range* r = VA_FROM_ADDR(n);
+        if (r->start < addr) {
+            *prev = r;
+            n = n->right;
+        } else {
+            *next = r;
+            n = n->left;
+        }
+    }
+}
+
+// Меняет размер диапазона; адресный порядок при этом не нарушается
+static void va_resize(va_range* r, uint64_t start, uint64_t pages) {
+    va_size_root = avl_remove(va_size_root, &r->by_size, va_cmp_size);
+    r->start = start;
+    r->pages = pages;
+    va_size_root = avl_insert(va_size_root, &r->by_size, va_cmp_size);
+}
+
+static void va_remove(va_range* r) {
+    va_addr_root = avl_remove(va_addr_root, &r->by_addr, va_cmp_addr);
+    va_size_root = avl_remove(va_size_root, &r->by_size, va_cmp_size);
+    va_node_free(r);
+}
+
+// Возвращает диапазон в деревья, сливая его с соседями. Вызывается под va_lock.
+// Если слить не с кем и узлы пула кончились, диапазон теряется (false)
+static bool va_insert_locked(uint64_t start, uint64_t pages) {
+    uint64_t end = start + pages * PAGE_SIZE;
+    va_range* prev;
+    va_range* next;
+    va_find_neighbours(start, &prev, &next);
+
+    bool merge_prev = prev && prev->start + prev->pages * PAGE_SIZE == start;
+    bool merge_next = next && next->start == end;
+    va_free_pages += pages;
+
+    if (merge_prev && merge_next) {
+        uint64_t total = prev->pages + pages + next->pages;
+        va_remove(next);
+        va_resize(prev, prev->start, total);
+    } else if (merge_prev) {
+        va_resize(prev, prev->start, prev->pages + pages);
+    } else if (merge_next) {
+        va_resize(next, start, next->pages + pages);
+    } else {
+        va_range* r = va_node_alloc();
+        if (!r) {
+            va_free_pages -= pages;
+            return false;
+        }
+        r->start = start;
+        r->pages = pages;
+        va_addr_root = avl_insert(va_addr_root, &r->by_addr, va_cmp_addr);
+        va_size_root = avl_insert(va_size_root, &r->by_size, va_cmp_size);
+    }
+    return true;
+}
+
+// Вырезает pages страниц с выравниванием align (степень двойки, в байтах). Вызывается под va_lock.
+// Для выравнивания ищется диапазон с запасом на худший случай, чтобы поиск оставался O(log n)
+static uint64_t va_alloc_locked(uint64_t pages, uint64_t align) {
+    uint64_t slack = align > PAGE_SIZE ? align / PAGE_SIZE - 1 : 0;
+    va_range* r = va_find_best_fit(pages + slack);
+    if (!r) return 0;
+
+    uint64_t start = r->start;
+    uint64_t end = r->start + r->pages * PAGE_SIZE;
+    uint64_t aligned = (start + align - 1) & ~(align - 1);
+    uint64_t alloc_end = aligned + pages * PAGE_SIZE;
+    uint64_t head_pages = (aligned - start) / PAGE_SIZE;
+    uint64_t tail_pages = (end - alloc_end) / PAGE_SIZE;
+
+    va_free_pages -= r->pages;
+    if (head_pages) {
+        va_resize(r, start, head_pages);
+        va_free_pages += head_pages;
+        if (tail_pages) {
+            // Хвост становится отдельным диапазоном; без свободного узла он теряется
+            va_insert_locked(alloc_end, tail_pages);
+        }
+    } else if (tail_pages) {
+        va_resize(r, alloc_end, tail_pages);
+        va_free_pages += tail_pages;
+    } else {
+        va_remove(r);
+    }
+    return aligned;
+}
+
+static void va_init(uint64_t start, uint64_t end) {
+    va_unused_nodes = NULL;
+    for (size_t i = VA_MAX_NODES; i-- > 0;) {
+        va_node_free(&va_nodes[i]);
+    }
+    va_addr_root = va_size_root = NULL;
+    va_free_pages = 0;
+    va_insert_locked(start, (end - start) / PAGE_SIZE);
+}
+
+// Выделяет диапазон виртуальных адресов; 0 если места нет
+static uint64_t va_alloc(uint64_t pages, uint64_t align) {
+    if (pages <= VA_CACHE_MAX_PAGES && align <= PAGE_SIZE) {
+        uint32_t cpu = pmm_cpu_id();
+        if (cpu < PMM_MAX_CPUS) {
+            va_cpu_cache_t* cache = &va_cpu_caches[cpu];
+            if (!atomic_flag_test_and_set_explicit(&cache->lock, memory_order_acquire)) {
+                // Самый свежий диапазон точно такого размера
+                for (uint32_t i = cache->count; i-- > 0;) {
+                    if (cache->ranges[i].pages == pages) {
+                        uint64_t start = cache->ranges[i].start;
+                        cache->ranges[i] = cache->ranges[--cache->count];
+                        atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+                        return start;
+                    }
+                }
+                atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+            }
+        }
+    }
+
+    va_spin_lock();
+    uint64_t start = va_alloc_locked(pages, align);
+    va_spin_unlock();
+    if (start == 0 && pages <= VA_CACHE_MAX_PAGES) {
+        // Подходящее место может лежать в кэшах: сливаем их и пробуем ещё раз
+        vmm_drain_va_caches();
+        va_spin_lock();
+        start = va_alloc_locked(pages, align);
+        va_spin_unlock();
+    }
+    return start;
+}
+
+// Возвращает диапазон. Отображения к этому моменту уже должны быть сняты
+static void va_free(uint64_t start, uint64_t pages) {
+    if (pages <= VA_CACHE_MAX_PAGES) {
+        uint32_t cpu = pmm_cpu_id();
+        if (cpu < PMM_MAX_CPUS) {
+            va_cpu_cache_t* cache = &va_cpu_caches[cpu];
+            if (!atomic_flag_test_and_set_explicit(&cache->lock, memory_order_acquire)) {
+                if (cache->count == VA_CACHE_SIZE) {
+                    // Полный кэш: самые старые VA_CACHE_BATCH диапазонов уходят в деревья
+                    va_spin_lock();
+                    for (uint32_t i = 0; i < VA_CACHE_BATCH; i++) {
+                        va_insert_locked(cache->ranges[i].start, cache->ranges[i].pages);
+                    }
+                    va_spin_unlock();
+                    for (uint32_t i = VA_CACHE_BATCH; i < VA_CACHE_SIZE; i++) {
+                        cache->ranges[i - VA_CACHE_BATCH] = cache->ranges[i];
+                    }
+                    cache->count -= VA_CACHE_BATCH;
+                }
+                cache->ranges[cache->count].start = start;
+                cache->ranges[cache->count].pages = pages;
+                cache->count++;
+                atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+                return;
+            }
+        }
+    }
+
+    va_spin_lock();
+    va_insert_locked(start, pages);
+    va_spin_unlock();
+}
+
+uint64_t vmm_drain_va_caches(void) {
+    uint64_t drained = 0;
+    for (uint32_t cpu = 0; cpu < PMM_MAX_CPUS; cpu++) {
+        va_cpu_cache_t* cache = &va_cpu_caches[cpu];
+        if (atomic_flag_test_and_set_explicit(&cache->lock, memory_order_acquire)) {
+            continue; // Владелец как раз работает с кэшем
+        }
+        va_spin_lock();
+        for (uint32_t i = 0; i < cache->count; i++) {
+            va_insert_locked(cache->ranges[i].start, cache->ranges[i].pages);
+        }
+        va_spin_unlock();
+        drained += cache->count;
+        cache->count = 0;
+        atomic_flag_clear_explicit(&cache->lock, memory_order_release);
+    }
+    return drained;
+}
+
 void vmm_init(void) {
     paging_init();
     
@@ -36,43 +420,118 @@ void vmm_init(void) {
     vmm_map_range(0, KERNEL_VIRTUAL_BASE, 512, VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE);
     
     paging_load_directory(paging_get_directory());
+
+    va_init(kernel_space.virtual_base + VA_KERNEL_WINDOW_PAGES * PAGE_SIZE, kernel_space.virtual_top);
 }
 
 static bool is_page_aligned(uint64_t addr) {
     return (addr & (PAGE_SIZE - 1)) == 0;
 }
 
+// Фреймов, удерживаемых vmm_release_range до сброса TLB
+#define VMM_RELEASE_BATCH 64
+
+// Снимает отображения в [virt, virt + count страниц) и освобождает фреймы. Целые
+// страницы 2 MiB возвращаются в PMM одним фреймом. Отображения снимаются порциями под
+// vmm_lock, а сброс TLB на остальных CPU (один раунд IPI на порцию) и возврат фреймов в
+// PMM идут после его освобождения: ожидающий vmm_lock процессор может не ответить на IPI.
+// Диапазон принадлежит вызывающему, так что отпускать lock между порциями безопасно.
+// Фрейм отдаётся в PMM только после того, как его отображение снято везде. Если большую
+// страницу не удалось разбить или сброс не дошёл до какого-то CPU, фреймы остаются
+// занятыми, возвращается false, и диапазон нельзя возвращать в va-аллокатор.
+// Вызывается без vmm_lock
+static bool vmm_release_range(uint64_t virt, size_t count) {
+    uint64_t held[VMM_RELEASE_BATCH];
+    bool held_huge[VMM_RELEASE_BATCH];
+    bool ok = true;
+    size_t done = 0;
+
+    while (done < count) {
+        uint64_t batch_start = virt;
+        size_t held_count = 0;
+
+        vmm_spin_lock();
+        while (done < count && held_count < VMM_RELEASE_BATCH) {
+            uint64_t page_size = paging_get_page_size(virt);
+            if (page_size == PAGE_SIZE_2M && (virt & (PAGE_SIZE_2M - 1)) == 0 && count - done >= PAGES_PER_2M) {
+                uint64_t phys = paging_get_physical_address(virt);
+                if (paging_unmap_range_local(virt, PAGES_PER_2M)) {
+                    held[held_count] = phys;
+                    held_huge[held_count++] = true;
+                } else {
+                    ok = false;
+                }
+                virt += PAGE_SIZE_2M;
+                done += PAGES_PER_2M;
+                continue;
+            }
+            if (page_size) {
+                uint64_t phys = paging_get_physical_address(virt);
+                if (paging_unmap_range_local(virt, 1)) {
+                    held[held_count] = phys;
+                    held_huge[held_count++] = false;
+                } else {
+                    ok = false;
+                }
+            }
+            virt += PAGE_SIZE;
+            done++;
+        }
+        vmm_spin_unlock();
+
+        if (!paging_tlb_shootdown(batch_start, (virt - batch_start) / PAGE_SIZE)) {
+            ok = false;
+            continue;
+        }
+        for (size_t i = 0; i < held_count; i++) {
+            if (held_huge[i]) {
+                pmm_free_huge_frame((void*)held[i]);
+            } else {
+                pmm_free_block((void*)held[i]);
+            }
+        }
+    }
+    return ok;
+}
+
 void* vmm_alloc_pages(size_t count) {
     if (count == 0) return NULL;
 
+    // Запросы от 2 MiB выравниваются, чтобы их можно было покрыть большими страницами
+    uint64_t base_virt = va_alloc(count, count >= PAGES_PER_2M ? PAGE_SIZE_2M : PAGE_SIZE);
+    if (!base_virt) return NULL;
+
     vmm_spin_lock();
+    size_t done = 0;
     
-    uint64_t base_virt = atomic_load(&next_free_page);
-    uint64_t current_virt = base_virt;
-    
-    for (size_t i = 0; i < count; i++) {
-        void* phys = pmm_alloc_block();
-        if (!phys) {
-            // Rollback allocated pages
-            while (i-- > 0) {
-                pmm_free_block((void*)(current_virt - PAGE_SIZE * (i + 1)));
-                paging_unmap_page(current_virt - PAGE_SIZE * (i + 1));
+    while (done < count) {
+        uint64_t current_virt = base_virt + done * PAGE_SIZE;
+
+        // Выровненные куски по 2 MiB - одной большой страницей из пула PMM
+        if ((current_virt & (PAGE_SIZE_2M - 1)) == 0 && count - done >= PAGES_PER_2M) {
+            void* huge = pmm_alloc_huge_frame();
+            if (huge) {
+                if (paging_map_range((uint64_t)huge, current_virt, PAGES_PER_2M,
+                                     VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE)) {
+                    done += PAGES_PER_2M;
+                    continue;
+                }
+                pmm_free_huge_frame(huge);
             }
-            vmm_spin_unlock();
-            return NULL;
         }
-        
-        if (!paging_map_page((uint64_t)phys, current_virt, 
-                           VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE)) {
-            pmm_free_block(phys);
+
+        void* phys = pmm_alloc_block();
+        if (!phys || !paging_map_page((uint64_t)phys, current_virt,
+                                      VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE)) {
+            if (phys) pmm_free_block(phys);
             vmm_spin_unlock();
+            // Rollback allocated pages; недоснятый диапазон в va-аллокатор не возвращаем
+            if (vmm_release_range(base_virt, done)) va_free(base_virt, count);
             return NULL;
         }
-        
-        current_virt += PAGE_SIZE;
+        done++;
     }
     
-    atomic_store(&next_free_page, current_virt);
     vmm_spin_unlock();
     
     return (void*)base_virt;
@@ -81,19 +540,7 @@ void* vmm_alloc_pages(size_t count) {
 void vmm_free_pages(void* addr, size_t count) {
     if (!addr || count == 0 || !is_page_aligned((uint64_t)addr)) return;
 
-    vmm_spin_lock();
-    
-    uint64_t virt = (uint64_t)addr;
-    for (size_t i = 0; i < count; i++) {
-        uint64_t phys = paging_get_physical_address(virt);
-        if (phys) {
-            pmm_free_block((void*)phys);
-            paging_unmap_page(virt);
-        }
-        virt += PAGE_SIZE;
-    }
-    
-    vmm_spin_unlock();
+    if (vmm_release_range((uint64_t)addr, count)) va_free((uint64_t)addr, count);
 }
 
 bool vmm_map_page(uint64_t phys, uint64_t virt, uint64_t flags) {
@@ -109,51 +556,41 @@ bool vmm_map_page(uint64_t phys, uint64_t virt, uint64_t flags) {
 void vmm_unmap_page(uint64_t virt) {
     if (!is_page_aligned(virt)) return;
     
+    // Остальные CPU сбрасываются уже без vmm_lock (см. vmm_release_range)
     vmm_spin_lock();
-    paging_unmap_page(virt);
+    paging_unmap_range_local(virt, 1);
     vmm_spin_unlock();
+    paging_tlb_shootdown(virt, 1);
 }
 
 bool vmm_map_range(uint64_t phys_start, uint64_t virt_start, size_t pages, uint64_t flags) {
     if (!is_page_aligned(phys_start) || !is_page_aligned(virt_start)) return false;
 
+    // Страницы 2 MiB / 1 GiB там, где позволяет выравнивание; при ошибке paging откатывает всё сам
     vmm_spin_lock();
-    
-    for (size_t i = 0; i < pages; i++) {
-        uint64_t phys = phys_start + i * PAGE_SIZE;
-        uint64_t virt = virt_start + i * PAGE_SIZE;
-        
-        if (!paging_map_page(phys, virt, flags)) {
-            // Unmap already mapped pages
-            while (i-- > 0) {
-                paging_unmap_page(virt_start + i * PAGE_SIZE);
-            }
-            vmm_spin_unlock();
-            return false;
-        }
-    }
-    
+    bool ok = paging_map_range(phys_start, virt_start, pages, flags);
     vmm_spin_unlock();
-    return true;
+    return ok;
 }
 
 void vmm_protect_page(uint64_t virt, uint64_t flags) {
     if (!is_page_aligned(virt)) return;
     
+    // Внутри большой страницы paging_protect_page сначала разбивает её
+    // Понижение прав тоже должно дойти до TLB остальных CPU
     vmm_spin_lock();
-    
-    page_table_entry* entry = (page_table_entry*)paging_get_physical_address(virt);
-    if (entry) {
-        *entry = (*entry & ~0xFFF) | (flags & 0xFFF);
-        __asm__ volatile("invlpg (%0)" : : "r" (virt) : "memory");
-    }
-    
+    bool changed = paging_protect_page(virt, flags);
     vmm_spin_unlock();
+    if (changed) paging_tlb_shootdown(virt, 1);
 }
 
 // Дополнительные функции
 uint64_t vmm_get_kernel_base(void) { return KERNEL_VIRTUAL_BASE; }
 
 uint64_t vmm_get_free_virtual(void) {
-    return atomic_load(&next_free_page);
+    // Без учёта per-CPU кэшей: там лежат лишь небольшие недавно освобождённые диапазоны
+    va_spin_lock();
+    uint64_t free_bytes = va_free_pages * PAGE_SIZE;
+    va_spin_unlock();
+    return free_bytes;
 }
@@ -37,6 +37,9 @@ void vmm_switch_address_space(vmm_address_space* space);
 
 // Информация
 uint64_t vmm_get_kernel_base(void);
-uint64_t vmm_get_free_virtual(void);
+uint64_t vmm_get_free_virtual(void); // Байт свободного виртуального пространства ядра
+
+// Возвращает диапазоны из per-CPU кэшей в общий аллокатор; результат - их число
+uint64_t vmm_drain_va_caches(void);
 
 #endif // VMM_H
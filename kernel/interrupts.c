@@ -8,6 +8,8 @@
 #define KERNEL_CS 0x08       // Селектор сегмента кода ядра (предполагается плоская модель)
 #define MAX_PROCESSORS 8     // Максимальное поддерживаемое количество процессоров для нашего статического массива
 #define SPURIOUS_VECTOR_NUM 0xFF // Вектор для ложных прерываний APIC (рекомендуется 0xFF или 39)
+#define TLB_SHOOTDOWN_VECTOR 0xFD // IPI сброса TLB (см. tlb_gather_flush в memory.c)
+#define MSR_GS_BASE 0xC0000101   // IA32_GS_BASE: указывает на processors[i] текущего процессора
 
 // --- Атрибуты и Выравнивание ---
 #define PACKED __attribute__((packed))
@@ -86,6 +88,7 @@ typedef struct PACKED {
 
 // Информация о процессоре
 typedef struct ALIGNED(64) { // Выравнивание по линии кэша
+    uint32_t index;             // Индекс в processors[]; читается через %gs (см. kmem_cpu_id)
     uint32_t acpi_processor_id; // ID из ACPI MADT
     uint32_t apic_id;           // ID из регистра LAPIC
     volatile bool active;       // Флаг, устанавливаемый процессором после инициализации
@@ -106,6 +109,8 @@ static processor_info_t processors[MAX_PROCESSORS];
 static volatile uint32_t active_processor_count = 0;
 // Базовый адрес MMIO для локального APIC текущего процессора (обычно одинаков)
 static uintptr_t local_apic_base = APIC_DEFAULT_BASE;
+// GS_BASE настроен на BSP; до этого kmem_cpu_id возвращает 0
+static volatile bool percpu_ready = false;
 
 // --- Статические проверки ---
 static_assert(sizeof(idt_entry_t) == 16, "Invalid IDT entry size");
@@ -222,6 +227,8 @@ ISR_STUB(24, false); ISR_STUB(25, false); ISR_STUB(26, false); ISR_STUB(27, fals
 ISR_STUB(28, false); ISR_STUB(29, true); ISR_STUB(30, true); ISR_STUB(31, false);
 // Добавим заглушку и для ложного вектора
 ISR_STUB(SPURIOUS_VECTOR_NUM, false);
+// И для IPI сброса TLB
+ISR_STUB(TLB_SHOOTDOWN_VECTOR, false);
 
 // Добавим прототипы для линковщика
 #define ISR_STUB_PROTO(vector_num) extern void isr_stub_##vector_num(void)
@@ -234,6 +241,7 @@ ISR_STUB_PROTO(20); ISR_STUB_PROTO(21); ISR_STUB_PROTO(22); ISR_STUB_PROTO(23);
 ISR_STUB_PROTO(24); ISR_STUB_PROTO(25); ISR_STUB_PROTO(26); ISR_STUB_PROTO(27);
 ISR_STUB_PROTO(28); ISR_STUB_PROTO(29); ISR_STUB_PROTO(30); ISR_STUB_PROTO(31);
 ISR_STUB_PROTO(SPURIOUS_VECTOR_NUM);
+ISR_STUB_PROTO(TLB_SHOOTDOWN_VECTOR);
 
 // Указатели на функции-заглушки
 void* isr_stubs[] = {
@@ -246,6 +254,7 @@ void* isr_stubs[] = {
     [24] = &isr_stub_24, [25] = &isr_stub_25, [26] = &isr_stub_26, [27] = &isr_stub_27,
     [28] = &isr_stub_28, [29] = &isr_stub_29, [30] = &isr_stub_30, [31] = &isr_stub_31,
     // Устанавливаем заглушку и для ложного вектора
+    [TLB_SHOOTDOWN_VECTOR] = &isr_stub_TLB_SHOOTDOWN_VECTOR,
     [SPURIOUS_VECTOR_NUM] = &isr_stub_SPURIOUS_VECTOR_NUM
     // Остальные вектора пока не настроены (будут NULL)
 };
@@ -305,10 +314,30 @@ static void init_idt(void) {
 // Временная примитивная функция вывода для ядра (требует реализации!)
 void kprintf(const char *fmt, ...); // Объявление
 
+// Обработчик запроса на сброс TLB (memory.c)
+void vmm_tlb_shootdown_handler(void);
+// Copy-on-write: true, если запись можно повторить (memory.c)
+bool vmm_handle_page_fault(uint64_t fault_addr, uint64_t error_code);
+// Привязка индекса процессора к rdtscp для статистики системных вызовов (syscall.c)
+void syscall_stats_init_cpu(uint32_t cpu);
+// Включение процессора в маску kernel_address_space (memory.c)
+void vmm_cpu_online(void);
+// Сброс диапазона ядра в TLB всех процессоров (memory.c)
+bool vmm_flush_kernel_range(uint64_t virt, uint64_t pages);
+
 // Общий C-обработчик прерываний
 void generic_interrupt_handler_c(interrupt_frame_t *frame) {
     uint64_t vec = frame->vector_number;
 
+    // Page Fault при первом обращении к странице кучи или при записи в страницу copy-on-write разрешается молча
+    if (vec == 14) {
+        uint64_t cr2;
+        __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+        if (vmm_handle_page_fault(cr2, frame->error_code)) {
+            return; // Исключение - EOI не нужен
+        }
+    }
+
     // Базовая диагностика для исключений CPU
     if (vec < 32) {
         kprintf("!!! CPU EXCEPTION %lld (ERROR CODE: 0x%llx) !!!\n", vec, frame->error_code);
@@ -324,6 +353,9 @@ void generic_interrupt_handler_c(interrupt_frame_t *frame) {
              global_keep_running = false; // Сигнал всем CPU остановиться
              for (;;) __asm__ volatile("cli; hlt");
         }
+    } else if (vec == TLB_SHOOTDOWN_VECTOR) {
+        // Без kprintf: инициатор ждёт нас с выключенными прерываниями
+        vmm_tlb_shootdown_handler();
     } else if (vec == SPURIOUS_VECTOR_NUM) {
         // Ложное прерывание - Игнорируем и НЕ отправляем EOI!
         kprintf("Spurious interrupt (vector 0x%llx) received.\n", vec);
@@ -339,6 +371,62 @@ void generic_interrupt_handler_c(interrupt_frame_t *frame) {
     apic_send_eoi();
 }
 
+// --- Межпроцессорные прерывания для memory.c ---
+
+// Индекс текущего процессора в processors[] (переопределяет слабую версию в memory.c).
+// Эти же индексы использует маска в kmem_send_tlb_shootdown_ipi.
+// GS_BASE каждого процессора указывает на его processors[i], так что это одно чтение
+// без обращения к LAPIC. Вход из пользовательского режима должен делать swapgs
+uint32_t kmem_cpu_id(void) {
+    if (!percpu_ready) {
+        return 0; // До smp_init работает только BSP
+    }
+    uint32_t index;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(index) : "i"(offsetof(processor_info_t, index)));
+    return index;
+}
+
+// Тот же индекс для пер-CPU кэшей arch/x86_64/mm (pmm.c, vmm.c, paging.c);
+// переопределяет слабую версию в pmm.c, которая всегда возвращает 0
+uint32_t pmm_cpu_id(void) {
+    return kmem_cpu_id();
+}
+
+// Сброс TLB остальных процессоров после снятия отображений в arch/x86_64/mm (paging.c):
+// тот же раунд IPI, что и у memory.c; переопределяет слабую версию, которая ничего не шлёт
+bool paging_tlb_shootdown(uint64_t virt_start, size_t pages) {
+    return vmm_flush_kernel_range(virt_start, pages);
+}
+
+// Привязывает processors[index] к текущему процессору через GS_BASE
+static void percpu_init(uint32_t index) {
+    uint64_t base = (uint64_t)(uintptr_t)&processors[index];
+    processors[index].index = index;
+    __asm__ volatile("wrmsr" : : "c"(MSR_GS_BASE), "a"((uint32_t)base), "d"((uint32_t)(base >> 32)) : "memory");
+}
+
+// Один раунд IPI сброса TLB: по одному фиксированному IPI каждому процессору из маски.
+// Если кто-то из них ещё не активен, ответа не будет - тогда не шлём ничего
+bool kmem_send_tlb_shootdown_ipi(uint64_t cpu_mask) {
+    for (uint32_t i = 0; i < 64; ++i) {
+        if ((cpu_mask & (1ull << i)) && (i >= active_processor_count || !processors[i].active)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < active_processor_count; ++i) {
+        if (!(cpu_mask & (1ull << i))) {
+            continue;
+        }
+        apic_wait_ipi_idle();
+        apic_write(APIC_REG_ICR_HIGH, processors[i].apic_id << 24);
+        apic_write(APIC_REG_ICR_LOW, TLB_SHOOTDOWN_VECTOR | APIC_DELIVERY_MODE_FIXED |
+                                     APIC_DESTINATION_PHYSICAL | APIC_LEVEL_ASSERT |
+                                     APIC_TRIGGER_MODE_EDGE);
+    }
+    apic_wait_ipi_idle();
+    return true;
+}
+
 // --- Управление прерываниями ---
 INLINE void enable_interrupts(void) {
     __asm__ volatile("sti" ::: "memory");
@@ -415,6 +503,13 @@ NORETURN void ap_entry_point(void) {
          for (;;) __asm__ volatile("cli; hlt");
     }
 
+    percpu_init(my_processor_index);
+    syscall_stats_init_cpu(my_processor_index); // rdtscp будет возвращать индекс процессора
+
+    // Сначала active, чтобы IPI сброса TLB доходили, затем маска адресного пространства
+    processors[my_processor_index].active = true;
+    vmm_cpu_online();
+
     // Основная функция процессора
     cpu_main(my_processor_index);
 }
@@ -458,6 +553,13 @@ COLD void smp_init(void) {
                 proc->apic_id = lapic->apic_id;
                 proc->active = false; // Пока не активен
                 proc->bsp = (lapic->apic_id == bsp_apic_id);
+                if (proc->bsp) {
+                    percpu_init(active_processor_count);
+                    percpu_ready = true;
+                    syscall_stats_init_cpu(active_processor_count);
+                    proc->active = true; // BSP уже работает
+                    vmm_cpu_online();
+                }
 
                  kprintf("  Found LAPIC: ACPI ID %u, APIC ID %u, %s\n",
                          proc->acpi_processor_id, proc->apic_id, proc->bsp ? "BSP" : "AP");
@@ -29,6 +29,7 @@
 #define PTE_DIRTY (1ull << 6)
 #define PTE_PAT (1ull << 7)  // Page Attribute Table index
 #define PTE_GLOBAL (1ull << 8) // Global page (ignored in PML4E/PDPTE/PDE for 4k pages)
+#define PTE_COW (1ull << 9) // Software bit: PTE_WRITE withheld because the frame/table below is shared
 #define PTE_NX (1ull << 63) // No Execute bit
 #define PTE_ADDR_MASK 0x000FFFFFFFFFF000 // Mask for physical address (bits 12-51)
 #define PTE_FLAGS_MASK (~PTE_ADDR_MASK) // Mask for all flags
@@ -226,10 +227,39 @@ static inline void spin_lock(spinlock_t* lock) {
     }
 }
 
+static inline bool spin_trylock(spinlock_t* lock) {
+    return !__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE);
+}
+
 static inline void spin_unlock(spinlock_t* lock) {
     __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
 }
 
+// Disables interrupts and returns the previous RFLAGS so they can be restored
+static inline uint64_t irq_save() {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enables interrupts only if they were enabled when irq_save was called
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1ull << 9)) { // RFLAGS.IF
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+// --- Per-CPU Support ---
+
+#define KMEM_MAX_CPUS 16 // CPUs with private PMM caches and slab magazines; others use the shared paths
+
+// Index of the executing CPU. There is no SMP bring-up in this file, so the
+// default reports the boot CPU; SMP code overrides it (e.g. with a GS-relative
+// read). The value must stay stable while interrupts are disabled.
+__attribute__((weak)) uint32_t kmem_cpu_id() {
+    return 0;
+}
+
 // --- Physical Memory Manager (PMM) - Bitmap Allocator ---
 
 static uint64_t* pmm_bitmap = NULL;
@@ -239,6 +269,10 @@ static uint64_t pmm_used_frames = 0;
 static uint64_t pmm_highest_frame = 0; // Highest usable frame index
 static spinlock_t pmm_lock = SPINLOCK_INIT;
 static uint64_t pmm_last_allocated_index = 0; // Hint for next allocation
+static uint16_t* pmm_frame_refs = NULL; // Extra references per frame, stored after the bitmap (0 = one owner)
+// Flag in pmm_frame_refs: the frame is free but parked in a per-CPU cache, where the bitmap
+// still shows it as used. pmm_free_frame relies on it to catch double frees.
+#define PMM_FRAME_CACHED 0x8000
 
 // Global HHDM offset obtained from Limine
 static uint64_t hhdm_phys_offset = 0;
@@ -284,6 +318,45 @@ static inline bool pmm_bitmap_test(uint64_t frame_index) {
     return (__atomic_load_n(&pmm_bitmap[idx], __ATOMIC_RELAXED) & (1ull << bit)) != 0;
 }
 
+// Finds 'count' (> 1) contiguous free frames starting in qwords [from_qword, to_qword)
+static int64_t pmm_find_free_run(uint64_t from_qword, uint64_t to_qword, uint64_t count) {
+    uint64_t run = 0; // Free frames immediately before the current qword
+    for (uint64_t q = from_qword; q < to_qword; q++) {
+        uint64_t qword = __atomic_load_n(&pmm_bitmap[q], __ATOMIC_RELAXED);
+        uint64_t base = q * 64;
+        if (qword == 0) {
+            if (run + 64 >= count) {
+                uint64_t start = base - run;
+                return (start + count - 1 <= pmm_highest_frame) ? (int64_t)start : -1;
+            }
+            run += 64;
+        } else if (qword == UINT64_MAX) {
+            run = 0;
+        } else {
+            if (run + __builtin_ctzll(qword) >= count) {
+                uint64_t start = base - run;
+                return (start + count - 1 <= pmm_highest_frame) ? (int64_t)start : -1;
+            }
+            if (count < 64) {
+                // Bit i of 'starts' survives iff frames i..i+count-1 of this qword are all free
+                uint64_t starts = ~qword;
+                uint64_t len = 1;
+                while (starts && len < count) {
+                    uint64_t step = (count - len < len) ? count - len : len;
+                    starts &= starts >> step;
+                    len += step;
+                }
+                if (starts) {
+                    uint64_t start = base + __builtin_ctzll(starts);
+                    return (start + count - 1 <= pmm_highest_frame) ? (int64_t)start : -1;
+                }
+            }
+            run = __builtin_clzll(qword); // Free frames at the top of this qword
+        }
+    }
+    return -1;
+}
+
 // Finds the first 'count' contiguous free frames (Improved for count=1)
 static int64_t pmm_find_first_free_contiguous(uint64_t count) {
     if (count == 0) return -1;
@@ -309,81 +382,264 @@ static int64_t pmm_find_first_free_contiguous(uint64_t count) {
         }
         return -1; // Not found
     } else {
-        // Linear search for contiguous blocks (less optimized)
-        uint64_t consecutive_free = 0;
-        uint64_t start_index = pmm_last_allocated_index + 1;
-        if (start_index > pmm_highest_frame) start_index = 0;
-
-        for (uint64_t current_offset = 0; current_offset <= pmm_highest_frame; ++current_offset) {
-            uint64_t search_index = (start_index + current_offset) % (pmm_highest_frame + 1);
-
-            if (!pmm_bitmap_test(search_index)) {
-                consecutive_free++;
-                if (consecutive_free == count) {
-                    return search_index - count + 1; // Found start of block
-                }
-            } else {
-                consecutive_free = 0; // Reset counter
-            }
+        // Word-at-a-time search: full qwords reset the run, empty qwords extend it by 64,
+        // mixed qwords are resolved with ctz/clz. Runs never wrap from the last frame to frame 0,
+        // so the search goes hint..end and then 0..just past the hint.
+        uint64_t hint_qword = (pmm_last_allocated_index + 1) / 64;
+        if (hint_qword >= pmm_bitmap_size_qwords) hint_qword = 0;
+        int64_t found = pmm_find_free_run(hint_qword, pmm_bitmap_size_qwords, count);
+        if (found < 0 && hint_qword > 0) {
+            uint64_t end_qword = hint_qword + (count + 63) / 64 + 1;
+            if (end_qword > pmm_bitmap_size_qwords) end_qword = pmm_bitmap_size_qwords;
+            found = pmm_find_free_run(0, end_qword, count);
         }
-        return -1; // Not found
+        return found;
     }
 }
 
 
-// Allocates a single physical frame
-uint64_t pmm_alloc_frame() {
-    spin_lock(&pmm_lock);
-
+// Takes one free frame from the bitmap. Caller holds pmm_lock. Returns -1 if none is left.
+static int64_t pmm_take_frame_locked() {
     int64_t frame_index_signed = pmm_find_first_free_contiguous(1);
-
     if (frame_index_signed == -1) {
-        // Try searching from the beginning if the hint didn't work (already done by find_first_free)
-        spin_unlock(&pmm_lock);
-        kpanic("PMM: Out of physical memory!", __FILE__, __LINE__);
-        // Note: kpanic doesn't return
-        return 0; // Should not be reached
+        return -1;
     }
 
     uint64_t frame_index = (uint64_t)frame_index_signed;
-
     ASSERT(!pmm_bitmap_test(frame_index)); // Ensure it was actually free
 
     pmm_bitmap_set(frame_index);
     pmm_used_frames++;
     pmm_last_allocated_index = frame_index; // Update hint
+    return frame_index_signed;
+}
+
+// Returns one frame to the bitmap. Caller holds pmm_lock.
+static void pmm_put_frame_locked(uint64_t frame_index) {
+    if (!pmm_bitmap_test(frame_index)) {
+        spin_unlock(&pmm_lock);
+        kpanic("PMM: Attempted to free already free frame!", __FILE__, __LINE__);
+        return; // Should not be reached
+    }
+
+    pmm_bitmap_clear(frame_index);
+    pmm_used_frames--;
+}
+
+// --- PMM Per-CPU Frame Caches ---
+//
+// pmm_alloc_frame/pmm_free_frame first go to a small stack of hot frames owned by the
+// current CPU, so page-table allocation and heap growth rarely touch pmm_lock. Stacks are
+// refilled and drained PMM_CPU_CACHE_BATCH frames at a time. Frames sitting in a cache stay
+// marked as used in the bitmap.
+//
+// Each cache has its own lock, taken with interrupts disabled. It is uncontended except
+// when another CPU drains the cache under memory pressure. Lock order: cache -> pmm_lock.
+
+#define PMM_CPU_CACHE_SIZE 64
+#define PMM_CPU_CACHE_BATCH 32
+
+typedef struct {
+    spinlock_t lock;
+    uint32_t count;
+    uint64_t frames[PMM_CPU_CACHE_SIZE]; // Frame indices, most recently freed on top
+} __attribute__((aligned(64))) pmm_cpu_cache_t;
+
+static pmm_cpu_cache_t pmm_cpu_caches[KMEM_MAX_CPUS];
+
+static inline void pmm_mark_cached(uint64_t frame_index) {
+    uint16_t old = __atomic_fetch_or(&pmm_frame_refs[frame_index], PMM_FRAME_CACHED, __ATOMIC_RELAXED);
+    if (old & PMM_FRAME_CACHED) {
+        kpanic("PMM: Attempted to free already free frame!", __FILE__, __LINE__);
+    }
+}
+
+static inline void pmm_clear_cached(uint64_t frame_index) {
+    __atomic_fetch_and(&pmm_frame_refs[frame_index], (uint16_t)~PMM_FRAME_CACHED, __ATOMIC_RELAXED);
+}
+
+// Returns every frame held by one cache to the bitmap. Interrupts must be disabled.
+static uint64_t pmm_drain_cache(pmm_cpu_cache_t* cache) {
+    spin_lock(&cache->lock);
+    uint64_t drained = cache->count;
+    if (drained > 0) {
+        spin_lock(&pmm_lock);
+        for (uint32_t i = 0; i < cache->count; i++) {
+            pmm_clear_cached(cache->frames[i]);
+            pmm_put_frame_locked(cache->frames[i]);
+        }
+        spin_unlock(&pmm_lock);
+        cache->count = 0;
+    }
+    spin_unlock(&cache->lock);
+    return drained;
+}
+
+// Drain hook for the current CPU, e.g. before it goes idle. Returns the number of frames released.
+uint64_t pmm_drain_cpu_cache() {
+    uint64_t flags = irq_save();
+    uint64_t drained = 0;
+    uint32_t cpu = kmem_cpu_id();
+    if (cpu < KMEM_MAX_CPUS) {
+        drained = pmm_drain_cache(&pmm_cpu_caches[cpu]);
+    }
+    irq_restore(flags);
+    return drained;
+}
+
+// Drains every CPU's cache; used when the bitmap runs dry. Returns the number of frames released.
+uint64_t pmm_drain_all_caches() {
+    uint64_t flags = irq_save();
+    uint64_t drained = 0;
+    for (uint32_t cpu = 0; cpu < KMEM_MAX_CPUS; cpu++) {
+        drained += pmm_drain_cache(&pmm_cpu_caches[cpu]);
+    }
+    irq_restore(flags);
+    return drained;
+}
+
+// Allocates a single zeroed physical frame. Returns 0 when physical memory is exhausted,
+// for callers that can back off (see tlb_gather_reserve).
+uint64_t pmm_try_alloc_frame() {
+    int64_t frame_index_signed = -1;
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = kmem_cpu_id();
+    if (cpu < KMEM_MAX_CPUS) {
+        pmm_cpu_cache_t* cache = &pmm_cpu_caches[cpu];
+        spin_lock(&cache->lock);
+        if (cache->count == 0) {
+            // Refill half the stack in one pmm_lock section
+            spin_lock(&pmm_lock);
+            while (cache->count < PMM_CPU_CACHE_BATCH) {
+                int64_t frame = pmm_take_frame_locked();
+                if (frame == -1) break;
+                pmm_mark_cached((uint64_t)frame);
+                cache->frames[cache->count++] = (uint64_t)frame;
+            }
+            spin_unlock(&pmm_lock);
+        }
+        if (cache->count > 0) {
+            frame_index_signed = (int64_t)cache->frames[--cache->count];
+            pmm_clear_cached((uint64_t)frame_index_signed);
+        }
+        spin_unlock(&cache->lock);
+    }
+    irq_restore(flags);
+
+    if (frame_index_signed == -1) {
+        spin_lock(&pmm_lock);
+        frame_index_signed = pmm_take_frame_locked();
+        spin_unlock(&pmm_lock);
+
+        // Frames parked in other CPUs' caches are the last reserve
+        if (frame_index_signed == -1 && pmm_drain_all_caches() > 0) {
+            spin_lock(&pmm_lock);
+            frame_index_signed = pmm_take_frame_locked();
+            spin_unlock(&pmm_lock);
+        }
+    }
+
+    if (frame_index_signed == -1) {
+        return 0;
+    }
 
-    uint64_t phys_addr = frame_index * PAGE_SIZE;
+    uint64_t phys_addr = (uint64_t)frame_index_signed * PAGE_SIZE;
 
-    // Zero the allocated frame *before* releasing the lock
+    // Zero the frame; it is owned by the caller now, so no lock is needed
     void* virt_addr = phys_to_virt(phys_addr);
     memset(virt_addr, 0, PAGE_SIZE);
 
-    spin_unlock(&pmm_lock);
-
     // kprintf("PMM: Allocated frame 0x%lx\n", phys_addr);
     return phys_addr;
 }
 
+// Allocates a single physical frame
+uint64_t pmm_alloc_frame() {
+    uint64_t phys_addr = pmm_try_alloc_frame();
+    if (phys_addr == 0) {
+        kpanic("PMM: Out of physical memory!", __FILE__, __LINE__);
+        // Note: kpanic doesn't return
+        return 0; // Should not be reached
+    }
+    return phys_addr;
+}
+
 // Frees a single physical frame
 void pmm_free_frame(uint64_t phys_addr) {
     ASSERT((phys_addr % PAGE_SIZE) == 0); // Must be page aligned
     uint64_t frame_index = phys_addr / PAGE_SIZE;
     ASSERT(frame_index <= pmm_highest_frame); // Must be within manageable range
+    // Catches frames already back in the bitmap; frames parked in a cache are still marked
+    // used there, so for those pmm_mark_cached below does the check
+    ASSERT(pmm_bitmap_test(frame_index));
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = kmem_cpu_id();
+    if (cpu < KMEM_MAX_CPUS) {
+        pmm_cpu_cache_t* cache = &pmm_cpu_caches[cpu];
+        spin_lock(&cache->lock);
+        if (cache->count == PMM_CPU_CACHE_SIZE) {
+            // Full: the oldest PMM_CPU_CACHE_BATCH frames go back to the bitmap
+            spin_lock(&pmm_lock);
+            for (uint32_t i = 0; i < PMM_CPU_CACHE_BATCH; i++) {
+                pmm_clear_cached(cache->frames[i]);
+                pmm_put_frame_locked(cache->frames[i]);
+            }
+            spin_unlock(&pmm_lock);
+            for (uint32_t i = PMM_CPU_CACHE_BATCH; i < PMM_CPU_CACHE_SIZE; i++) {
+                cache->frames[i - PMM_CPU_CACHE_BATCH] = cache->frames[i];
+            }
+            cache->count -= PMM_CPU_CACHE_BATCH;
+        }
+        pmm_mark_cached(frame_index);
+        cache->frames[cache->count++] = frame_index;
+        spin_unlock(&cache->lock);
+        irq_restore(flags);
+        return;
+    }
+    irq_restore(flags);
 
     spin_lock(&pmm_lock);
+    pmm_put_frame_locked(frame_index);
+    spin_unlock(&pmm_lock);
+    // kprintf("PMM: Freed frame 0x%lx\n", phys_addr);
+}
 
-    if (!pmm_bitmap_test(frame_index)) {
-        spin_unlock(&pmm_lock);
-        kpanic("PMM: Attempted to free already free frame!", __FILE__, __LINE__);
-        return; // Should not be reached
-    }
+// --- Frame Reference Counts ---
 
-    pmm_bitmap_clear(frame_index);
-    pmm_used_frames--;
+// Copy-on-write sharing gives a frame (data page or page table) several owners. The count
+// kept is the number of *extra* owners, so frames that were never shared cost nothing and
+// pmm_frame_unref on them is just pmm_free_frame.
 
-    spin_unlock(&pmm_lock);
-    // kprintf("PMM: Freed frame 0x%lx\n", phys_addr);
+static inline void pmm_frame_ref(uint64_t phys_addr) {
+    uint16_t old = __atomic_fetch_add(&pmm_frame_refs[phys_addr / PAGE_SIZE], 1, __ATOMIC_RELAXED);
+    ASSERT(old < PMM_FRAME_CACHED - 1); // Owned frames never carry PMM_FRAME_CACHED
+    (void)old;
+}
+
+static inline bool pmm_frame_shared(uint64_t phys_addr) {
+    return __atomic_load_n(&pmm_frame_refs[phys_addr / PAGE_SIZE], __ATOMIC_ACQUIRE) != 0;
+}
+
+// Drops one extra reference. Returns false, changing nothing, if the caller is the only
+// owner, e.g. because the other sharer let go in the meantime.
+static bool pmm_frame_unshare(uint64_t phys_addr) {
+    uint16_t* refs = &pmm_frame_refs[phys_addr / PAGE_SIZE];
+    uint16_t old = __atomic_load_n(refs, __ATOMIC_ACQUIRE);
+    while (old != 0) {
+        if (__atomic_compare_exchange_n(refs, &old, old - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drops a reference and frees the frame when it was the last one
+void pmm_frame_unref(uint64_t phys_addr) {
+    if (!pmm_frame_unshare(phys_addr)) {
+        pmm_free_frame(phys_addr);
+    }
 }
 
 // --- Virtual Memory Manager (VMM) ---
@@ -396,9 +652,11 @@ typedef uint64_t pt_entry_t;
 typedef struct {
     uint64_t pml4_phys;
     spinlock_t lock; // Lock for modifying this specific address space
+    volatile uint64_t cpu_mask; // Bit per kmem_cpu_id() of the CPUs that have this space loaded
 } address_space_t;
 
 static address_space_t kernel_address_space;
+static address_space_t* vmm_current_space[KMEM_MAX_CPUS]; // Space loaded on each CPU
 
 // Reads the current CR3 register (physical address of PML4)
 static inline uint64_t read_cr3() {
@@ -417,9 +675,359 @@ static inline void invlpg(void* virt_addr) {
     asm volatile("invlpg (%0)" ::"r"(virt_addr) : "memory");
 }
 
+// Drops every TLB entry on this CPU. Reloading CR3 keeps global pages, so when CR4.PGE is
+// set it is toggled instead, which flushes those as well.
+static inline void tlb_flush_all_local() {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (cr4 & (1ull << 7)) { // CR4.PGE
+        asm volatile("mov %0, %%cr4" ::"r"(cr4 & ~(1ull << 7)) : "memory");
+        asm volatile("mov %0, %%cr4" ::"r"(cr4) : "memory");
+    } else {
+        load_cr3(read_cr3());
+    }
+}
+
+// --- TLB Shootdown (batched invalidation) ---
+
+// Unmapping code collects the pages it clears in a tlb_gather_t and invalidates them in one
+// go with tlb_gather_flush: one local pass plus one IPI round to the other CPUs that have the
+// address space loaded. Frames that were mapped (data pages and emptied page tables) are only
+// returned to the PMM after that flush, so no CPU can still reach them through a stale entry.
+//
+//     tlb_gather_t gather;
+//     tlb_gather_init(&gather, space);
+//     for (...) tlb_gather_free_frame(&gather, vmm_unmap_page_deferred(&gather, addr));
+//     tlb_gather_flush(&gather);
+//
+// The flush waits for the other CPUs with interrupts off, and they may be spinning on a lock
+// with interrupts off too, so it must never run with a spinlock held. Code that unmaps under
+// a lock (the heap) reserves room for the frames with tlb_gather_reserve before it changes
+// anything, and flushes after dropping the lock. Frames beyond the inline array go to spill
+// pages taken from the PMM; only a gather that could not get one flushes early.
+
+#define TLB_GATHER_MAX_RANGES 16 // Distinct ranges tracked before falling back to a full flush
+#define TLB_GATHER_MAX_FRAMES 64 // Frames held inline before spill pages are needed
+#define TLB_FLUSH_ALL_THRESHOLD 32 // Above this many pages a full flush beats per-page invlpg
+
+// A page of held-back frames, chained through physical addresses
+#define TLB_SPILL_FRAMES (PAGE_SIZE / sizeof(uint64_t) - 2)
+
+typedef struct {
+    uint64_t next_phys;
+    uint64_t count;
+    uint64_t frames[TLB_SPILL_FRAMES];
+} tlb_spill_page_t;
+
+typedef struct {
+    address_space_t* space;
+    uint64_t range_start[TLB_GATHER_MAX_RANGES]; // Page-aligned virtual start of each range
+    uint64_t range_pages[TLB_GATHER_MAX_RANGES];
+    uint32_t range_count;
+    uint64_t total_pages;
+    bool flush_all; // Too many pages or ranges to invalidate one by one
+    uint64_t frames[TLB_GATHER_MAX_FRAMES]; // Physical frames to free once the flush is done
+    uint32_t frame_count;
+    uint64_t spill_phys; // Spill pages in use; the first one is being filled
+    uint64_t spare_phys; // Empty spill pages set aside by tlb_gather_reserve
+    uint64_t spare_count;
+} tlb_gather_t;
+
+// One shootdown request in flight at a time. 'request' stays valid while 'pending' is non-zero:
+// the initiator does not return (and its gather does not go out of scope) until every target
+// CPU has cleared its bit.
+static struct {
+    spinlock_t lock; // Serializes initiators
+    const tlb_gather_t* volatile request;
+    volatile uint64_t pending; // Target CPUs that have not processed the request yet
+} tlb_shootdown = { SPINLOCK_INIT, NULL, 0 };
+
+// Sends the TLB shootdown IPI to every CPU in cpu_mask (bit per kmem_cpu_id()). Returns false
+// when some CPU in the mask cannot be reached; tlb_gather_flush then keeps the frames it holds.
+// Without SMP bring-up no other CPU joins a mask, so this is never called.
+// The interrupt code overrides this and calls vmm_tlb_shootdown_handler from the vector.
+__attribute__((weak)) bool kmem_send_tlb_shootdown_ipi(uint64_t cpu_mask) {
+    (void)cpu_mask;
+    return false;
+}
+
+void tlb_gather_init(tlb_gather_t* gather, address_space_t* space) {
+    gather->space = space;
+    gather->range_count = 0;
+    gather->total_pages = 0;
+    gather->flush_all = false;
+    gather->frame_count = 0;
+    gather->spill_phys = 0;
+    gather->spare_phys = 0;
+    gather->spare_count = 0;
+}
+
+// Upper bound on the frames that unmapping 'mapped' pages inside a span of 'span' pages hands
+// to a gather: the pages themselves plus every page table covering the span, which may empty
+static inline uint64_t tlb_gather_frames_for(uint64_t mapped, uint64_t span) {
+    return mapped + span / 512 + span / (512 * 512) + 6;
+}
+
+// Number of frames the gather can still take without allocating
+static uint64_t tlb_gather_room(const tlb_gather_t* gather) {
+    uint64_t room = TLB_GATHER_MAX_FRAMES - gather->frame_count;
+    if (gather->spill_phys) {
+        room += TLB_SPILL_FRAMES - ((tlb_spill_page_t*)phys_to_virt(gather->spill_phys))->count;
+    }
+    return room + gather->spare_count * TLB_SPILL_FRAMES;
+}
+
+// Makes sure the gather can take 'frames' more frames without flushing early, so the caller
+// may keep a lock held until it is done unmapping. Returns false if the spill pages this
+// needs cannot be allocated; the caller should then leave the pages mapped.
+bool tlb_gather_reserve(tlb_gather_t* gather, uint64_t frames) {
+    while (tlb_gather_room(gather) < frames) {
+        uint64_t page = pmm_try_alloc_frame();
+        if (page == 0) {
+            return false;
+        }
+        ((tlb_spill_page_t*)phys_to_virt(page))->next_phys = gather->spare_phys;
+        gather->spare_phys = page;
+        gather->spare_count++;
+    }
+    return true;
+}
+
+// Records that [virt, virt + pages * PAGE_SIZE) needs invalidating. Extends the last range
+// when contiguous, which is the common case for loops over a region.
+void tlb_gather_add(tlb_gather_t* gather, uint64_t virt, uint64_t pages) {
+    gather->total_pages += pages;
+    if (gather->flush_all) {
+        return;
+    }
+    if (gather->total_pages > TLB_FLUSH_ALL_THRESHOLD) {
+        gather->flush_all = true;
+        return;
+    }
+    if (gather->range_count > 0) {
+        uint32_t last = gather->range_count - 1;
+        if (gather->range_start[last] + gather->range_pages[last] * PAGE_SIZE == virt) {
+            gather->range_pages[last] += pages;
+            return;
+        }
+    }
+    if (gather->range_count == TLB_GATHER_MAX_RANGES) {
+        gather->flush_all = true;
+        return;
+    }
+    gather->range_start[gather->range_count] = virt;
+    gather->range_pages[gather->range_count] = pages;
+    gather->range_count++;
+}
+
+// Invalidates what the gather describes on the executing CPU
+static void tlb_gather_apply_local(const tlb_gather_t* gather) {
+    if (gather->flush_all) {
+        tlb_flush_all_local();
+        return;
+    }
+    for (uint32_t r = 0; r < gather->range_count; r++) {
+        for (uint64_t i = 0; i < gather->range_pages[r]; i++) {
+            invlpg((void*)(gather->range_start[r] + i * PAGE_SIZE));
+        }
+    }
+}
+
+// Processes a pending shootdown request aimed at this CPU, if any. Called from the IPI vector,
+// and by CPUs spinning in tlb_gather_flush so two initiators with interrupts off cannot
+// deadlock waiting on each other.
+void vmm_tlb_shootdown_handler() {
+    uint32_t cpu = kmem_cpu_id();
+    if (cpu >= KMEM_MAX_CPUS) {
+        return;
+    }
+    uint64_t bit = 1ull << cpu;
+    if (!(__atomic_load_n(&tlb_shootdown.pending, __ATOMIC_ACQUIRE) & bit)) {
+        return;
+    }
+    tlb_gather_apply_local(tlb_shootdown.request);
+    __atomic_fetch_and(&tlb_shootdown.pending, ~bit, __ATOMIC_RELEASE);
+}
+
+// Invalidates everything gathered so far on all CPUs that may cache it, then frees the held
+// frames. The gather is reset and can keep collecting. Returns false when some CPU could not
+// be reached (the held frames are leaked then).
+bool tlb_gather_flush(tlb_gather_t* gather) {
+    if (gather->total_pages == 0 && !gather->flush_all && gather->frame_count == 0) {
+        return true;
+    }
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = kmem_cpu_id();
+    uint64_t self = (cpu < KMEM_MAX_CPUS) ? (1ull << cpu) : 0;
+    bool delivered = true;
+
+    if (gather->total_pages != 0 || gather->flush_all) {
+        tlb_gather_apply_local(gather);
+
+        // Kernel mappings are shared by every address space, so every CPU that ever loaded
+        // one is a target; kernel_address_space.cpu_mask only ever gains bits.
+        uint64_t targets = __atomic_load_n(&gather->space->cpu_mask, __ATOMIC_ACQUIRE) & ~self;
+        if (targets) {
+            while (!spin_trylock(&tlb_shootdown.lock)) {
+                vmm_tlb_shootdown_handler();
+                asm volatile("pause");
+            }
+            tlb_shootdown.request = gather;
+            __atomic_store_n(&tlb_shootdown.pending, targets, __ATOMIC_RELEASE);
+            if (kmem_send_tlb_shootdown_ipi(targets)) {
+                while (__atomic_load_n(&tlb_shootdown.pending, __ATOMIC_ACQUIRE)) {
+                    asm volatile("pause");
+                }
+            } else {
+                __atomic_store_n(&tlb_shootdown.pending, 0, __ATOMIC_RELEASE);
+                delivered = false;
+            }
+            tlb_shootdown.request = NULL;
+            spin_unlock(&tlb_shootdown.lock);
+        }
+    }
+    irq_restore(flags);
+
+    // A CPU in the mask that could not be reached may still use the frames through its TLB,
+    // so they are leaked rather than handed out again
+    if (!delivered && gather->frame_count != 0) {
+        kprintf("VMM: Warning - TLB shootdown not delivered, leaking held-back frames\n");
+    }
+    for (uint32_t i = 0; delivered && i < gather->frame_count; i++) {
+        pmm_frame_unref(gather->frames[i]);
+    }
+    for (uint64_t page = gather->spill_phys; page != 0;) {
+        tlb_spill_page_t* spill = (tlb_spill_page_t*)phys_to_virt(page);
+        for (uint64_t i = 0; delivered && i < spill->count; i++) {
+            pmm_frame_unref(spill->frames[i]);
+        }
+        uint64_t next = spill->next_phys;
+        pmm_free_frame(page);
+        page = next;
+    }
+    for (uint64_t page = gather->spare_phys; page != 0;) {
+        uint64_t next = ((tlb_spill_page_t*)phys_to_virt(page))->next_phys;
+        pmm_free_frame(page);
+        page = next;
+    }
+    tlb_gather_init(gather, gather->space);
+    return delivered;
+}
+
+// Invalidates [virt, virt + pages) of the kernel half on every CPU, for page-table code that
+// clears kernel entries itself (arch/x86_64/mm/paging.c, through the interrupt code). Same rule
+// as tlb_gather_flush: never call it with a spinlock held. Returns false if some CPU was not
+// reached, in which case frames from the range must not be reused.
+bool vmm_flush_kernel_range(uint64_t virt, uint64_t pages) {
+    if (pages == 0) {
+        return true;
+    }
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, &kernel_address_space);
+    tlb_gather_add(&gather, virt & ~(uint64_t)(PAGE_SIZE - 1), pages);
+    return tlb_gather_flush(&gather);
+}
+
+// Hands a frame that was mapped in the gathered ranges to the gather; its reference is dropped
+// in the next flush. Zero (nothing was mapped) is ignored.
+void tlb_gather_free_frame(tlb_gather_t* gather, uint64_t phys_frame) {
+    if (phys_frame == 0) {
+        return;
+    }
+    if (gather->frame_count < TLB_GATHER_MAX_FRAMES) {
+        gather->frames[gather->frame_count++] = phys_frame;
+        return;
+    }
+    tlb_spill_page_t* spill = gather->spill_phys ? (tlb_spill_page_t*)phys_to_virt(gather->spill_phys) : NULL;
+    if (!spill || spill->count == TLB_SPILL_FRAMES) {
+        uint64_t page = gather->spare_phys;
+        if (page) {
+            gather->spare_phys = ((tlb_spill_page_t*)phys_to_virt(page))->next_phys;
+            gather->spare_count--;
+        } else {
+            page = pmm_try_alloc_frame();
+        }
+        if (page == 0) {
+            // Out of memory and nothing reserved: the caller holds no lock (see above)
+            tlb_gather_flush(gather);
+            gather->frames[gather->frame_count++] = phys_frame;
+            return;
+        }
+        spill = (tlb_spill_page_t*)phys_to_virt(page);
+        spill->next_phys = gather->spill_phys;
+        spill->count = 0;
+        gather->spill_phys = page;
+    }
+    spill->frames[spill->count++] = phys_frame;
+}
+
+// Takes a reference on every frame a table points to and withholds write access from its
+// entries, so the table can be referenced from one more place (a clone or a table copy)
+static void vmm_share_entries(pt_entry_t* table) {
+    for (int i = 0; i < 512; i++) {
+        if (!(table[i] & PTE_PRESENT)) {
+            continue;
+        }
+        pmm_frame_ref(table[i] & PTE_ADDR_MASK);
+        if (table[i] & PTE_WRITE) {
+            table[i] = (table[i] & ~PTE_WRITE) | PTE_COW;
+        }
+    }
+}
+
+// Makes the table that 'entry' points to private to this address space and gives write
+// access back to 'entry' if copy-on-write withheld it. Returns the table's virtual address.
+// Sharing only ever withholds write access one level at a time, so a table regaining it first
+// withholds it from its own entries; they are restored the same way on their first write.
+// 'entry' maps the (1 << shift)-byte region around 'virt'. Other CPUs may still walk the old
+// table or hold writable entries below it, so a changed region is added to 'gather', which
+// the caller flushes after dropping the space lock.
+static pt_entry_t* vmm_make_private(tlb_gather_t* gather, pt_entry_t* entry, uint64_t virt, int shift) {
+    uint64_t table_phys = *entry & PTE_ADDR_MASK;
+    pt_entry_t* table = (pt_entry_t*)phys_to_virt(table_phys);
+    bool changed = false;
+
+    if (pmm_frame_shared(table_phys)) {
+        uint64_t copy_phys = pmm_alloc_frame();
+        pt_entry_t* copy = (pt_entry_t*)phys_to_virt(copy_phys);
+        memcpy(copy, table, PAGE_SIZE);
+        vmm_share_entries(copy);
+        if (pmm_frame_unshare(table_phys)) {
+            *entry = copy_phys | (*entry & PTE_FLAGS_MASK);
+            table = copy;
+            changed = true;
+        } else {
+            // The other owner let go while we copied: the original is ours after all
+            for (int i = 0; i < 512; i++) {
+                if (copy[i] & PTE_PRESENT) {
+                    pmm_frame_unshare(copy[i] & PTE_ADDR_MASK);
+                }
+            }
+            pmm_free_frame(copy_phys);
+        }
+    }
+
+    if (*entry & PTE_COW) {
+        for (int i = 0; i < 512; i++) {
+            if ((table[i] & (PTE_PRESENT | PTE_WRITE)) == (PTE_PRESENT | PTE_WRITE)) {
+                table[i] = (table[i] & ~PTE_WRITE) | PTE_COW;
+            }
+        }
+        *entry = (*entry & ~PTE_COW) | PTE_WRITE;
+        changed = true;
+    }
+    if (changed) {
+        uint64_t span = 1ull << shift;
+        tlb_gather_add(gather, virt & ~(span - 1), span / PAGE_SIZE);
+    }
+    return table;
+}
+
 // Gets the next level page table address from an entry
 // Returns the *virtual* address of the next level table
-static inline pt_entry_t* vmm_get_next_level(pt_entry_t* entry, bool allocate_if_needed) {
+static inline pt_entry_t* vmm_get_next_level(tlb_gather_t* gather, pt_entry_t* entry, uint64_t virt, int shift,
+                                             bool allocate_if_needed) {
     if (!(*entry & PTE_PRESENT)) {
         if (!allocate_if_needed) {
             return NULL;
@@ -439,8 +1047,8 @@ static inline pt_entry_t* vmm_get_next_level(pt_entry_t* entry, bool allocate_if
         // kprintf("VMM: Allocated PT frame 0x%lx for entry %p\n", frame, entry);
         return (pt_entry_t*)phys_to_virt(frame); // Return virtual address
     }
-    // Table exists, return its virtual address
-    return (pt_entry_t*)phys_to_virt(*entry & PTE_ADDR_MASK);
+    // Table exists; a table shared with a cloned space is copied before anyone modifies it
+    return vmm_make_private(gather, entry, virt, shift);
 }
 
 // Maps a virtual page to a physical frame in the given address space
@@ -457,18 +1065,22 @@ bool vmm_map_page(address_space_t* space, void* virt_addr_in, uint64_t phys_addr
     uint64_t pd_index = (virt_addr >> 21) & 0x1FF;
     uint64_t pt_index = (virt_addr >> 12) & 0x1FF;
 
+    // Only copy-on-write tables on the path add to this; kernel tables are never shared
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
     spin_lock(&space->lock);
 
     // Get virtual address of PML4
     pt_entry_t* pml4 = (pt_entry_t*)phys_to_virt(space->pml4_phys);
 
     // Walk the tables, allocating if necessary
-    pt_entry_t* pdpt = vmm_get_next_level(&pml4[pml4_index], true);
-    if (!pdpt) { spin_unlock(&space->lock); return false; }
-    pt_entry_t* pd = vmm_get_next_level(&pdpt[pdpt_index], true);
-    if (!pd) { spin_unlock(&space->lock); return false; }
-    pt_entry_t* pt = vmm_get_next_level(&pd[pd_index], true);
-    if (!pt) { spin_unlock(&space->lock); return false; }
+    pt_entry_t* pdpt = vmm_get_next_level(&gather, &pml4[pml4_index], virt_addr, 39, true);
+    if (!pdpt) { spin_unlock(&space->lock); tlb_gather_flush(&gather); return false; }
+    pt_entry_t* pd = vmm_get_next_level(&gather, &pdpt[pdpt_index], virt_addr, 30, true);
+    if (!pd) { spin_unlock(&space->lock); tlb_gather_flush(&gather); return false; }
+    pt_entry_t* pt = vmm_get_next_level(&gather, &pd[pd_index], virt_addr, 21, true);
+    if (!pt) { spin_unlock(&space->lock); tlb_gather_flush(&gather); return false; }
 
     // Set the final Page Table Entry (PTE)
     pt_entry_t* pte = &pt[pt_index];
@@ -476,6 +1088,8 @@ bool vmm_map_page(address_space_t* space, void* virt_addr_in, uint64_t phys_addr
         // Page already mapped - this might be an error or require unmapping first
         kprintf("VMM: Warning - Remapping page at 0x%lx (old phys 0x%lx, new phys 0x%lx)\n",
                 virt_addr, *pte & PTE_ADDR_MASK, phys_addr);
+        // Other CPUs may still hold the old translation; the flush below reaches them
+        tlb_gather_add(&gather, virt_addr, 1);
         // Consider freeing the old frame if ownership is clear and this is not expected.
         // pmm_free_frame(*pte & PTE_ADDR_MASK); // Be careful with this!
     }
@@ -486,6 +1100,7 @@ bool vmm_map_page(address_space_t* space, void* virt_addr_in, uint64_t phys_addr
 
     // Invalidate TLB for this address (outside the lock)
     invlpg(virt_addr_in);
+    tlb_gather_flush(&gather);
 
     // kprintf("VMM: Mapped virt 0x%lx to phys 0x%lx flags 0x%lx\n", virt_addr, phys_addr, flags);
     return true;
@@ -501,10 +1116,13 @@ static bool vmm_is_table_empty(pt_entry_t* table_virt) {
     return true; // All entries are non-present
 }
 
-// Unmaps a virtual page and potentially frees parent tables if they become empty.
+// Unmaps a virtual page and releases parent tables that become empty, without invalidating
+// the TLB: the page is added to the gather and the emptied tables are freed by its flush.
 // Returns the physical frame that was mapped, or 0 if not mapped.
-// Does NOT free the returned physical frame. Caller must decide.
-uint64_t vmm_unmap_page(address_space_t* space, void* virt_addr_in) {
+// Does NOT free the returned physical frame. Caller must decide (tlb_gather_free_frame
+// defers it past the flush and only frees it once no clone shares it).
+uint64_t vmm_unmap_page_deferred(tlb_gather_t* gather, void* virt_addr_in) {
+    address_space_t* space = gather->space;
     uint64_t virt_addr = (uint64_t)virt_addr_in;
     ASSERT((virt_addr % PAGE_SIZE) == 0);
 
@@ -519,15 +1137,16 @@ uint64_t vmm_unmap_page(address_space_t* space, void* virt_addr_in) {
     pt_entry_t* pml4e = &pml4[pml4_index];
     if (!(*pml4e & PTE_PRESENT)) { spin_unlock(&space->lock); return 0; } // No PDPT
 
-    pt_entry_t* pdpt = (pt_entry_t*)phys_to_virt(*pml4e & PTE_ADDR_MASK);
+    // Tables shared with a cloned space are copied before they are modified
+    pt_entry_t* pdpt = vmm_make_private(gather, pml4e, virt_addr, 39);
     pt_entry_t* pdpte = &pdpt[pdpt_index];
     if (!(*pdpte & PTE_PRESENT)) { spin_unlock(&space->lock); return 0; } // No PD
 
-    pt_entry_t* pd = (pt_entry_t*)phys_to_virt(*pdpte & PTE_ADDR_MASK);
+    pt_entry_t* pd = vmm_make_private(gather, pdpte, virt_addr, 30);
     pt_entry_t* pde = &pd[pd_index];
     if (!(*pde & PTE_PRESENT)) { spin_unlock(&space->lock); return 0; } // No PT
 
-    pt_entry_t* pt = (pt_entry_t*)phys_to_virt(*pde & PTE_ADDR_MASK);
+    pt_entry_t* pt = vmm_make_private(gather, pde, virt_addr, 21);
     pt_entry_t* pte = &pt[pt_index];
     if (!(*pte & PTE_PRESENT)) { spin_unlock(&space->lock); return 0; } // Page wasn't mapped
 
@@ -535,28 +1154,27 @@ uint64_t vmm_unmap_page(address_space_t* space, void* virt_addr_in) {
     uint64_t phys_frame = *pte & PTE_ADDR_MASK;
     *pte = 0; // Clear the entry
 
-    // Invalidate TLB *after* modifying PTE but *before* potentially freeing tables
-    invlpg(virt_addr_in);
+    // Paging-structure caches may still point at the tables, so they are freed after the flush
+    tlb_gather_add(gather, virt_addr, 1);
 
-    // 2. Check if PT is now empty
+    // 2. Check if PT is now empty. Emptied tables are handed to the gather after the lock is
+    // dropped, since a full gather may flush and wait on other CPUs.
+    uint64_t pt_phys = 0, pd_phys = 0, pdpt_phys = 0;
     if (vmm_is_table_empty(pt)) {
-        uint64_t pt_phys = *pde & PTE_ADDR_MASK; // Get phys addr of PT from PDE
+        pt_phys = *pde & PTE_ADDR_MASK; // Get phys addr of PT from PDE
         *pde = 0; // Clear PDE pointing to the now-empty PT
-        pmm_free_frame(pt_phys); // Free the PT's frame
         // kprintf("VMM: Freed empty PT at phys 0x%lx\n", pt_phys);
 
         // 3. Check if PD is now empty
         if (vmm_is_table_empty(pd)) {
-            uint64_t pd_phys = *pdpte & PTE_ADDR_MASK; // Get phys addr of PD from PDPTE
+            pd_phys = *pdpte & PTE_ADDR_MASK; // Get phys addr of PD from PDPTE
             *pdpte = 0; // Clear PDPTE pointing to the now-empty PD
-            pmm_free_frame(pd_phys); // Free the PD's frame
             // kprintf("VMM: Freed empty PD at phys 0x%lx\n", pd_phys);
 
             // 4. Check if PDPT is now empty
             if (vmm_is_table_empty(pdpt)) {
-                uint64_t pdpt_phys = *pml4e & PTE_ADDR_MASK; // Get phys addr of PDPT from PML4E
+                pdpt_phys = *pml4e & PTE_ADDR_MASK; // Get phys addr of PDPT from PML4E
                 *pml4e = 0; // Clear PML4E pointing to the now-empty PDPT
-                pmm_free_frame(pdpt_phys); // Free the PDPT's frame
                 // kprintf("VMM: Freed empty PDPT at phys 0x%lx\n", pdpt_phys);
                 // PML4 is never freed this way
             }
@@ -565,85 +1183,505 @@ uint64_t vmm_unmap_page(address_space_t* space, void* virt_addr_in) {
 
     spin_unlock(&space->lock);
 
+    tlb_gather_free_frame(gather, pt_phys);
+    tlb_gather_free_frame(gather, pd_phys);
+    tlb_gather_free_frame(gather, pdpt_phys);
+
     // kprintf("VMM: Unmapped virt 0x%lx (was phys 0x%lx)\n", virt_addr, phys_frame);
     return phys_frame;
 }
 
 
-// Switches the current address space
-void vmm_switch_address_space(address_space_t* space) {
-    // In a real scenario, you might need to handle TLB shootdowns
-    // if switching between spaces that share kernel mappings modified
-    // by other cores. For a single core or simple kernel, just loading
-    // CR3 might suffice initially.
-    load_cr3(space->pml4_phys);
-    // kprintf("VMM: Switched address space to PML4 at 0x%lx\n", space->pml4_phys);
+// Unmaps a single page and invalidates it on every CPU that has the space loaded.
+// Returns the physical frame that was mapped, or 0 if not mapped. The frame is not freed.
+// For more than one page use vmm_unmap_page_deferred with a gather.
+uint64_t vmm_unmap_page(address_space_t* space, void* virt_addr_in) {
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+    uint64_t phys_frame = vmm_unmap_page_deferred(&gather, virt_addr_in);
+    tlb_gather_flush(&gather);
+    return phys_frame;
 }
 
-// --- Kernel Heap (kmalloc/kfree) - Simple Block Allocator ---
+// --- Copy-on-Write Address Space Cloning ---
 
-// Header size MUST be a multiple of alignment for the data pointer to be aligned
-#define KHEAP_MIN_ALIGNMENT 16 // x86_64 requires 16-byte alignment for many operations
-typedef struct kheap_block_header {
-    size_t size; // Size of the data area *following* this header
-    struct kheap_block_header* next_free;
-    uint64_t magic; // For detecting corruption
-    // Padding to make header size a multiple of KHEAP_MIN_ALIGNMENT (16)
-    // sizeof(size_t)=8, sizeof(ptr)=8, sizeof(magic)=8 => 24 bytes. Need 8 bytes padding.
-    uint64_t _padding;
-} kheap_block_header_t;
+// A clone shares the parent's user page tables instead of copying them: each user PML4 entry
+// takes a reference on its PDPT and loses write access (PTE_COW) in both spaces. Because
+// write access on x86 is the AND over all levels, the first write anywhere below faults, and
+// vmm_handle_page_fault copies exactly the tables on the faulting path and then the page.
+// Cloning therefore costs one PML4 frame, whatever the size of the parent.
+// The kernel half (PML4 entries 256-511) is the same in every space and is shared as is.
+// User mappings are assumed to be 4 KiB pages.
 
-#define KHEAP_MAGIC 0xDEADBEEFCAFEBABE
-#define KHEAP_HEADER_SIZE sizeof(kheap_block_header_t) // Now 32 bytes (multiple of 16)
+#define VMM_USER_PML4_ENTRIES 256
 
-static kheap_block_header_t* kheap_free_list = NULL;
-static uintptr_t kheap_current_break = KERNEL_HEAP_START;
-static uintptr_t kheap_max_break = KERNEL_HEAP_START + KERNEL_HEAP_MAX_SIZE;
-static spinlock_t kheap_lock = SPINLOCK_INIT;
+// Initializes 'child' as a copy-on-write clone of 'parent'
+void address_space_clone(address_space_t* parent, address_space_t* child) {
+    uint64_t pml4_phys = pmm_alloc_frame();
+    pt_entry_t* child_pml4 = (pt_entry_t*)phys_to_virt(pml4_phys);
+
+    spin_lock(&parent->lock);
+    pt_entry_t* parent_pml4 = (pt_entry_t*)phys_to_virt(parent->pml4_phys);
+    for (int i = 0; i < VMM_USER_PML4_ENTRIES; i++) {
+        if (!(parent_pml4[i] & PTE_PRESENT)) {
+            continue;
+        }
+        pmm_frame_ref(parent_pml4[i] & PTE_ADDR_MASK);
+        if (parent_pml4[i] & PTE_WRITE) {
+            parent_pml4[i] = (parent_pml4[i] & ~PTE_WRITE) | PTE_COW;
+        }
+        child_pml4[i] = parent_pml4[i];
+    }
+    for (int i = VMM_USER_PML4_ENTRIES; i < 512; i++) {
+        child_pml4[i] = parent_pml4[i];
+    }
+    spin_unlock(&parent->lock);
 
-// Adds a block to the free list (maintains sorted order by address)
-static void kheap_add_to_free_list(kheap_block_header_t* block) {
-    block->magic = KHEAP_MAGIC; // Set magic when freeing/adding
-    block->next_free = NULL;
+    child->pml4_phys = pml4_phys;
+    child->lock = (spinlock_t)SPINLOCK_INIT;
+    child->cpu_mask = 0;
 
-    // Ensure block address itself is aligned (should be if from pmm_alloc or split correctly)
-    ASSERT(((uintptr_t)block % KHEAP_MIN_ALIGNMENT) == 0);
+    // The parent just lost write access to all of its user memory
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, parent);
+    gather.flush_all = true;
+    tlb_gather_flush(&gather);
+}
 
-    if (kheap_free_list == NULL || block < kheap_free_list) {
-        block->next_free = kheap_free_list;
-        kheap_free_list = block;
-    } else {
-        kheap_block_header_t* current = kheap_free_list;
-        while (current->next_free != NULL && current->next_free < block) {
-            current = current->next_free;
+// Drops a reference on a page table at 'level' (3 = PDPT .. 1 = PT) and, if it was the last
+// one, on everything below it
+static void vmm_release_table(uint64_t table_phys, int level) {
+    if (pmm_frame_unshare(table_phys)) {
+        return;
+    }
+    pt_entry_t* table = (pt_entry_t*)phys_to_virt(table_phys);
+    for (int i = 0; i < 512; i++) {
+        if (!(table[i] & PTE_PRESENT)) {
+            continue;
+        }
+        if (level > 1) {
+            vmm_release_table(table[i] & PTE_ADDR_MASK, level - 1);
+        } else {
+            pmm_frame_unref(table[i] & PTE_ADDR_MASK);
         }
-        block->next_free = current->next_free;
-        current->next_free = block;
     }
+    pmm_free_frame(table_phys);
 }
 
-// Expands the kernel heap by mapping more pages
-static bool kheap_expand(size_t bytes_needed) {
-    uintptr_t old_break = kheap_current_break;
-    // Align the *needed size* up to page size for expansion request
-    uintptr_t expansion_size = align_up(bytes_needed, PAGE_SIZE);
-    uintptr_t new_break = old_break + expansion_size;
+// Releases the user half of an address space that no CPU has loaded any more, including
+// the frames only it still references
+void address_space_destroy(address_space_t* space) {
+    ASSERT(space != &kernel_address_space);
+    ASSERT(__atomic_load_n(&space->cpu_mask, __ATOMIC_ACQUIRE) == 0);
 
-    if (new_break > kheap_max_break) {
-        kprintf("KHeap: Expansion failed - exceeds max heap size (req 0x%lx, current 0x%lx, new 0x%lx > max 0x%lx)\n",
-                bytes_needed, old_break, new_break, kheap_max_break);
-        return false;
+    pt_entry_t* pml4 = (pt_entry_t*)phys_to_virt(space->pml4_phys);
+    for (int i = 0; i < VMM_USER_PML4_ENTRIES; i++) {
+        if (pml4[i] & PTE_PRESENT) {
+            vmm_release_table(pml4[i] & PTE_ADDR_MASK, 3);
+        }
     }
+    pmm_free_frame(space->pml4_phys);
+    space->pml4_phys = 0;
+}
 
-    // kprintf("KHeap: Expanding by 0x%lx bytes (from 0x%lx to 0x%lx)\n", expansion_size, old_break, new_break);
+static bool kheap_handle_page_fault(uint64_t fault_addr);
+
+// Resolves a page fault the memory manager caused on purpose: first touch of a demand-paged
+// heap page, or a write to a copy-on-write mapping in the current address space.
+// Returns true if the access can be retried, false if the fault is not ours.
+bool vmm_handle_page_fault(uint64_t fault_addr, uint64_t error_code) {
+    // Not-present faults can only be heap pages, and only the kernel may touch the heap
+    // (bit U clear); copy-on-write needs a write (bits P and W)
+    if (!(error_code & 0x1)) {
+        if (error_code & 0x4) {
+            return false;
+        }
+        return kheap_handle_page_fault(fault_addr);
+    }
+    if ((error_code & 0x3) != 0x3) {
+        return false;
+    }
+    uint64_t pml4_index = (fault_addr >> 39) & 0x1FF;
+    if (pml4_index >= VMM_USER_PML4_ENTRIES) {
+        return false;
+    }
+    uint32_t cpu = kmem_cpu_id();
+    address_space_t* space = (cpu < KMEM_MAX_CPUS) ? vmm_current_space[cpu] : NULL;
+    if (!space) {
+        return false;
+    }
+
+    // Other CPUs running this space may cache the old page or tables; they are invalidated
+    // after the lock is dropped, as address_space_clone does
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, space);
+
+    spin_lock(&space->lock);
+    pt_entry_t* pml4 = (pt_entry_t*)phys_to_virt(space->pml4_phys);
+    pt_entry_t* entry = &pml4[pml4_index];
+    int shift = 39;
+    // Walk down, making each table on the path private; stop at a hole or the leaf
+    bool handled = true;
+    while (shift > 12) {
+        if (!(*entry & PTE_PRESENT) || (!(*entry & PTE_WRITE) && !(*entry & PTE_COW))) {
+            handled = false; // Not mapped, or genuinely read-only
+            break;
+        }
+        pt_entry_t* table = vmm_make_private(&gather, entry, fault_addr, shift);
+        shift -= 9;
+        entry = &table[(fault_addr >> shift) & 0x1FF];
+    }
+
+    if (!handled || !(*entry & PTE_PRESENT)) {
+        handled = false; // Tables made private on the way down stay private
+    } else if (*entry & PTE_COW) {
+        uint64_t frame = *entry & PTE_ADDR_MASK;
+        uint64_t flags = (*entry & PTE_FLAGS_MASK & ~PTE_COW) | PTE_WRITE;
+        if (pmm_frame_shared(frame)) {
+            uint64_t copy = pmm_alloc_frame();
+            memcpy(phys_to_virt(copy), phys_to_virt(frame), PAGE_SIZE);
+            if (pmm_frame_unshare(frame)) {
+                frame = copy;
+            } else {
+                pmm_free_frame(copy); // Last other owner went away while we copied
+            }
+        }
+        *entry = frame | flags;
+        tlb_gather_add(&gather, fault_addr & ~(uint64_t)(PAGE_SIZE - 1), 1);
+    } else if (!(*entry & PTE_WRITE)) {
+        handled = false; // Read-only mapping
+    } else {
+        // Another CPU already resolved it and this CPU had a stale TLB entry
+        invlpg((void*)fault_addr);
+    }
+    spin_unlock(&space->lock);
+
+    tlb_gather_flush(&gather);
+    return handled;
+}
+
+// Checks that the kernel can write every byte of [addr, addr + size) in the current address
+// space without an unresolvable fault: each page is a present user page, writable or
+// copy-on-write (the write fault breaks the sharing), behind tables that allow the write.
+// For system calls that write to user memory; a fault there would never be fixed up. It is a
+// snapshot: the caller must not drop its own guarantees that the range stays mapped.
+bool vmm_user_range_writable(uint64_t addr, uint64_t size) {
+    if (size == 0) {
+        return true;
+    }
+    uint64_t end = addr + size;
+    if (end < addr || ((end - 1) >> 39) >= VMM_USER_PML4_ENTRIES) {
+        return false;
+    }
+    uint32_t cpu = kmem_cpu_id();
+    address_space_t* space = (cpu < KMEM_MAX_CPUS) ? vmm_current_space[cpu] : NULL;
+    if (!space) {
+        return false;
+    }
+
+    bool writable = true;
+    spin_lock(&space->lock);
+    pt_entry_t* pml4 = (pt_entry_t*)phys_to_virt(space->pml4_phys);
+    for (uint64_t page = addr & ~(uint64_t)(PAGE_SIZE - 1); writable && page < end; page += PAGE_SIZE) {
+        pt_entry_t* entry = &pml4[(page >> 39) & 0x1FF];
+        for (int shift = 39;; shift -= 9) {
+            // Tables carry no user bit here; only the leaf has to be a user page
+            uint64_t need = (shift == 12) ? (PTE_PRESENT | PTE_USER) : PTE_PRESENT;
+            if ((*entry & need) != need || !(*entry & (PTE_WRITE | PTE_COW))) {
+                writable = false;
+                break;
+            }
+            if (shift == 12) {
+                break;
+            }
+            pt_entry_t* table = (pt_entry_t*)phys_to_virt(*entry & PTE_ADDR_MASK);
+            entry = &table[(page >> (shift - 9)) & 0x1FF];
+        }
+    }
+    spin_unlock(&space->lock);
+    return writable;
+}
+
+// Called by each CPU as it comes online, after it is reachable by the shootdown IPI: joins
+// the kernel address space's mask and drops whatever it cached before that
+void vmm_cpu_online() {
+    uint64_t flags = irq_save();
+    uint32_t cpu = kmem_cpu_id();
+    if (cpu < KMEM_MAX_CPUS) {
+        __atomic_fetch_or(&kernel_address_space.cpu_mask, 1ull << cpu, __ATOMIC_RELEASE);
+        if (!vmm_current_space[cpu]) {
+            vmm_current_space[cpu] = &kernel_address_space;
+        }
+    }
+    tlb_flush_all_local();
+    irq_restore(flags);
+}
+
+// Switches the current address space
+void vmm_switch_address_space(address_space_t* space) {
+    // cpu_mask tracks who may cache the space's entries, so shootdowns reach exactly those
+    // CPUs. Every CPU caches kernel mappings, so it joins the kernel mask for good.
+    uint64_t flags = irq_save();
+    uint32_t cpu = kmem_cpu_id();
+    if (cpu < KMEM_MAX_CPUS) {
+        uint64_t bit = 1ull << cpu;
+        address_space_t* previous = vmm_current_space[cpu];
+        __atomic_fetch_or(&kernel_address_space.cpu_mask, bit, __ATOMIC_RELEASE);
+        __atomic_fetch_or(&space->cpu_mask, bit, __ATOMIC_RELEASE);
+        if (previous && previous != space && previous != &kernel_address_space) {
+            __atomic_fetch_and(&previous->cpu_mask, ~bit, __ATOMIC_RELEASE);
+        }
+        vmm_current_space[cpu] = space;
+    }
+    load_cr3(space->pml4_phys);
+    irq_restore(flags);
+    // kprintf("VMM: Switched address space to PML4 at 0x%lx\n", space->pml4_phys);
+}
+
+// --- Kernel Heap (kmalloc/kfree) - Boundary-Tag Block Allocator ---
+
+// Every block is laid out as [header][data][footer]. The footer mirrors the header's size and
+// magic, so a block being freed finds its left neighbour in O(1) and the right neighbour starts
+// right after its footer. Free blocks are kept in two-level segregated bins (TLSF): the first
+// level is the power of two of the data size, the second splits that range into KHEAP_SL_COUNT
+// linear steps. Two bitmaps locate a non-empty bin with a couple of bit scans, so both kmalloc
+// and kfree are O(1) regardless of how many blocks are free.
+
+// Header size MUST be a multiple of alignment for the data pointer to be aligned
+#define KHEAP_MIN_ALIGNMENT 16 // x86_64 requires 16-byte alignment for many operations
+typedef struct kheap_block_header {
+    size_t size; // Size of the data area between this header and the footer
+    struct kheap_block_header* next_free; // Bin links, only valid while the block is free
+    struct kheap_block_header* prev_free;
+    uint64_t magic; // KHEAP_MAGIC while free, ~KHEAP_MAGIC while allocated
+} kheap_block_header_t;
+
+typedef struct {
+    size_t size; // Copy of the header's size
+    uint64_t magic; // Copy of the header's magic
+} kheap_block_footer_t;
+
+#define KHEAP_MAGIC 0xDEADBEEFCAFEBABE
+#define KHEAP_HEADER_SIZE sizeof(kheap_block_header_t) // 32 bytes (multiple of 16)
+#define KHEAP_FOOTER_SIZE sizeof(kheap_block_footer_t) // 16 bytes (multiple of 16)
+#define KHEAP_BLOCK_OVERHEAD (KHEAP_HEADER_SIZE + KHEAP_FOOTER_SIZE)
+
+// TLSF bin geometry
+#define KHEAP_SL_LOG2 4
+#define KHEAP_SL_COUNT (1u << KHEAP_SL_LOG2) // Second-level bins per power of two
+#define KHEAP_FL_SHIFT 4 // log2(KHEAP_MIN_ALIGNMENT): first level 0 holds sizes 16..31
+#define KHEAP_FL_COUNT 24 // Enough for any block inside KERNEL_HEAP_MAX_SIZE
+
+#define KHEAP_MAX_PAGES (KERNEL_HEAP_MAX_SIZE / PAGE_SIZE)
+
+// Trim policy: page-aligned free space is handed back to the PMM only once a free block spans at
+// least KHEAP_TRIM_THRESHOLD of it, and a trimmed tail keeps KHEAP_TRIM_KEEP mapped. The gap
+// between the two keeps a workload that hovers around one size from unmapping and remapping.
+#define KHEAP_TRIM_THRESHOLD (PAGE_SIZE * 64) // 256 KiB
+#define KHEAP_TRIM_KEEP (PAGE_SIZE * 16) // 64 KiB
+
+static kheap_block_header_t* kheap_bins[KHEAP_FL_COUNT][KHEAP_SL_COUNT];
+static uint32_t kheap_fl_bitmap = 0; // Bit f set if any kheap_bins[f][*] is non-empty
+static uint32_t kheap_sl_bitmap[KHEAP_FL_COUNT]; // Bit s set if kheap_bins[f][s] is non-empty
+static uintptr_t kheap_current_break = KERNEL_HEAP_START;
+static uintptr_t kheap_max_break = KERNEL_HEAP_START + KERNEL_HEAP_MAX_SIZE;
+static spinlock_t kheap_lock = SPINLOCK_INIT;
+
+// For every heap page: 0 if it belongs to the block allocator, class index + 1 if the slab layer owns it
+static uint8_t kslab_page_class[KHEAP_MAX_PAGES];
+
+// Heap pages below the break with no frame behind them: pages inside free blocks whose frames
+// were returned to the PMM (pages holding a block's header or footer are never released, so
+// boundary tags stay readable) and, in reserve-only mode, pages nobody has touched yet.
+// Bits are updated atomically because the #PF handler claims them without kheap_lock.
+static uint64_t kheap_released_bitmap[KHEAP_MAX_PAGES / 64];
+static uint64_t kheap_released_pages = 0;
+
+// Reserve-only mode: kheap_expand just moves the break and the #PF handler backs each page on
+// first touch, so a large allocation only costs frames for the parts actually used.
+// Must not be enabled before the #PF handler is installed.
+static bool kheap_reserve_only = false;
+static uint64_t kheap_demand_faults = 0;
+
+// Pre-zeroed frames for the demand fault path, topped up from the idle loop
+#define KHEAP_ZERO_POOL_SIZE 64
+#define KHEAP_ZERO_POOL_MIN_FREE 1024 // Refilling stops when the PMM gets this low
+static uint64_t kheap_zero_pool[KHEAP_ZERO_POOL_SIZE];
+static uint32_t kheap_zero_pool_count = 0;
+static spinlock_t kheap_zero_pool_lock = SPINLOCK_INIT;
+
+static inline uint64_t kheap_page_index(uintptr_t addr) {
+    return (addr - KERNEL_HEAP_START) / PAGE_SIZE;
+}
+
+static inline bool kheap_page_unbacked(uintptr_t addr) {
+    uint64_t page = kheap_page_index(addr);
+    return __atomic_load_n(&kheap_released_bitmap[page / 64], __ATOMIC_ACQUIRE) & (1ull << (page % 64));
+}
+
+static inline void kheap_mark_unbacked(uintptr_t addr) {
+    uint64_t page = kheap_page_index(addr);
+    __atomic_fetch_or(&kheap_released_bitmap[page / 64], 1ull << (page % 64), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&kheap_released_pages, 1, __ATOMIC_RELAXED);
+}
+
+// Clears the page's bit; returns true if it was set, i.e. the caller now has to back it
+static inline bool kheap_claim_unbacked(uintptr_t addr) {
+    uint64_t page = kheap_page_index(addr);
+    uint64_t bit = 1ull << (page % 64);
+    if (!(__atomic_fetch_and(&kheap_released_bitmap[page / 64], ~bit, __ATOMIC_ACQ_REL) & bit)) {
+        return false;
+    }
+    __atomic_sub_fetch(&kheap_released_pages, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static inline bool kheap_is_slab_addr(uintptr_t addr) {
+    return kslab_page_class[(addr - KERNEL_HEAP_START) / PAGE_SIZE] != 0;
+}
+
+static inline kheap_block_footer_t* kheap_footer(kheap_block_header_t* block) {
+    return (kheap_block_footer_t*)((uintptr_t)block + KHEAP_HEADER_SIZE + block->size);
+}
+
+// Writes size and magic into both boundary tags of a block
+static inline void kheap_write_tags(kheap_block_header_t* block, uint64_t magic) {
+    kheap_block_footer_t* footer = kheap_footer(block);
+    block->magic = magic;
+    footer->size = block->size;
+    footer->magic = magic;
+}
+
+// Returns the block whose footer ends exactly at addr, or NULL if addr is the heap start
+// or the preceding memory belongs to the slab layer
+static kheap_block_header_t* kheap_block_ending_at(uintptr_t addr) {
+    if (addr <= KERNEL_HEAP_START || kheap_is_slab_addr(addr - 1)) {
+        return NULL;
+    }
+    kheap_block_footer_t* footer = (kheap_block_footer_t*)(addr - KHEAP_FOOTER_SIZE);
+    ASSERT(footer->magic == KHEAP_MAGIC || footer->magic == ~KHEAP_MAGIC);
+    kheap_block_header_t* block = (kheap_block_header_t*)(addr - KHEAP_FOOTER_SIZE - footer->size - KHEAP_HEADER_SIZE);
+    ASSERT(block->magic == footer->magic && block->size == footer->size);
+    return block;
+}
+
+// Returns the block physically following this one, or NULL at the break or before slab memory
+static kheap_block_header_t* kheap_next_block(kheap_block_header_t* block) {
+    uintptr_t addr = (uintptr_t)kheap_footer(block) + KHEAP_FOOTER_SIZE;
+    if (addr >= kheap_current_break || kheap_is_slab_addr(addr)) {
+        return NULL;
+    }
+    kheap_block_header_t* next = (kheap_block_header_t*)addr;
+    ASSERT(next->magic == KHEAP_MAGIC || next->magic == ~KHEAP_MAGIC);
+    return next;
+}
+
+// Maps a data size to the bin that holds blocks of that size
+static inline void kheap_bin_index(size_t size, uint32_t* fl, uint32_t* sl) {
+    uint32_t msb = 63 - __builtin_clzll(size);
+    *fl = msb - KHEAP_FL_SHIFT;
+    *sl = (uint32_t)(size >> (msb - KHEAP_SL_LOG2)) & (KHEAP_SL_COUNT - 1);
+    ASSERT(*fl < KHEAP_FL_COUNT);
+}
+
+static void kheap_bin_insert(kheap_block_header_t* block) {
+    uint32_t fl, sl;
+    kheap_bin_index(block->size, &fl, &sl);
+    block->prev_free = NULL;
+    block->next_free = kheap_bins[fl][sl];
+    if (block->next_free) {
+        block->next_free->prev_free = block;
+    }
+    kheap_bins[fl][sl] = block;
+    kheap_fl_bitmap |= 1u << fl;
+    kheap_sl_bitmap[fl] |= 1u << sl;
+}
+
+static void kheap_bin_remove(kheap_block_header_t* block) {
+    uint32_t fl, sl;
+    kheap_bin_index(block->size, &fl, &sl);
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        ASSERT(kheap_bins[fl][sl] == block);
+        kheap_bins[fl][sl] = block->next_free;
+        if (!kheap_bins[fl][sl]) {
+            kheap_sl_bitmap[fl] &= ~(1u << sl);
+            if (!kheap_sl_bitmap[fl]) {
+                kheap_fl_bitmap &= ~(1u << fl);
+            }
+        }
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+}
+
+// Finds a free block with at least 'size' data bytes. The size is rounded up to the next bin
+// boundary first, so any block in the chosen bin fits without scanning the bin.
+static kheap_block_header_t* kheap_bin_find(size_t size) {
+    uint32_t msb = 63 - __builtin_clzll(size);
+    size_t rounded = size + ((1ull << (msb - KHEAP_SL_LOG2)) - 1);
+    uint32_t fl, sl;
+    kheap_bin_index(rounded, &fl, &sl);
+
+    uint32_t sl_map = kheap_sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = (fl + 1 < 32) ? (kheap_fl_bitmap & (~0u << (fl + 1))) : 0;
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = __builtin_ctz(fl_map);
+        sl_map = kheap_sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+    return kheap_bins[fl][sl];
+}
+
+// Unmaps heap pages in [start, end) into the gather; their frames go back to the PMM when the
+// caller flushes it after dropping kheap_lock. Room for them must have been reserved.
+static void kheap_release_pages(tlb_gather_t* gather, uintptr_t start, uintptr_t end) {
+    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE) {
+        tlb_gather_free_frame(gather, vmm_unmap_page_deferred(gather, (void*)addr));
+    }
+}
+
+// Expands the kernel heap by mapping more pages. A failed expansion is rolled back into
+// 'gather', which the caller flushes once kheap_lock is dropped.
+static bool kheap_expand(tlb_gather_t* gather, size_t bytes_needed) {
+    uintptr_t old_break = kheap_current_break;
+    // Align the *needed size* up to page size for expansion request
+    uintptr_t expansion_size = align_up(bytes_needed, PAGE_SIZE);
+    uintptr_t new_break = old_break + expansion_size;
+
+    if (new_break > kheap_max_break) {
+        kprintf("KHeap: Expansion failed - exceeds max heap size (req 0x%lx, current 0x%lx, new 0x%lx > max 0x%lx)\n",
+                bytes_needed, old_break, new_break, kheap_max_break);
+        return false;
+    }
+
+    // kprintf("KHeap: Expanding by 0x%lx bytes (from 0x%lx to 0x%lx)\n", expansion_size, old_break, new_break);
+
+    if (kheap_reserve_only) {
+        for (uintptr_t addr = old_break; addr < new_break; addr += PAGE_SIZE) {
+            kheap_mark_unbacked(addr);
+        }
+        __atomic_store_n(&kheap_current_break, new_break, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Room for a rollback, so it never has to flush under kheap_lock
+    if (!tlb_gather_reserve(gather, tlb_gather_frames_for(expansion_size / PAGE_SIZE, expansion_size / PAGE_SIZE))) {
+        kprintf("KHeap: Expansion failed - out of memory\n");
+        return false;
+    }
 
     for (uintptr_t addr = old_break; addr < new_break; addr += PAGE_SIZE) {
         uint64_t phys_frame = pmm_alloc_frame();
         if (phys_frame == 0) {
             kprintf("KHeap: Expansion failed - PMM out of memory during expansion\n");
-            // Rollback? Difficult. Panic or return failure.
-            // For simplicity, we don't rollback mappings here. A real kernel might try.
-            kheap_current_break = addr; // Only update break to where we successfully mapped
+            // Roll back so the break never ends in pages that no block describes
+            kheap_release_pages(gather, old_break, addr);
             return false;
         }
 
@@ -651,150 +1689,622 @@ static bool kheap_expand(size_t bytes_needed) {
         if (!vmm_map_page(&kernel_address_space, (void*)addr, phys_frame, PTE_WRITE | PTE_NX)) {
             kprintf("KHeap: Expansion failed - VMM mapping error for virt 0x%lx -> phys 0x%lx\n", addr, phys_frame);
             pmm_free_frame(phys_frame); // Free the frame we couldn't map
-            // Rollback? Difficult.
-             kheap_current_break = addr; // Only update break to where we successfully mapped
+            kheap_release_pages(gather, old_break, addr);
             return false;
         }
     }
-    kheap_current_break = new_break; // Expansion successful
+    __atomic_store_n(&kheap_current_break, new_break, __ATOMIC_RELEASE); // Expansion successful
     return true;
 }
 
-// Coalesces adjacent free blocks
-static void kheap_coalesce_free_list() {
-    kheap_block_header_t* current = kheap_free_list;
-    while (current && current->next_free) {
-        ASSERT(current->magic == KHEAP_MAGIC);
-        ASSERT(current->next_free->magic == KHEAP_MAGIC);
-
-        // Check if the end of the current block's data area touches the next free block's header
-        if ((uintptr_t)current + KHEAP_HEADER_SIZE + current->size == (uintptr_t)current->next_free) {
-            // Coalesce
-            current->size += KHEAP_HEADER_SIZE + current->next_free->size; // Add size of next header + its data
-            current->next_free = current->next_free->next_free; // Remove next block from list
-            // Stay on current block to check if it can coalesce further
-            // kprintf("KHeap: Coalesced block at %p, new data size %zu\n", current, current->size);
-        } else {
-            current = current->next_free; // Move to next
+// Grows the heap so that a free block of at least 'size' data bytes ends at the new break.
+// A free block already at the end of the heap is extended instead of left behind.
+// The returned block is not in any bin.
+static kheap_block_header_t* kheap_grow_block(tlb_gather_t* gather, size_t size) {
+    uintptr_t old_break = kheap_current_break;
+    kheap_block_header_t* tail = kheap_block_ending_at(old_break);
+    size_t reusable = 0;
+    if (tail && tail->magic == KHEAP_MAGIC) {
+        if (tail->size >= size) {
+            // Fits already; bin rounding just made kheap_bin_find skip it
+            kheap_bin_remove(tail);
+            return tail;
         }
+        reusable = KHEAP_BLOCK_OVERHEAD + tail->size;
+    }
+
+    if (!kheap_expand(gather, KHEAP_BLOCK_OVERHEAD + size - reusable)) {
+        return NULL;
+    }
+
+    kheap_block_header_t* block;
+    if (reusable) {
+        kheap_bin_remove(tail);
+        block = tail;
+        block->size += kheap_current_break - old_break;
+    } else {
+        block = (kheap_block_header_t*)old_break;
+        block->size = kheap_current_break - old_break - KHEAP_BLOCK_OVERHEAD;
     }
+    kheap_write_tags(block, KHEAP_MAGIC);
+    return block;
 }
 
+// Maps fresh frames back into any released pages in [start, end).
+// In reserve-only mode this is left to the #PF handler.
+static bool kheap_populate(uintptr_t start, uintptr_t end) {
+    if (kheap_reserve_only || __atomic_load_n(&kheap_released_pages, __ATOMIC_RELAXED) == 0) {
+        return true;
+    }
+    for (uintptr_t addr = align_down(start, PAGE_SIZE); addr < end; addr += PAGE_SIZE) {
+        if (!kheap_claim_unbacked(addr)) {
+            continue;
+        }
+        uint64_t phys_frame = pmm_alloc_frame();
+        if (!vmm_map_page(&kernel_address_space, (void*)addr, phys_frame, PTE_WRITE | PTE_NX)) {
+            kprintf("KHeap: Repopulate failed - VMM mapping error for virt 0x%lx\n", addr);
+            pmm_free_frame(phys_frame);
+            kheap_mark_unbacked(addr);
+            return false;
+        }
+    }
+    return true;
+}
 
-// Allocate memory from kernel heap
-void* kmalloc(size_t size) {
-    if (size == 0) {
+// Takes a zeroed frame for the demand fault path, from the pool if it has one
+static uint64_t kheap_take_zeroed_frame() {
+    uint64_t frame = 0;
+    uint64_t flags = irq_save();
+    spin_lock(&kheap_zero_pool_lock);
+    if (kheap_zero_pool_count > 0) {
+        frame = kheap_zero_pool[--kheap_zero_pool_count];
+    }
+    spin_unlock(&kheap_zero_pool_lock);
+    irq_restore(flags);
+    return frame ? frame : pmm_alloc_frame(); // pmm_alloc_frame zeroes as well, just on this path
+}
+
+// Backs a heap page on its first touch. Runs from the #PF handler without kheap_lock (the
+// faulting code may hold it): the page's bit is claimed atomically, so exactly one CPU maps it.
+static bool kheap_handle_page_fault(uint64_t fault_addr) {
+    if (fault_addr < KERNEL_HEAP_START || fault_addr >= __atomic_load_n(&kheap_current_break, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    uintptr_t addr = align_down(fault_addr, PAGE_SIZE);
+    if (!kheap_claim_unbacked(addr)) {
+        // Every page below the break is mapped or marked, so another CPU is mapping this one
+        // right now (or already has and our TLB entry was stale): retrying is enough.
+        return true;
+    }
+    uint64_t phys_frame = kheap_take_zeroed_frame();
+    if (!vmm_map_page(&kernel_address_space, (void*)addr, phys_frame, PTE_WRITE | PTE_NX)) {
+        pmm_free_frame(phys_frame);
+        kheap_mark_unbacked(addr);
+        return false;
+    }
+    __atomic_add_fetch(&kheap_demand_faults, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Bytes in the page-aligned interior of a block (between the pages holding its tags)
+static inline size_t kheap_interior_span(kheap_block_header_t* block) {
+    uintptr_t start = align_up((uintptr_t)block + KHEAP_HEADER_SIZE, PAGE_SIZE);
+    uintptr_t end = align_down((uintptr_t)kheap_footer(block), PAGE_SIZE);
+    return end > start ? end - start : 0;
+}
+
+// Unmaps the page-aligned interior of a free block into 'gather', if the interior spans at
+// least min_span bytes. Only pages in [lo, hi) are looked at. The frames go back to the PMM
+// when the caller flushes the gather after dropping kheap_lock.
+// Returns the number of pages released.
+static uint64_t kheap_release_range(tlb_gather_t* gather, kheap_block_header_t* block, size_t min_span,
+                                    uintptr_t lo, uintptr_t hi) {
+    if (kheap_interior_span(block) < min_span) {
+        return 0;
+    }
+    uintptr_t start = align_up((uintptr_t)block + KHEAP_HEADER_SIZE, PAGE_SIZE);
+    uintptr_t end = align_down((uintptr_t)kheap_footer(block), PAGE_SIZE);
+    if (lo > start) {
+        start = align_down(lo, PAGE_SIZE);
+    }
+    if (hi < end) {
+        end = align_up(hi, PAGE_SIZE);
+    }
+    uint64_t released = 0;
+    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE) {
+        if (kheap_page_unbacked(addr)) {
+            continue;
+        }
+        if (!tlb_gather_reserve(gather, tlb_gather_frames_for(1, 1))) {
+            break; // No memory to hold the frames; the rest stays mapped for now
+        }
+        uint64_t phys_frame = vmm_unmap_page_deferred(gather, (void*)addr);
+        ASSERT(phys_frame != 0);
+        tlb_gather_free_frame(gather, phys_frame);
+        kheap_mark_unbacked(addr);
+        released++;
+    }
+    return released;
+}
+
+static uint64_t kheap_release_interior(tlb_gather_t* gather, kheap_block_header_t* block, size_t min_span) {
+    return kheap_release_range(gather, block, min_span, 0, UINTPTR_MAX);
+}
+
+// Lowers the break when the free block at the end of the heap has at least 'threshold' bytes
+// of page-aligned space beyond 'keep'. The block must be free and in its bin. Released frames
+// are left in 'gather' for the caller to flush after dropping kheap_lock.
+// Returns the number of pages released.
+static uint64_t kheap_trim_tail(tlb_gather_t* gather, kheap_block_header_t* block, size_t keep, size_t threshold) {
+    uintptr_t new_break = align_up((uintptr_t)block + KHEAP_BLOCK_OVERHEAD + KHEAP_MIN_ALIGNMENT + keep, PAGE_SIZE);
+    if (new_break >= kheap_current_break || kheap_current_break - new_break < threshold) {
+        return 0;
+    }
+    uint64_t backed = 0;
+    for (uintptr_t addr = new_break; addr < kheap_current_break; addr += PAGE_SIZE) {
+        backed += !kheap_page_unbacked(addr);
+    }
+    if (!tlb_gather_reserve(gather, tlb_gather_frames_for(backed, (kheap_current_break - new_break) / PAGE_SIZE))) {
+        return 0;
+    }
+    // The block's new footer lands in the last page that stays mapped
+    if (!kheap_populate(new_break - KHEAP_FOOTER_SIZE, new_break)) {
+        return 0;
+    }
+
+    uint64_t released = 0;
+    for (uintptr_t addr = new_break; addr < kheap_current_break; addr += PAGE_SIZE) {
+        if (kheap_claim_unbacked(addr)) {
+            // Frame already returned (or never taken); the page just leaves the heap
+            continue;
+        }
+        uint64_t phys_frame = vmm_unmap_page_deferred(gather, (void*)addr);
+        ASSERT(phys_frame != 0);
+        tlb_gather_free_frame(gather, phys_frame);
+        released++;
+    }
+
+    kheap_bin_remove(block);
+    block->size = new_break - (uintptr_t)block - KHEAP_BLOCK_OVERHEAD;
+    __atomic_store_n(&kheap_current_break, new_break, __ATOMIC_RELEASE);
+    kheap_write_tags(block, KHEAP_MAGIC);
+    kheap_bin_insert(block);
+    return released;
+}
+
+// Allocate memory from the block allocator (used for sizes above the slab classes)
+static void* kheap_alloc_large(size_t size) {
+    if (size > KERNEL_HEAP_MAX_SIZE) {
+        kprintf("KHeap: Allocation failed - request 0x%lx exceeds max heap size\n", (uint64_t)size);
         return NULL;
     }
 
     // 1. Align desired data size
     size_t aligned_data_size = align_up(size, KHEAP_MIN_ALIGNMENT);
-    // 2. Calculate total block size needed (header + aligned data)
-    size_t total_block_size_needed = KHEAP_HEADER_SIZE + aligned_data_size;
 
+    tlb_gather_t gather; // Only a rolled-back expansion puts anything here
+    tlb_gather_init(&gather, &kernel_address_space);
     spin_lock(&kheap_lock);
 
-    // 3. Search free list (first fit)
-    kheap_block_header_t* current = kheap_free_list;
-    kheap_block_header_t* prev = NULL;
-    while (current) {
-        ASSERT(current->magic == KHEAP_MAGIC); // Check for corruption
-
-        // Does this free block have enough space for the *aligned data*?
-        if (current->size >= aligned_data_size) {
-            // Found a suitable block
-            // Remove from free list
-            if (prev) {
-                prev->next_free = current->next_free;
-            } else {
-                kheap_free_list = current->next_free;
-            }
-
-            // Check if we can split the block.
-            // Can we fit the requested data AND a new header AND minimum aligned data block?
-            size_t remaining_size = current->size - aligned_data_size;
-            if (remaining_size >= KHEAP_HEADER_SIZE + KHEAP_MIN_ALIGNMENT) {
-                // Yes, split the block
-                // Calculate address of the new free block's header
-                kheap_block_header_t* split_free = (kheap_block_header_t*)((uintptr_t)current + KHEAP_HEADER_SIZE + aligned_data_size);
-                split_free->size = remaining_size - KHEAP_HEADER_SIZE; // Data size for the new free block
-                // Adjust size of the allocated block (data area size)
-                current->size = aligned_data_size;
-                // Add the split remainder back to the free list
-                kheap_add_to_free_list(split_free); // Handles magic, sorting
-                // kprintf("KHeap: Split block %p (orig data %zu) -> alloc %zu, free %p (data %zu)\n",
-                //         current, current->size + remaining_size, current->size, split_free, split_free->size);
-            }
-            // Else: Use the whole block. current->size is already >= aligned_data_size.
-
-            current->magic = ~KHEAP_MAGIC; // Mark as allocated (simple inversion)
+    // 2. Take a block from the first non-empty bin that is guaranteed to fit, or grow the heap
+    kheap_block_header_t* block = kheap_bin_find(aligned_data_size);
+    if (block) {
+        ASSERT(block->magic == KHEAP_MAGIC); // Check for corruption
+        kheap_bin_remove(block);
+    } else {
+        block = kheap_grow_block(&gather, aligned_data_size);
+        if (!block) {
+            // Expansion failed (already printed error in kheap_expand)
             spin_unlock(&kheap_lock);
-
-            void* data_ptr = (void*)((uintptr_t)current + KHEAP_HEADER_SIZE);
-            // Verify alignment of returned pointer
-            ASSERT(((uintptr_t)data_ptr % KHEAP_MIN_ALIGNMENT) == 0);
-            // kprintf("KHeap: Allocated %zu bytes (aligned %zu) at %p (header %p)\n", size, aligned_data_size, data_ptr, current);
-            return data_ptr;
+            tlb_gather_flush(&gather);
+            kprintf("KHeap: Allocation failed - cannot expand heap for 0x%lx bytes\n", (uint64_t)size);
+            return NULL; // Out of memory
         }
-        prev = current;
-        current = current->next_free;
     }
+    ASSERT(block->size >= aligned_data_size);
 
-    // 4. No suitable block in free list, expand the heap
-    // We need enough space for the total block size (header + aligned data)
-    uintptr_t expansion_start = kheap_current_break;
-    if (!kheap_expand(total_block_size_needed)) {
-        // Expansion failed (already printed error in kheap_expand)
+    // 3. Split off the remainder if it can hold another block with a minimal data area
+    size_t remaining_size = block->size - aligned_data_size;
+    bool split = remaining_size >= KHEAP_BLOCK_OVERHEAD + KHEAP_MIN_ALIGNMENT;
+
+    // Trimmed pages inside the block (and under the remainder's new header) must be mapped again
+    uintptr_t used_end = (uintptr_t)block + KHEAP_BLOCK_OVERHEAD + aligned_data_size + (split ? KHEAP_HEADER_SIZE : 0);
+    if (!kheap_populate((uintptr_t)block, used_end)) {
+        kheap_bin_insert(block);
         spin_unlock(&kheap_lock);
-        kprintf("KHeap: Allocation failed - cannot expand heap for %zu bytes\n", size);
-        return NULL; // Out of memory
+        tlb_gather_flush(&gather);
+        kprintf("KHeap: Allocation failed - cannot repopulate heap for 0x%lx bytes\n", (uint64_t)size);
+        return NULL;
     }
 
-    // Expansion successful, kheap_current_break is updated.
-    // The newly expanded space starts at expansion_start and has size (kheap_current_break - expansion_start).
-    size_t new_region_size = kheap_current_break - expansion_start;
-    ASSERT(new_region_size >= total_block_size_needed);
+    if (split) {
+        kheap_block_header_t* split_free = (kheap_block_header_t*)((uintptr_t)block + KHEAP_BLOCK_OVERHEAD + aligned_data_size);
+        split_free->size = remaining_size - KHEAP_BLOCK_OVERHEAD;
+        kheap_write_tags(split_free, KHEAP_MAGIC);
+        kheap_bin_insert(split_free);
+        block->size = aligned_data_size;
+    }
+
+    kheap_write_tags(block, ~KHEAP_MAGIC); // Mark as allocated (simple inversion)
+    spin_unlock(&kheap_lock);
+    tlb_gather_flush(&gather); // Frees the spill pages a successful expansion reserved
 
-    // Create a new block header at the beginning of the expanded space
-    kheap_block_header_t* new_block = (kheap_block_header_t*)expansion_start;
-    new_block->size = new_region_size - KHEAP_HEADER_SIZE; // Data size for the entire new region
+    void* data_ptr = (void*)((uintptr_t)block + KHEAP_HEADER_SIZE);
+    // Verify alignment of returned pointer
+    ASSERT(((uintptr_t)data_ptr % KHEAP_MIN_ALIGNMENT) == 0);
+    return data_ptr;
+}
 
-    // Add this large new block to the free list so it can be potentially split/coalesced later
-    kheap_add_to_free_list(new_block);
+// Return a block to the block allocator, merging it with free physical neighbours
+static void kheap_free_large(void* ptr) {
+    kheap_block_header_t* block = (kheap_block_header_t*)((uintptr_t)ptr - KHEAP_HEADER_SIZE);
 
-    // Coalesce immediately in case the new block is adjacent to a previous free block
-    // (though unlikely with simple break pointer expansion)
-    kheap_coalesce_free_list();
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, &kernel_address_space);
+    spin_lock(&kheap_lock);
+
+    // Basic sanity check - both tags must say allocated (catches double frees and overruns)
+    ASSERT(block->magic == ~KHEAP_MAGIC);
+    ASSERT(kheap_footer(block)->magic == ~KHEAP_MAGIC && kheap_footer(block)->size == block->size);
+
+    // Free neighbours whose interiors span the threshold already gave their frames back, so the
+    // release below only has to look at the freed block, the pages around its tags and small
+    // neighbours. This keeps a free next to a huge free block from walking all of it.
+    uintptr_t walk_lo = (uintptr_t)block - KHEAP_FOOTER_SIZE;
+    uintptr_t walk_hi = (uintptr_t)kheap_footer(block) + KHEAP_FOOTER_SIZE + KHEAP_HEADER_SIZE;
+
+    kheap_block_header_t* next = kheap_next_block(block);
+    if (next && next->magic == KHEAP_MAGIC) {
+        if (kheap_interior_span(next) < KHEAP_TRIM_THRESHOLD) {
+            walk_hi = (uintptr_t)kheap_footer(next);
+        }
+        kheap_bin_remove(next);
+        block->size += KHEAP_BLOCK_OVERHEAD + next->size;
+        next->magic = 0; // Absorbed header is now plain data
+    }
+
+    kheap_block_header_t* prev = kheap_block_ending_at((uintptr_t)block);
+    if (prev && prev->magic == KHEAP_MAGIC) {
+        if (kheap_interior_span(prev) < KHEAP_TRIM_THRESHOLD) {
+            walk_lo = (uintptr_t)prev;
+        }
+        kheap_bin_remove(prev);
+        prev->size += KHEAP_BLOCK_OVERHEAD + block->size;
+        block->magic = 0;
+        block = prev;
+    }
+
+    kheap_write_tags(block, KHEAP_MAGIC);
+    kheap_bin_insert(block);
+
+    // Give large runs of free pages back to the PMM (see KHEAP_TRIM_THRESHOLD)
+    if ((uintptr_t)kheap_footer(block) + KHEAP_FOOTER_SIZE == kheap_current_break) {
+        kheap_trim_tail(&gather, block, KHEAP_TRIM_KEEP, KHEAP_TRIM_THRESHOLD);
+    }
+    kheap_release_range(&gather, block, KHEAP_TRIM_THRESHOLD, walk_lo, walk_hi);
 
-    // Retry allocation (recursive call, but safe due to expansion)
-    // This simplifies logic as the new block is now on the free list and will be found.
     spin_unlock(&kheap_lock);
-    // kprintf("KHeap: Expanded heap, retrying allocation for %zu bytes\n", size);
-    return kmalloc(size); // Tail recursion might be optimized
+    tlb_gather_flush(&gather);
 }
 
-// Free memory allocated by kmalloc
-void kfree(void* ptr) {
-    if (!ptr) {
-        return;
+// Returns every fully free heap page to the PMM, ignoring the trim thresholds.
+// Meant for low-memory paths; returns the number of frames released.
+uint64_t kheap_trim() {
+    uint64_t released = 0;
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, &kernel_address_space);
+    spin_lock(&kheap_lock);
+
+    kheap_block_header_t* tail = kheap_block_ending_at(kheap_current_break);
+    if (tail && tail->magic == KHEAP_MAGIC) {
+        released += kheap_trim_tail(&gather, tail, 0, PAGE_SIZE);
+    }
+    for (uint32_t fl = 0; fl < KHEAP_FL_COUNT; fl++) {
+        for (uint32_t sl = 0; sl < KHEAP_SL_COUNT; sl++) {
+            for (kheap_block_header_t* block = kheap_bins[fl][sl]; block; block = block->next_free) {
+                released += kheap_release_interior(&gather, block, PAGE_SIZE);
+            }
+        }
     }
 
-    // Calculate header address using the CORRECT (padded) header size
-    kheap_block_header_t* block = (kheap_block_header_t*)((uintptr_t)ptr - KHEAP_HEADER_SIZE);
+    spin_unlock(&kheap_lock);
+    tlb_gather_flush(&gather);
+    return released;
+}
 
+// Switches heap expansion between eager mapping and reserve-only (demand-paged) mode.
+// Only enable reserve-only once the #PF handler calls vmm_handle_page_fault.
+void kheap_set_reserve_only(bool enabled) {
     spin_lock(&kheap_lock);
+    kheap_reserve_only = enabled;
+    spin_unlock(&kheap_lock);
+}
 
-    // Basic sanity check - check if it *was* allocated (using inverted magic)
-    ASSERT(block->magic == ~KHEAP_MAGIC);
+// Tops up the pre-zeroed frame pool used by demand faults. Meant for the idle loop: it stops
+// early when the PMM runs low. Returns the number of frames added.
+uint32_t kheap_refill_zero_pool() {
+    uint32_t added = 0;
+    while (pmm_total_frames - pmm_used_frames > KHEAP_ZERO_POOL_MIN_FREE) {
+        uint64_t frame = pmm_alloc_frame(); // Zeroed, and outside the pool lock
+        uint64_t flags = irq_save();
+        spin_lock(&kheap_zero_pool_lock);
+        bool stored = kheap_zero_pool_count < KHEAP_ZERO_POOL_SIZE;
+        if (stored) {
+            kheap_zero_pool[kheap_zero_pool_count++] = frame;
+        }
+        spin_unlock(&kheap_zero_pool_lock);
+        irq_restore(flags);
+        if (!stored) {
+            pmm_free_frame(frame);
+            break;
+        }
+        added++;
+    }
+    return added;
+}
 
-    // Add block back to free list (will handle sorting and set magic back to KHEAP_MAGIC)
-    kheap_add_to_free_list(block);
+// Heap pages that currently have a frame behind them, and demand faults served so far
+uint64_t kheap_resident_pages() {
+    return (__atomic_load_n(&kheap_current_break, __ATOMIC_ACQUIRE) - KERNEL_HEAP_START) / PAGE_SIZE -
+           __atomic_load_n(&kheap_released_pages, __ATOMIC_RELAXED);
+}
 
-    // Coalesce free blocks
-    kheap_coalesce_free_list();
+uint64_t kheap_demand_fault_count() {
+    return __atomic_load_n(&kheap_demand_faults, __ATOMIC_RELAXED);
+}
+
+
+// --- Kernel Heap Slab Layer (small size classes) ---
+//
+// Requests up to KSLAB_MAX_SIZE bytes are served from segregated size classes
+// (powers of two plus the 3/4 step in between). Objects are carved from
+// KSLAB_CHUNK_SIZE chunks taken from the heap break via kheap_expand, so they
+// carry no per-object header. Each CPU keeps a small magazine of free objects
+// per class; the per-class depot (central free list) is only locked when a
+// magazine runs empty or overflows.
+
+#define KSLAB_MAX_SIZE 2048
+#define KSLAB_NUM_CLASSES 14
+#define KSLAB_CHUNK_SIZE (PAGE_SIZE * 4) // 16 KiB per refill of a class from the heap
+#define KSLAB_MAG_SIZE 16 // Objects per per-CPU magazine
+
+static const uint16_t kslab_class_sizes[KSLAB_NUM_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+// Maps (size + 15) / 16 to a class index, built by kslab_init()
+static uint8_t kslab_size_to_class[KSLAB_MAX_SIZE / KHEAP_MIN_ALIGNMENT + 1];
+
+typedef struct kslab_object {
+    struct kslab_object* next;
+} kslab_object_t;
+
+typedef struct {
+    kslab_object_t* free_list; // Depot: free objects not held by any magazine
+    spinlock_t lock;
+} kslab_class_t;
+
+typedef struct {
+    uint32_t count;
+    void* objects[KSLAB_MAG_SIZE];
+} kslab_magazine_t;
+
+static kslab_class_t kslab_classes[KSLAB_NUM_CLASSES];
+static kslab_magazine_t kslab_magazines[KMEM_MAX_CPUS][KSLAB_NUM_CLASSES];
+
+static void kslab_init() {
+    uint32_t class_idx = 0;
+    for (uint32_t i = 0; i <= KSLAB_MAX_SIZE / KHEAP_MIN_ALIGNMENT; i++) {
+        while (kslab_class_sizes[class_idx] < i * KHEAP_MIN_ALIGNMENT) {
+            class_idx++;
+        }
+        kslab_size_to_class[i] = (uint8_t)class_idx;
+    }
+    for (uint32_t c = 0; c < KSLAB_NUM_CLASSES; c++) {
+        kslab_classes[c].free_list = NULL;
+        kslab_classes[c].lock = (spinlock_t)SPINLOCK_INIT;
+    }
+    memset(kslab_magazines, 0, sizeof(kslab_magazines));
+}
+
+// Returns the slab class of a heap pointer, or -1 if it belongs to the block allocator
+static inline int kslab_class_of(void* ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr < KERNEL_HEAP_START || addr >= kheap_max_break) {
+        return -1;
+    }
+    return (int)kslab_page_class[(addr - KERNEL_HEAP_START) / PAGE_SIZE] - 1;
+}
 
+// Carves a fresh chunk from the heap break into objects of the given class.
+// Returns the objects as a private list (count in *out_count), or NULL if the heap is exhausted.
+// Called with interrupts as the allocating caller had them, never from a magazine section.
+static kslab_object_t* kslab_grow(uint32_t class_idx, uint32_t* out_count) {
+    size_t obj_size = kslab_class_sizes[class_idx];
+
+    tlb_gather_t gather;
+    tlb_gather_init(&gather, &kernel_address_space);
+    spin_lock(&kheap_lock);
+    uintptr_t chunk = kheap_current_break;
+    if (!kheap_expand(&gather, KSLAB_CHUNK_SIZE)) {
+        spin_unlock(&kheap_lock);
+        tlb_gather_flush(&gather);
+        return NULL;
+    }
+    // Tag the pages before anyone can see the objects, so kfree routes them here
+    for (uintptr_t page = chunk; page < chunk + KSLAB_CHUNK_SIZE; page += PAGE_SIZE) {
+        kslab_page_class[(page - KERNEL_HEAP_START) / PAGE_SIZE] = (uint8_t)(class_idx + 1);
+    }
     spin_unlock(&kheap_lock);
-    // kprintf("KHeap: Freed block at %p (ptr %p, data size %zu)\n", block, ptr, block->size);
+    tlb_gather_flush(&gather); // Frees the spill pages kheap_expand reserved, if any
+
+    // Thread the objects together; chunk start is page aligned and sizes are multiples of 16
+    uint32_t count = KSLAB_CHUNK_SIZE / obj_size;
+    kslab_object_t* head = NULL;
+    for (uint32_t i = count; i > 0; i--) {
+        kslab_object_t* obj = (kslab_object_t*)(chunk + (uintptr_t)(i - 1) * obj_size);
+        obj->next = head;
+        head = obj;
+    }
+    *out_count = count;
+    return head;
+}
+
+// Allocates one object of the given class. Interrupts are disabled only while the per-CPU
+// magazine is touched; growing the class from the heap runs with the caller's interrupt state.
+static void* kslab_alloc(uint32_t class_idx) {
+    kslab_class_t* cls = &kslab_classes[class_idx];
+    uint64_t flags = irq_save(); // Magazines are per-CPU; keep interrupt handlers off them
+    uint32_t cpu = kmem_cpu_id();
+
+    if (cpu < KMEM_MAX_CPUS) {
+        kslab_magazine_t* mag = &kslab_magazines[cpu][class_idx];
+        if (mag->count > 0) {
+            void* obj = mag->objects[--mag->count];
+            irq_restore(flags);
+            return obj;
+        }
+
+        // Magazine empty: refill half of it from the depot, growing the class if needed
+        spin_lock(&cls->lock);
+        if (!cls->free_list) {
+            spin_unlock(&cls->lock);
+            irq_restore(flags);
+            uint32_t grown = 0;
+            kslab_object_t* list = kslab_grow(class_idx, &grown);
+            if (!list) {
+                return NULL;
+            }
+            kslab_object_t* tail = list;
+            while (tail->next) {
+                tail = tail->next;
+            }
+            flags = irq_save();
+            cpu = kmem_cpu_id(); // We may be on another CPU by now
+            if (cpu >= KMEM_MAX_CPUS) {
+                irq_restore(flags);
+                return NULL;
+            }
+            mag = &kslab_magazines[cpu][class_idx];
+            spin_lock(&cls->lock);
+            tail->next = cls->free_list;
+            cls->free_list = list;
+        }
+        while (cls->free_list && mag->count < KSLAB_MAG_SIZE / 2) {
+            kslab_object_t* obj = cls->free_list;
+            cls->free_list = obj->next;
+            mag->objects[mag->count++] = obj;
+        }
+        spin_unlock(&cls->lock);
+        void* obj = mag->objects[--mag->count];
+        irq_restore(flags);
+        return obj;
+    }
+
+    // CPU without a magazine: allocate directly from the depot
+    spin_lock(&cls->lock);
+    kslab_object_t* obj = cls->free_list;
+    if (obj) {
+        cls->free_list = obj->next;
+        spin_unlock(&cls->lock);
+        irq_restore(flags);
+        return obj;
+    }
+    spin_unlock(&cls->lock);
+    irq_restore(flags);
+
+    uint32_t grown = 0;
+    kslab_object_t* list = kslab_grow(class_idx, &grown);
+    if (!list) {
+        return NULL;
+    }
+    if (list->next) {
+        kslab_object_t* tail = list->next;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        flags = irq_save();
+        spin_lock(&cls->lock);
+        tail->next = cls->free_list;
+        cls->free_list = list->next;
+        spin_unlock(&cls->lock);
+        irq_restore(flags);
+    }
+    return list;
+}
+
+// Returns one object to its class. Interrupts must be disabled by the caller.
+static void kslab_free(void* ptr, uint32_t class_idx) {
+    uint32_t cpu = kmem_cpu_id();
+    kslab_class_t* cls = &kslab_classes[class_idx];
+    kslab_object_t* obj = (kslab_object_t*)ptr;
+
+    if (cpu < KMEM_MAX_CPUS) {
+        kslab_magazine_t* mag = &kslab_magazines[cpu][class_idx];
+        if (mag->count == KSLAB_MAG_SIZE) {
+            // Magazine full: flush the older half back to the depot in one lock section
+            kslab_object_t* head = NULL;
+            for (uint32_t i = 0; i < KSLAB_MAG_SIZE / 2; i++) {
+                kslab_object_t* flushed = (kslab_object_t*)mag->objects[i];
+                flushed->next = head;
+                head = flushed;
+            }
+            kslab_object_t* tail = (kslab_object_t*)mag->objects[0];
+            for (uint32_t i = KSLAB_MAG_SIZE / 2; i < KSLAB_MAG_SIZE; i++) {
+                mag->objects[i - KSLAB_MAG_SIZE / 2] = mag->objects[i];
+            }
+            mag->count = KSLAB_MAG_SIZE / 2;
+
+            spin_lock(&cls->lock);
+            tail->next = cls->free_list;
+            cls->free_list = head;
+            spin_unlock(&cls->lock);
+        }
+        mag->objects[mag->count++] = ptr;
+        return;
+    }
+
+    spin_lock(&cls->lock);
+    obj->next = cls->free_list;
+    cls->free_list = obj;
+    spin_unlock(&cls->lock);
+}
+
+// --- Kernel Heap Public Interface ---
+
+// Allocate memory from kernel heap
+void* kmalloc(size_t size) {
+    if (size == 0) {
+        return NULL;
+    }
+    if (size > KSLAB_MAX_SIZE) {
+        return kheap_alloc_large(size);
+    }
+
+    uint32_t class_idx = kslab_size_to_class[(size + KHEAP_MIN_ALIGNMENT - 1) / KHEAP_MIN_ALIGNMENT];
+    void* ptr = kslab_alloc(class_idx);
+
+    if (!ptr) {
+        kprintf("KHeap: Slab allocation failed - cannot expand heap for %lx bytes\n", (uint64_t)size);
+    }
+    return ptr;
+}
+
+// Free memory allocated by kmalloc
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    int class_idx = kslab_class_of(ptr);
+    if (class_idx < 0) {
+        kheap_free_large(ptr);
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    kslab_free(ptr, (uint32_t)class_idx);
+    irq_restore(flags);
 }
 
 
@@ -865,6 +2375,8 @@ void memory_init() {
     // Calculate bitmap size in qwords (uint64_t)
     pmm_bitmap_size_qwords = align_up(pmm_total_frames, 64) / 64;
     uint64_t pmm_bitmap_size_bytes = pmm_bitmap_size_qwords * sizeof(uint64_t);
+    // The frame reference counts live right after the bitmap, in the same reserved area
+    uint64_t pmm_metadata_size_bytes = pmm_bitmap_size_bytes + pmm_total_frames * sizeof(uint16_t);
 
     kprintf("PMM: Highest Addr: 0x%lx, Total Frames: %lu, Bitmap Size: %lu bytes (%lu qwords)\n",
             highest_addr, pmm_total_frames, pmm_bitmap_size_bytes, pmm_bitmap_size_qwords);
@@ -873,7 +2385,7 @@ void memory_init() {
     uint64_t bitmap_phys_addr = 0;
     for (uint64_t i = 0; i < memmap_entry_count; i++) {
         // Find usable region large enough for the bitmap, preferably above 1MB
-        if (memmap[i]->type == LIMINE_MEMMAP_USABLE && memmap[i]->length >= pmm_bitmap_size_bytes) {
+        if (memmap[i]->type == LIMINE_MEMMAP_USABLE && memmap[i]->length >= pmm_metadata_size_bytes) {
             uint64_t potential_addr = memmap[i]->base;
             // Try to place it above 1MB to avoid potential conflicts with BIOS/low memory structures
             if (potential_addr < 0x100000) {
@@ -887,7 +2399,7 @@ void memory_init() {
             potential_addr = align_up(potential_addr, PAGE_SIZE);
 
             // Check if it still fits within the current usable region after alignment
-            if (potential_addr + pmm_bitmap_size_bytes <= memmap[i]->base + memmap[i]->length) {
+            if (potential_addr + pmm_metadata_size_bytes <= memmap[i]->base + memmap[i]->length) {
                  bitmap_phys_addr = potential_addr;
                  kprintf("PMM: Placing bitmap at phys 0x%lx (within region %lu)\n", bitmap_phys_addr, i);
                  break; // Found a spot
@@ -901,6 +2413,8 @@ void memory_init() {
     // 3. Initialize the bitmap (mark all as used initially)
     pmm_bitmap = (uint64_t*)phys_to_virt(bitmap_phys_addr);
     memset(pmm_bitmap, 0xFF, pmm_bitmap_size_bytes); // Mark all bits as 1 (used)
+    pmm_frame_refs = (uint16_t*)((uint8_t*)pmm_bitmap + pmm_bitmap_size_bytes);
+    memset(pmm_frame_refs, 0, pmm_total_frames * sizeof(uint16_t)); // No frame is shared yet
     pmm_used_frames = pmm_total_frames; // Assume all used initially
 
     // 4. Mark usable regions as free in the bitmap
@@ -922,9 +2436,9 @@ void memory_init() {
         }
     }
 
-    // 5. Mark the bitmap area itself as used (critical!)
+    // 5. Mark the bitmap area (and the reference counts after it) as used (critical!)
     uint64_t bitmap_start_frame = bitmap_phys_addr / PAGE_SIZE;
-    uint64_t bitmap_end_frame = align_up(bitmap_phys_addr + pmm_bitmap_size_bytes, PAGE_SIZE) / PAGE_SIZE;
+    uint64_t bitmap_end_frame = align_up(bitmap_phys_addr + pmm_metadata_size_bytes, PAGE_SIZE) / PAGE_SIZE;
     kprintf("PMM: Marking bitmap frames %lu to %lu as used\n", bitmap_start_frame, bitmap_end_frame - 1);
     for (uint64_t frame = bitmap_start_frame; frame < bitmap_end_frame; frame++) {
         if (!pmm_bitmap_test(frame)) { // If it was marked free (because it was in a USABLE region)
@@ -940,7 +2454,9 @@ void memory_init() {
     kprintf("VMM: Initializing...\n");
     // 1. Get current PML4 (set up by Limine) and initialize kernel address space struct
     kernel_address_space.pml4_phys = read_cr3();
-    kernel_address_space.lock = SPINLOCK_INIT; // Initialize spinlock
+    kernel_address_space.lock = (spinlock_t)SPINLOCK_INIT; // Initialize spinlock
+    kernel_address_space.cpu_mask = 1ull << kmem_cpu_id(); // The boot CPU runs on it already
+    vmm_current_space[kmem_cpu_id()] = &kernel_address_space;
     kprintf("VMM: Initial kernel PML4 (from CR3) at phys 0x%lx\n", kernel_address_space.pml4_phys);
 
     // 2. Ensure HHDM is mapped correctly by iterating through physical memory
@@ -1000,10 +2516,16 @@ void memory_init() {
     // --- Initialize Kernel Heap ---
     // The virtual address range KERNEL_HEAP_START -> KERNEL_HEAP_START + KERNEL_HEAP_MAX_SIZE
     // is reserved, but pages are allocated and mapped on demand by kmalloc -> kheap_expand.
-    kheap_free_list = NULL;
+    memset(kheap_bins, 0, sizeof(kheap_bins));
+    memset(kheap_sl_bitmap, 0, sizeof(kheap_sl_bitmap));
+    memset(kslab_page_class, 0, sizeof(kslab_page_class));
+    memset(kheap_released_bitmap, 0, sizeof(kheap_released_bitmap));
+    kheap_released_pages = 0;
+    kheap_fl_bitmap = 0;
     kheap_current_break = KERNEL_HEAP_START; // Set initial break
     kheap_max_break = KERNEL_HEAP_START + KERNEL_HEAP_MAX_SIZE; // Set max break
     kheap_lock = SPINLOCK_INIT; // Initialize lock
+    kslab_init(); // Size-class table, depots and per-CPU magazines
     kprintf("KHeap: Initialized. Ready at virt 0x%lx (max size 0x%lx)\n",
             KERNEL_HEAP_START, KERNEL_HEAP_MAX_SIZE);
 
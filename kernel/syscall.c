@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
 #include "syscalls.h"
 
 //==================================================================
@@ -15,6 +17,9 @@
 #define CACHE_LINE_SIZE 64
 #define CACHE_ALIGNED   __attribute__((aligned(CACHE_LINE_SIZE)))
 
+// First address above the canonical lower (user) half
+#define USER_SPACE_END  0x0000800000000000ull
+
 //==================================================================
 // KERNEL LOGGING INTERFACE
 //==================================================================
@@ -59,8 +64,41 @@ SYSCALL_INLINE uint64_t sys_open(const syscall_args_t *a);
 SYSCALL_INLINE uint64_t sys_close(const syscall_args_t *a);
 SYSCALL_INLINE uint64_t sys_lseek(const syscall_args_t *a);
 SYSCALL_INLINE uint64_t sys_fstat(const syscall_args_t *a);
+SYSCALL_INLINE uint64_t sys_ring_enter(const syscall_args_t *a);
+SYSCALL_INLINE uint64_t sys_syscall_stats(const syscall_args_t *a);
 SYSCALL_INLINE uint64_t sys_exit(const syscall_args_t *a);
 
+//==================================================================
+// USER POINTER VALIDATION
+//==================================================================
+
+/**
+ * @brief Checks that [addr, addr + size) lies entirely in the user half
+ *
+ * Keeps a user-supplied pointer from naming kernel memory. It does not
+ * check that the pages are mapped.
+ */
+SYSCALL_INLINE bool syscall_user_range_ok(uint64_t addr, uint64_t size) {
+    return addr != 0 && size <= USER_SPACE_END && addr <= USER_SPACE_END - size;
+}
+
+// Page walk of the current address space (memory.c)
+bool vmm_user_range_writable(uint64_t addr, uint64_t size);
+
+/**
+ * @brief Checks that the kernel may write [addr, addr + size) for the caller
+ *
+ * On top of syscall_user_range_ok, every page must be a present user page
+ * that is writable (or copy-on-write). A kernel page fault on user memory
+ * is never fixed up, so anything the kernel writes must pass this first.
+ * The result holds until the caller's address space is changed; a thread
+ * that unmaps a buffer while another thread's syscall uses it is not
+ * handled.
+ */
+SYSCALL_INLINE bool syscall_user_writable(uint64_t addr, uint64_t size) {
+    return syscall_user_range_ok(addr, size) && vmm_user_range_writable(addr, size);
+}
+
 //==================================================================
 // SYSCALL TABLE
 //==================================================================
@@ -73,22 +111,123 @@ static const syscall_handler_t syscall_table[SYS_MAX] CACHE_ALIGNED = {
     [SYS_CLOSE] = sys_close,
     [SYS_LSEEK] = sys_lseek,
     [SYS_FSTAT] = sys_fstat,
+    // SYS_RING_ENTER is left out until the file layer provides the ksys_*
+    // ring handlers; with only the -ENOSYS defaults every SQE would fail
+    [SYS_SYSCALL_STATS] = sys_syscall_stats,
     [SYS_EXIT]  = sys_exit,
     // All other entries are implicitly NULL
 };
 
+//==================================================================
+// SYSCALL LATENCY STATISTICS
+//==================================================================
+
+// Always on. Every call bumps count (and errors) of its CPU's slot with a
+// plain increment; only one call in SYSCALL_STATS_SAMPLE per CPU is timed,
+// since two TSC reads on every call cost about 45 ns where rdtsc is slow.
+// The buckets are therefore a 1/N sample of the latency distribution,
+// while count and errors are exact. Each CPU writes only its own slot, so
+// a reader on another CPU may see a histogram that is one call behind.
+
+typedef struct {
+    syscall_hist_t hist[SYS_MAX]; // Slot 0 (no syscall uses it) collects bad numbers
+    uint64_t calls;               // All calls on this CPU; picks the timed ones
+} CACHE_ALIGNED syscall_cpu_stats_t;
+
+static syscall_cpu_stats_t syscall_stats[SYSCALL_STATS_MAX_CPUS];
+
+// CPUID.80000001h:EDX[27]: rdtscp and IA32_TSC_AUX exist
+static bool syscall_stats_rdtscp;
+
+#define MSR_TSC_AUX 0xC0000103
+
+// Index of the executing CPU, a single %gs-relative load (interrupts.c)
+uint32_t kmem_cpu_id(void);
+
+void syscall_stats_init_cpu(uint32_t cpu) {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000u), "c"(0));
+    bool rdtscp = false;
+    if (eax >= 0x80000001u) {
+        __asm__ volatile ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001u), "c"(0));
+        rdtscp = (edx >> 27) & 1;
+    }
+    syscall_stats_rdtscp = rdtscp;
+    if (rdtscp) {
+        __asm__ volatile ("wrmsr" : : "c"(MSR_TSC_AUX), "a"(cpu), "d"(0));
+    }
+}
+
+SYSCALL_INLINE uint64_t syscall_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// End of a timed call: rdtscp waits for the handler's instructions to finish
+SYSCALL_INLINE uint64_t syscall_rdtsc_end(void) {
+    if (LIKELY(syscall_stats_rdtscp)) {
+        uint32_t lo, hi, aux;
+        __asm__ volatile ("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+        return ((uint64_t)hi << 32) | lo;
+    }
+    return syscall_rdtsc();
+}
+
+// The CPU is read again after the handler ran: it may have moved to
+// another CPU, and the increments are only safe on the executing CPU's slot
+SYSCALL_INLINE syscall_hist_t *syscall_stats_count(uint64_t num, uint64_t result) {
+    syscall_hist_t *h = &syscall_stats[kmem_cpu_id() & (SYSCALL_STATS_MAX_CPUS - 1)]
+                             .hist[LIKELY(num < SYS_MAX) ? num : 0];
+    h->count++;
+    if (UNLIKELY((int64_t)result < 0)) {
+        h->errors++;
+    }
+    return h;
+}
+
+SYSCALL_INLINE void syscall_stats_bucket(syscall_hist_t *h, uint64_t cycles) {
+    unsigned bucket = 63 - __builtin_clzll(cycles | 1);
+    if (UNLIKELY(bucket >= SYSCALL_HIST_BUCKETS)) {
+        bucket = SYSCALL_HIST_BUCKETS - 1;
+    }
+    h->buckets[bucket]++;
+}
+
+// arg0 = syscall number, arg1 = syscall_hist_t to fill (user memory),
+// arg2 = CPU index or SYSCALL_STATS_ALL_CPUS for the sum over all CPUs
+SYSCALL_INLINE uint64_t sys_syscall_stats(const syscall_args_t *a) {
+    uint64_t num        = a->arg0;
+    syscall_hist_t *out = (syscall_hist_t*)a->arg1;
+    uint64_t cpu        = a->arg2;
+
+    if (UNLIKELY(!syscall_user_writable((uint64_t)out, sizeof(*out)))) {
+        return (uint64_t)-EFAULT;
+    }
+    if (UNLIKELY(num >= SYS_MAX || (cpu >= SYSCALL_STATS_MAX_CPUS && cpu != SYSCALL_STATS_ALL_CPUS))) {
+        return (uint64_t)-EINVAL;
+    }
+
+    uint64_t first = cpu == SYSCALL_STATS_ALL_CPUS ? 0 : cpu;
+    uint64_t last  = cpu == SYSCALL_STATS_ALL_CPUS ? SYSCALL_STATS_MAX_CPUS - 1 : cpu;
+    syscall_hist_t sum = { 0 };
+    for (uint64_t c = first; c <= last; c++) {
+        const volatile syscall_hist_t *h = &syscall_stats[c].hist[num];
+        sum.count  += h->count;
+        sum.errors += h->errors;
+        for (int b = 0; b < SYSCALL_HIST_BUCKETS; b++) {
+            sum.buckets[b] += h->buckets[b];
+        }
+    }
+    *out = sum;
+    return 0;
+}
+
 //==================================================================
 // SYSCALL ENTRY POINT
 //==================================================================
 
-/**
- * @brief Main syscall dispatcher entry point
- * 
- * @param num Syscall number (from RAX register)
- * @param args Pointer to argument structure
- * @return Result of syscall or -errno on error
- */
-uint64_t syscall_entry(uint64_t num, const syscall_args_t *args) {
+SYSCALL_INLINE uint64_t syscall_dispatch(uint64_t num, const syscall_args_t *args) {
     // Bounds check with single comparison
     if (UNLIKELY(num >= SYS_MAX)) {
         KERNEL_LOG(__func__, "Syscall number out of bounds");
@@ -104,6 +243,28 @@ uint64_t syscall_entry(uint64_t num, const syscall_args_t *args) {
     return handler(args);
 }
 
+/**
+ * @brief Main syscall dispatcher entry point
+ * 
+ * @param num Syscall number (from RAX register)
+ * @param args Pointer to argument structure
+ * @return Result of syscall or -errno on error
+ */
+uint64_t syscall_entry(uint64_t num, const syscall_args_t *args) {
+    syscall_cpu_stats_t *stats = &syscall_stats[kmem_cpu_id() & (SYSCALL_STATS_MAX_CPUS - 1)];
+    if (LIKELY(stats->calls++ & (SYSCALL_STATS_SAMPLE - 1))) {
+        uint64_t result = syscall_dispatch(num, args);
+        syscall_stats_count(num, result);
+        return result;
+    }
+
+    uint64_t start = syscall_rdtsc();
+    uint64_t result = syscall_dispatch(num, args);
+    uint64_t cycles = syscall_rdtsc_end() - start;
+    syscall_stats_bucket(syscall_stats_count(num, result), cycles);
+    return result;
+}
+
 //==================================================================
 // SYSCALL IMPLEMENTATIONS
 //==================================================================
@@ -210,25 +371,101 @@ SYSCALL_INLINE uint64_t sys_exit(const syscall_args_t *a) {
 #undef SYSCALL_ASM_TEMPLATE
 
 //==================================================================
-// OPTIONAL: SYSCALL STATISTICS (for debugging/profiling)
+// BATCHED SUBMISSION RING
 //==================================================================
 
-#ifdef SYSCALL_STATS
-static struct {
-    uint64_t count;
-    uint64_t errors;
-} syscall_stats[SYS_MAX] CACHE_ALIGNED;
+// In-kernel implementations of the ring opcodes. The sys_* functions above
+// issue the syscall instruction themselves and must not run in ring 0, so
+// the ring never goes through syscall_table. The file layer overrides these
+// weak defaults. Like syscalls, they receive user pointers from the SQE and
+// must validate them.
+#define SYSCALL_RING_OP(name)                                   \
+    __attribute__((weak))                                       \
+    uint64_t name(const syscall_args_t *a) {                    \
+        UNUSED(a);                                              \
+        return (uint64_t)-ENOSYS;                               \
+    }
 
-uint64_t syscall_entry_with_stats(uint64_t num, const syscall_args_t *args) {
-    uint64_t result = syscall_entry(num, args);
-    
-    if (LIKELY(num < SYS_MAX)) {
-        __atomic_fetch_add(&syscall_stats[num].count, 1, __ATOMIC_RELAXED);
-        if (UNLIKELY((int64_t)result < 0)) {
-            __atomic_fetch_add(&syscall_stats[num].errors, 1, __ATOMIC_RELAXED);
+SYSCALL_RING_OP(ksys_read)
+SYSCALL_RING_OP(ksys_write)
+SYSCALL_RING_OP(ksys_open)
+SYSCALL_RING_OP(ksys_close)
+SYSCALL_RING_OP(ksys_lseek)
+SYSCALL_RING_OP(ksys_fstat)
+
+#undef SYSCALL_RING_OP
+
+// Opcodes a ring may carry; all other entries are NULL
+static const syscall_handler_t syscall_ring_ops[SYS_MAX] CACHE_ALIGNED = {
+    [SYS_READ]  = ksys_read,
+    [SYS_WRITE] = ksys_write,
+    [SYS_OPEN]  = ksys_open,
+    [SYS_CLOSE] = ksys_close,
+    [SYS_LSEEK] = ksys_lseek,
+    [SYS_FSTAT] = ksys_fstat,
+};
+
+/**
+ * @brief Processes up to max_submit queued SQEs of a ring
+ *
+ * Stops early when the submission queue is empty or the completion
+ * queue is full, so user space never loses a completion. The ring must
+ * already be checked with syscall_user_writable.
+ *
+ * @return Number of SQEs consumed
+ */
+static uint64_t syscall_ring_process(syscall_ring_t *ring, uint32_t max_submit) {
+    uint32_t sq_head = ring->kernel.sq_head;
+    uint32_t cq_tail = ring->kernel.cq_tail;
+    uint32_t sq_tail = __atomic_load_n(&ring->user.sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t cq_head = __atomic_load_n(&ring->user.cq_head, __ATOMIC_ACQUIRE);
+    uint32_t done = 0;
+
+    while (done < max_submit && sq_head != sq_tail) {
+        if (UNLIKELY(cq_tail - cq_head >= SYSCALL_RING_ENTRIES)) {
+            cq_head = __atomic_load_n(&ring->user.cq_head, __ATOMIC_ACQUIRE);
+            if (cq_tail - cq_head >= SYSCALL_RING_ENTRIES) {
+                break;
+            }
         }
+
+        // Copy the SQE out first: user space may rewrite the slot at any time
+        syscall_sqe_t sqe = ring->sqes[sq_head & SYSCALL_RING_MASK];
+        int64_t result;
+        if (UNLIKELY(sqe.opcode >= SYS_MAX || !syscall_ring_ops[sqe.opcode])) {
+            result = -ENOSYS;
+        } else if (UNLIKELY(sqe.flags != 0)) {
+            result = -EINVAL;
+        } else {
+            syscall_args_t args = { .args = { sqe.args[0], sqe.args[1], sqe.args[2] } };
+            result = (int64_t)syscall_ring_ops[sqe.opcode](&args);
+        }
+
+        syscall_cqe_t *cqe = &ring->cqes[cq_tail & SYSCALL_RING_MASK];
+        cqe->user_data = sqe.user_data;
+        cqe->result = result;
+        sq_head++;
+        cq_tail++;
+        done++;
     }
-    
-    return result;
+
+    // Publish once per batch rather than once per entry
+    __atomic_store_n(&ring->kernel.sq_head, sq_head, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->kernel.cq_tail, cq_tail, __ATOMIC_RELEASE);
+    return done;
+}
+
+// arg0 = ring, arg1 = max SQEs to process. Returns the number consumed.
+SYSCALL_INLINE uint64_t sys_ring_enter(const syscall_args_t *a) {
+    syscall_ring_t *ring = (syscall_ring_t*)a->arg0;
+    uint32_t max_submit  = (uint32_t)a->arg1;
+
+    // The whole ring must be mapped, writable user memory: the kernel writes
+    // CQEs and head/tail into it, and a fault there would not be recovered
+    if (UNLIKELY(!syscall_user_writable((uint64_t)ring, sizeof(*ring)) ||
+                 ((uintptr_t)ring & (CACHE_LINE_SIZE - 1)))) {
+        KERNEL_LOG(__func__, "Bad ring pointer");
+        return (uint64_t)-EFAULT;
+    }
+    return syscall_ring_process(ring, max_submit);
 }
-#endif
@@ -19,6 +19,8 @@ enum syscall_numbers {
     SYS_CLOSE,
     SYS_LSEEK,
     SYS_FSTAT,
+    SYS_RING_ENTER,
+    SYS_SYSCALL_STATS,
     SYS_EXIT = 60,
     SYS_MAX
 } KERNEL_ALIGN;
@@ -31,6 +33,54 @@ typedef struct syscall_args {
     };
 } syscall_args_t KERNEL_ALIGN;
 
+// Batched submission ring shared with user space. User space fills SQEs and
+// advances sq_tail, one SYS_RING_ENTER processes them in order and posts a CQE
+// (user_data + result) for each. Head/tail are free-running, index = value & mask.
+// The number is reserved: SYS_RING_ENTER fails with ENOSYS until the file layer
+// provides the in-kernel handlers for the ring opcodes.
+#define SYSCALL_RING_ENTRIES 256 // Power of two
+#define SYSCALL_RING_MASK    (SYSCALL_RING_ENTRIES - 1)
+
+typedef struct syscall_sqe {
+    uint32_t opcode;    // SYS_READ, SYS_WRITE, SYS_OPEN, SYS_CLOSE, SYS_LSEEK or SYS_FSTAT
+    uint32_t flags;     // Reserved, must be 0
+    uint64_t args[3];
+    uint64_t user_data; // Copied to the CQE untouched
+} syscall_sqe_t;
+
+typedef struct syscall_cqe {
+    uint64_t user_data;
+    int64_t result;     // Syscall result or -errno
+} syscall_cqe_t;
+
+typedef struct syscall_ring {
+    // Written by the kernel
+    struct { volatile uint32_t sq_head, cq_tail; } kernel KERNEL_ALIGN;
+    // Written by user space
+    struct { volatile uint32_t sq_tail, cq_head; } user KERNEL_ALIGN;
+    syscall_sqe_t sqes[SYSCALL_RING_ENTRIES] KERNEL_ALIGN;
+    syscall_cqe_t cqes[SYSCALL_RING_ENTRIES] KERNEL_ALIGN;
+} syscall_ring_t;
+
+// Latency histogram of one syscall number, returned by SYS_SYSCALL_STATS.
+// count and errors cover every call; only one call in SYSCALL_STATS_SAMPLE per CPU
+// is timed, so the buckets are a sample and add up to about count / SYSCALL_STATS_SAMPLE.
+// Bucket b counts calls that took [2^b, 2^(b+1)) TSC cycles, the last one is open-ended.
+#define SYSCALL_HIST_BUCKETS    32
+#define SYSCALL_STATS_MAX_CPUS  16 // Power of two
+#define SYSCALL_STATS_SAMPLE    64 // Power of two
+#define SYSCALL_STATS_ALL_CPUS  ((uint64_t)-1)
+
+typedef struct syscall_hist {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t buckets[SYSCALL_HIST_BUCKETS];
+} syscall_hist_t;
+
+// Programs IA32_TSC_AUX so rdtscp on the calling CPU reports its index.
+// Does nothing without rdtscp support
+void syscall_stats_init_cpu(uint32_t cpu);
+
 // Unified handler type with register optimization
 typedef uint64_t (*syscall_handler_t)(const syscall_args_t*) KERNEL_ALIGN;
 
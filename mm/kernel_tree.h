@@ -48,10 +48,44 @@ extern "C" {
   #define KTREE_MAX_NODES 4096
 #endif
 
+#ifndef KTREE_MAX_BNODES
+  #define KTREE_MAX_BNODES (KTREE_MAX_NODES / 4)
+#endif
+
 #ifndef KTREE_MAX_TREES
   #define KTREE_MAX_TREES 32
 #endif
 
+/*
+ * Сегментированный пул (KTREE_SEGMENTED_POOL): узлы лежат в сегментах по
+ * 2^KTREE_SEGMENT_SHIFT штук, выделяемых по требованию через подключаемый
+ * аллокатор страниц. Индекс узла 32-битный: старшие биты - номер сегмента,
+ * младшие - смещение. Без флага пул - статические массивы из
+ * KTREE_MAX_NODES / KTREE_MAX_BNODES узлов (ранняя загрузка).
+ */
+#ifdef KTREE_SEGMENTED_POOL
+  #ifndef KTREE_SEGMENT_SHIFT
+    #define KTREE_SEGMENT_SHIFT 12
+  #endif
+  
+  #ifndef KTREE_MAX_SEGMENTS
+    #define KTREE_MAX_SEGMENTS 1024
+  #endif
+  
+  #define KTREE_SEGMENT_NODES (1u << KTREE_SEGMENT_SHIFT)
+  #define KTREE_SEGMENT_MASK  (KTREE_SEGMENT_NODES - 1)
+#endif
+
+/* Ключей в порции ktree_insert_batch (сортируется на стеке) */
+#ifndef KTREE_INSERT_BATCH_CHUNK
+  #define KTREE_INSERT_BATCH_CHUNK 256
+#endif
+
+/* Деревьев с хэш-индексом на менеджер (каждому - своя таблица) */
+#ifndef KTREE_MAX_HASHED_TREES
+  #define KTREE_MAX_HASHED_TREES 4
+#endif
+
 #ifndef KTREE_SPINLOCK_RETRIES
   #define KTREE_SPINLOCK_RETRIES 1000
 #endif
@@ -60,6 +94,40 @@ extern "C" {
   #define KTREE_NUMA_AWARE 0
 #endif
 
+/* Пер-CPU счетчики контендации, глубины и отказов пула (ktree_stats_snapshot) */
+#ifndef KTREE_STATS
+  #define KTREE_STATS 0
+#endif
+
+/* Пер-CPU кэши свободных узлов */
+#ifndef KTREE_MAX_CPUS
+  #define KTREE_MAX_CPUS 64
+#endif
+
+#ifndef KTREE_PCPU_CACHE_SIZE
+  #define KTREE_PCPU_CACHE_SIZE 32
+#endif
+
+#define KTREE_PCPU_BATCH (KTREE_PCPU_CACHE_SIZE / 2)
+
+/*
+ * Номер текущего CPU. Ядро переопределяет его через smp_processor_id();
+ * в пользовательских сборках каждому потоку выдается свой слот.
+ */
+#ifndef KTREE_CPU_ID
+  #define KTREE_CPU_ID() ktree_hosted_cpu_id()
+  #define KTREE_HOSTED_CPU_ID
+#endif
+
+/* NUMA-узел CPU и "домашний" NUMA-узел индекса в пуле */
+#ifndef KTREE_CPU_NUMA_NODE
+  #define KTREE_CPU_NUMA_NODE(cpu) 0
+#endif
+
+#ifndef KTREE_IDX_NUMA_NODE
+  #define KTREE_IDX_NUMA_NODE(idx) 0
+#endif
+
 /* Компиляторно-специфичные оптимизации */
 #if defined(__GNUC__) || defined(__clang__)
   #define KTREE_LIKELY(x)   __builtin_expect(!!(x), 1)
@@ -74,6 +142,7 @@ extern "C" {
   #define KTREE_NORETURN    __attribute__((noreturn))
   #define KTREE_COLD        __attribute__((cold))
   #define KTREE_HOT         __attribute__((hot))
+  #define KTREE_READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
 #else
   #define KTREE_LIKELY(x)   (x)
   #define KTREE_UNLIKELY(x) (x)
@@ -87,11 +156,34 @@ extern "C" {
   #define KTREE_NORETURN
   #define KTREE_COLD
   #define KTREE_HOT
+  #define KTREE_READ_ONCE(x) (x)
 #endif
 
 /* Предзаполненные константы */
-#define KTREE_INVALID_NODE UINT16_MAX
-#define KTREE_MAX_DEPTH    32
+#ifdef KTREE_SEGMENTED_POOL
+  #define KTREE_INVALID_NODE UINT32_MAX
+#else
+  #define KTREE_INVALID_NODE UINT16_MAX
+#endif
+/*
+ * Предел длины пути спуска (стек итератора, счетчики путей). Высота
+ * красно-черного дерева до 2*log2(n+1): статическому пулу из 4096 узлов
+ * хватает 32, сегментированному на миллионы узлов нужно 64
+ */
+#ifndef KTREE_MAX_DEPTH
+  #ifdef KTREE_SEGMENTED_POOL
+    #define KTREE_MAX_DEPTH 64
+  #else
+    #define KTREE_MAX_DEPTH 32
+  #endif
+#endif
+#define KTREE_BNODE_KEYS   8   /* Ключей в узле B+-дерева: 8 x int32 = один AVX2-вектор */
+
+/* Слотов хэш-индекса; дерево с индексом держит не больше половины */
+#ifndef KTREE_HASH_SLOTS
+  #define KTREE_HASH_SLOTS (2 * KTREE_MAX_NODES)
+#endif
+#define KTREE_NO_HASH_INDEX UINT8_MAX
 
 /* Индикация ошибок */
 typedef enum {
@@ -143,7 +235,11 @@ typedef int32_t ktree_data_t;
 typedef uint32_t ktree_hash_t;
 
 /* Тип индекса узла */
+#ifdef KTREE_SEGMENTED_POOL
+typedef uint32_t ktree_node_idx_t;
+#else
 typedef uint16_t ktree_node_idx_t;
+#endif
 
 /* Тип атомик-счетчика */
 typedef struct {
@@ -155,6 +251,11 @@ typedef struct {
     volatile uint32_t lock;
 } ktree_spinlock_t;
 
+/* Тип счетчика последовательности (seqlock) */
+typedef struct {
+    volatile uint32_t sequence;
+} ktree_seqcount_t;
+
 /* Выровненная на кэш-линию структура узла для предотвращения false sharing */
 typedef struct KTREE_ALIGNED(8) {
     ktree_data_t data;
@@ -166,14 +267,67 @@ typedef struct KTREE_ALIGNED(8) {
     uint8_t flags;
 } ktree_node_t;
 
-/* Статический пул узлов */
+/*
+ * Узел B+-дерева, упакованный в одну кэш-линию. С 32-битными индексами
+ * узел занимает две линии; ключи по-прежнему лежат в первой.
+ */
+typedef struct KTREE_ALIGNED(KTREE_CACHE_LINE_SIZE) {
+    ktree_data_t keys[KTREE_BNODE_KEYS];
+    ktree_node_idx_t children[KTREE_BNODE_KEYS + 1];
+    ktree_node_idx_t next;
+    uint8_t count;
+    uint8_t flags;
+} ktree_bnode_t;
+
+/* Пер-CPU кэш свободных узлов; своя кэш-линия у каждого CPU */
+typedef struct KTREE_ALIGNED(KTREE_CACHE_LINE_SIZE) {
+    ktree_spinlock_t lock;
+    uint32_t count;
+    int32_t allocated;  /* Выдано из кэша минус возвращено в него */
+    ktree_node_idx_t idx[KTREE_PCPU_CACHE_SIZE];
+} ktree_pcpu_cache_t;
+
+#ifdef KTREE_SEGMENTED_POOL
+/* Аллокатор сегментов: size байт, выровненных на страницу; NULL при нехватке */
+typedef void* (*ktree_segment_alloc_fn)(size_t size, void* ctx);
+typedef void (*ktree_segment_free_fn)(void* ptr, size_t size, void* ctx);
+#endif
+
+#if KTREE_STATS
+/* Пер-CPU счетчики; пишутся relaxed-атомиками, своя кэш-линия у каждого CPU */
+typedef struct KTREE_ALIGNED(KTREE_CACHE_LINE_SIZE) {
+    uint64_t lock_spins;                        /* Итераций ожидания спин-локов */
+    uint64_t lock_failures;                     /* Исчерпаний KTREE_SPINLOCK_RETRIES */
+    uint64_t alloc_failures;                    /* Отказов выделения узлов */
+    uint64_t insert_path[KTREE_MAX_DEPTH + 1];  /* Вставки по длине пути спуска */
+} ktree_pcpu_stats_t;
+#endif
+
+/* Пул узлов: статические массивы или таблица сегментов */
 typedef struct KTREE_ALIGNED(KTREE_CACHE_LINE_SIZE) {
+#ifdef KTREE_SEGMENTED_POOL
+    ktree_node_t* segments[KTREE_MAX_SEGMENTS];
+    ktree_bnode_t* bnode_segments[KTREE_MAX_SEGMENTS];
+    uint32_t segment_count;        /* Публикуется после записи указателя */
+    uint32_t bnode_segment_count;
+    ktree_segment_alloc_fn segment_alloc;
+    ktree_segment_free_fn segment_free;
+    void* segment_ctx;
+#else
     ktree_node_t nodes[KTREE_MAX_NODES];
+    ktree_bnode_t bnodes[KTREE_MAX_BNODES];
+#endif
+    ktree_pcpu_cache_t pcpu[KTREE_MAX_CPUS];
+#if KTREE_STATS
+    ktree_pcpu_stats_t stats[KTREE_MAX_CPUS];
+#endif
     ktree_node_idx_t free_list;
+    ktree_node_idx_t bnode_free_list;
     ktree_atomic_t node_count;
+    ktree_atomic_t bnode_count;    /* Выданных узлов B+-дерева (меняется под pool_lock) */
     ktree_spinlock_t pool_lock;
     uint8_t padding[KTREE_CACHE_LINE_SIZE - sizeof(ktree_spinlock_t) 
-                   - sizeof(ktree_atomic_t) - sizeof(ktree_node_idx_t)];
+                   - 2 * sizeof(ktree_atomic_t) - 2 * sizeof(ktree_node_idx_t)];
 } ktree_node_pool_t;
 
 /* Битовая карта для отслеживания дубликатов/посещений */
@@ -194,16 +348,26 @@ typedef struct KTREE_ALIGNED(KTREE_CACHE_LINE_SIZE) {
     ktree_node_idx_t root;
     ktree_atomic_t size;
     ktree_spinlock_t tree_lock;
+    ktree_seqcount_t seq;
     uint32_t flags;
     uint8_t height;
+    uint8_t hash_slot;  /* Номер хэш-таблицы или KTREE_NO_HASH_INDEX */
     uint8_t padding[KTREE_CACHE_LINE_SIZE - sizeof(ktree_node_idx_t) 
                   - sizeof(ktree_atomic_t) - sizeof(ktree_spinlock_t) 
-                  - sizeof(uint32_t) - sizeof(uint8_t)];
+                  - sizeof(ktree_seqcount_t) - sizeof(uint32_t) 
+                  - 2 * sizeof(uint8_t)];
 } ktree_tree_t;
 
+/* Хэш-индекс дерева: индексы узлов по полю hash (KTREE_HASH_SLOTS - степень двойки) */
+typedef struct KTREE_ALIGNED(KTREE_CACHE_LINE_SIZE) {
+    ktree_node_idx_t slots[KTREE_HASH_SLOTS];
+} ktree_hash_index_t;
+
 /* Управление пулом деревьев */
 typedef struct KTREE_ALIGNED(KTREE_CACHE_LINE_SIZE) {
     ktree_node_pool_t node_pool;
+    ktree_hash_index_t hash_index[KTREE_MAX_HASHED_TREES];
+    uint32_t hash_index_used;  /* Битовая маска занятых таблиц */
     ktree_tree_t trees[KTREE_MAX_TREES];
     ktree_atomic_t tree_count;
     ktree_spinlock_t mgr_lock;
@@ -220,6 +384,25 @@ typedef struct {
     ktree_node_idx_t current;
 } ktree_iterator_t;
 
+/* Сводная статистика менеджера (нули для счетчиков без KTREE_STATS) */
+typedef struct {
+    uint64_t lock_spins;
+    uint64_t lock_failures;
+    uint64_t alloc_failures;
+    uint64_t inserts;
+    uint64_t insert_path[KTREE_MAX_DEPTH + 1];
+    uint32_t max_height;     /* Наибольшая высота среди деревьев */
+    uint32_t pool_capacity;  /* Узлов в пуле сейчас (с выделенными сегментами) */
+    uint32_t pool_used;
+    uint32_t pool_free;
+    uint32_t bnode_capacity; /* То же для узлов B+-дерева */
+    uint32_t bnode_used;
+    uint32_t bnode_free;
+} ktree_stats_t;
+
+/* Обратный вызов диапазонного обхода; false прекращает обход */
+typedef bool (*ktree_visit_fn)(ktree_data_t data, void* ctx);
+
 /* Флаги для узлов */
 #define KTREE_FLAG_RED       (1 << 0)  /* Для красно-черного дерева */
 #define KTREE_FLAG_MARKED    (1 << 1)  /* Для алгоритмов обхода */
@@ -237,6 +420,12 @@ typedef struct {
 #define KTREE_TREE_FLAG_BALANCED  (1 << 4)  /* Сбалансированное */
 #define KTREE_TREE_FLAG_SORTED    (1 << 5)  /* Сортированное */
 #define KTREE_TREE_FLAG_LOCKED    (1 << 6)  /* Дерево заблокировано */
+#define KTREE_TREE_FLAG_IN_USE    (1 << 7)  /* Слот менеджера занят */
+#define KTREE_TREE_FLAG_BPLUS     (1 << 8)  /* B+-дерево на упакованных узлах */
+#define KTREE_TREE_FLAG_HASHED    (1 << 9)  /* Хэш-индекс для ktree_find */
+
+/* Флаги для узлов B+-дерева */
+#define KTREE_BNODE_LEAF     (1 << 0)  /* Листовой узел */
 
 /* Флаги для итераторов */
 #define KTREE_ITER_FLAG_PREORDER   (1 << 0)
@@ -283,12 +472,15 @@ KTREE_INLINE void ktree_spinlock_init(ktree_spinlock_t* lock) {
     __atomic_store_n(&lock->lock, 0, __ATOMIC_RELAXED);
 }
 
-/* Захват спин-лока */
-KTREE_INLINE ktree_error_t ktree_spinlock_lock(ktree_spinlock_t* lock) {
+/* Захват спин-лока; spins - число неудачных попыток до захвата */
+KTREE_INLINE ktree_error_t ktree_spinlock_acquire(ktree_spinlock_t* lock,
+                                                uint32_t* spins) {
     uint32_t i;
     for (i = 0; i < KTREE_SPINLOCK_RETRIES; i++) {
-        if (__atomic_exchange_n(&lock->lock, 1, __ATOMIC_ACQUIRE) == 0)
+        if (__atomic_exchange_n(&lock->lock, 1, __ATOMIC_ACQUIRE) == 0) {
+            *spins = i;
             return KTREE_SUCCESS;
+        }
         
         /* Пауза для снижения контендации в гипер-потоках */
 #ifdef KTREE_ARCH_X86_64
@@ -298,9 +490,17 @@ KTREE_INLINE ktree_error_t ktree_spinlock_lock(ktree_spinlock_t* lock) {
 #endif
     }
     
+    *spins = i;
     return KTREE_ERR_LOCK_FAILED;
 }
 
+/* Захват спин-лока */
+KTREE_INLINE ktree_error_t ktree_spinlock_lock(ktree_spinlock_t* lock) {
+    uint32_t spins;
+    
+    return ktree_spinlock_acquire(lock, &spins);
+}
+
 /* Попытка захвата спин-лока */
 KTREE_INLINE bool ktree_spinlock_trylock(ktree_spinlock_t* lock) {
     return __atomic_exchange_n(&lock->lock, 1, __ATOMIC_ACQUIRE) == 0;
@@ -311,6 +511,43 @@ KTREE_INLINE void ktree_spinlock_unlock(ktree_spinlock_t* lock) {
     __atomic_store_n(&lock->lock, 0, __ATOMIC_RELEASE);
 }
 
+/* Инициализация счетчика последовательности */
+KTREE_INLINE void ktree_seqcount_init(ktree_seqcount_t* sc) {
+    __atomic_store_n(&sc->sequence, 0, __ATOMIC_RELAXED);
+}
+
+/* Начало чтения: ждем четного значения (нет активного писателя) */
+KTREE_INLINE uint32_t ktree_read_seqbegin(const ktree_seqcount_t* sc) {
+    uint32_t seq;
+    
+    while ((seq = __atomic_load_n(&sc->sequence, __ATOMIC_ACQUIRE)) & 1) {
+#ifdef KTREE_ARCH_X86_64
+        _mm_pause();
+#elif defined(KTREE_ARCH_ARM64)
+        __asm__ volatile("yield" ::: "memory");
+#endif
+    }
+    
+    return seq;
+}
+
+/* Конец чтения: true, если за время чтения был писатель */
+KTREE_INLINE bool ktree_read_seqretry(const ktree_seqcount_t* sc, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sc->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+/* Начало записи (вызывается под блокировкой писателя) */
+KTREE_INLINE void ktree_write_seqbegin(ktree_seqcount_t* sc) {
+    __atomic_store_n(&sc->sequence, sc->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Конец записи */
+KTREE_INLINE void ktree_write_seqend(ktree_seqcount_t* sc) {
+    __atomic_store_n(&sc->sequence, sc->sequence + 1, __ATOMIC_RELEASE);
+}
+
 /*
  * ============================================================================
  * ОПЕРАЦИИ С БИТОВЫМИ КАРТАМИ
@@ -431,90 +668,473 @@ KTREE_PURE KTREE_INLINE uint16_t ktree_ring_size(const ktree_ring_buffer_t* rb)
  * ============================================================================
  */
 
+/* Доступ к узлам по индексу и предельная емкость пула */
+#ifdef KTREE_SEGMENTED_POOL
+  #define KTREE_NODE_CAPACITY  ((uint32_t)KTREE_MAX_SEGMENTS << KTREE_SEGMENT_SHIFT)
+  #define KTREE_BNODE_CAPACITY KTREE_NODE_CAPACITY
+  #define KTREE_NODE(pool, idx) \
+    (&(pool)->segments[(uint32_t)(idx) >> KTREE_SEGMENT_SHIFT][(idx) & KTREE_SEGMENT_MASK])
+  #define KTREE_BNODE(pool, idx) \
+    (&(pool)->bnode_segments[(uint32_t)(idx) >> KTREE_SEGMENT_SHIFT][(idx) & KTREE_SEGMENT_MASK])
+#else
+  #define KTREE_NODE_CAPACITY  KTREE_MAX_NODES
+  #define KTREE_BNODE_CAPACITY KTREE_MAX_BNODES
+  #define KTREE_NODE(pool, idx)  (&(pool)->nodes[idx])
+  #define KTREE_BNODE(pool, idx) (&(pool)->bnodes[idx])
+#endif
+
+/*
+ * Проверка индекса, прочитанного без блокировки: сегмент мог быть еще не
+ * опубликован, а статический индекс - выйти за массив.
+ */
+KTREE_INLINE bool ktree_pool_node_valid(const ktree_node_pool_t* pool,
+                                      ktree_node_idx_t idx) {
+#ifdef KTREE_SEGMENTED_POOL
+    return (idx >> KTREE_SEGMENT_SHIFT) <
+           __atomic_load_n(&pool->segment_count, __ATOMIC_ACQUIRE);
+#else
+    (void)pool;
+    return idx < KTREE_MAX_NODES;
+#endif
+}
+
+KTREE_INLINE bool ktree_pool_bnode_valid(const ktree_node_pool_t* pool,
+                                       ktree_node_idx_t idx) {
+#ifdef KTREE_SEGMENTED_POOL
+    return (idx >> KTREE_SEGMENT_SHIFT) <
+           __atomic_load_n(&pool->bnode_segment_count, __ATOMIC_ACQUIRE);
+#else
+    (void)pool;
+    return idx < KTREE_MAX_BNODES;
+#endif
+}
+
+#ifdef KTREE_HOSTED_CPU_ID
+/* Слот текущего потока; коллизии слотов безопасны - кэш под своим локом */
+KTREE_INLINE uint32_t ktree_hosted_cpu_id(void) {
+    static __thread uint32_t slot = UINT32_MAX;
+    static uint32_t next_slot;
+    
+    if (KTREE_UNLIKELY(slot == UINT32_MAX))
+        slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) % KTREE_MAX_CPUS;
+    return slot;
+}
+#endif
+
+#if KTREE_STATS
+/* Счетчики текущего CPU; задача может мигрировать, поэтому запись атомарна */
+KTREE_INLINE ktree_pcpu_stats_t* ktree_stats_cpu(ktree_node_pool_t* pool) {
+    return &pool->stats[KTREE_CPU_ID() % KTREE_MAX_CPUS];
+}
+
+  #define KTREE_STAT_ADD(pool, field, n) \
+    __atomic_fetch_add(&ktree_stats_cpu(pool)->field, (uint64_t)(n), __ATOMIC_RELAXED)
+#else
+  #define KTREE_STAT_ADD(pool, field, n) do { } while (0)
+#endif
+
+/* Захват блокировки пула или дерева с учетом ожидания в статистике */
+KTREE_INLINE ktree_error_t ktree_lock(ktree_node_pool_t* pool, ktree_spinlock_t* lock) {
+    uint32_t spins;
+    ktree_error_t err = ktree_spinlock_acquire(lock, &spins);
+    
+#if KTREE_STATS
+    if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
+        KTREE_STAT_ADD(pool, lock_failures, 1);
+    else if (spins)
+        KTREE_STAT_ADD(pool, lock_spins, spins);
+#else
+    (void)pool;
+    (void)spins;
+#endif
+    return err;
+}
+
+/*
+ * Захват без ограничения числа попыток для путей освобождения и сброса
+ * кэшей: вернуть ошибку им некуда, а снять чужую блокировку нельзя
+ */
+KTREE_INLINE void ktree_lock_wait(ktree_node_pool_t* pool, ktree_spinlock_t* lock) {
+    while (ktree_lock(pool, lock) != KTREE_SUCCESS)
+        ;
+}
+
+/* Связывание count свободных узлов начиная с first в цепочку, хвост - next */
+KTREE_INLINE void ktree_pool_link_free(ktree_node_pool_t* pool,
+                                     ktree_node_idx_t first,
+                                     uint32_t count,
+                                     ktree_node_idx_t next) {
+    uint32_t i;
+    
+    for (i = 0; i < count; i++) {
+        ktree_node_t* node = KTREE_NODE(pool, first + i);
+        
+        node->left = i + 1 < count ? (ktree_node_idx_t)(first + i + 1) : next;
+        node->right = KTREE_INVALID_NODE;
+        node->parent = KTREE_INVALID_NODE;
+        node->height = 0;
+        node->flags = 0;
+    }
+}
+
+/* Цепочка свободных узлов B+-дерева связана через children[0] */
+KTREE_INLINE void ktree_pool_link_free_bnodes(ktree_node_pool_t* pool,
+                                            ktree_node_idx_t first,
+                                            uint32_t count,
+                                            ktree_node_idx_t next) {
+    uint32_t i;
+    
+    for (i = 0; i < count; i++) {
+        ktree_bnode_t* bnode = KTREE_BNODE(pool, first + i);
+        
+        bnode->children[0] = i + 1 < count ? (ktree_node_idx_t)(first + i + 1) : next;
+        bnode->count = 0;
+        bnode->flags = 0;
+    }
+}
+
 /* Инициализация пула узлов */
 KTREE_INLINE void ktree_pool_init(ktree_node_pool_t* pool) {
-    uint16_t i;
+    uint32_t i;
     
-    /* Инициализация цепочки свободных узлов */
-    for (i = 0; i < KTREE_MAX_NODES - 1; i++) {
-        pool->nodes[i].left = i + 1;
-        pool->nodes[i].right = KTREE_INVALID_NODE;
-        pool->nodes[i].parent = KTREE_INVALID_NODE;
-        pool->nodes[i].height = 0;
-        pool->nodes[i].flags = 0;
+#ifdef KTREE_SEGMENTED_POOL
+    /* Сегменты выделяются при первой нехватке узлов */
+    for (i = 0; i < KTREE_MAX_SEGMENTS; i++) {
+        pool->segments[i] = NULL;
+        pool->bnode_segments[i] = NULL;
     }
+    pool->segment_count = 0;
+    pool->bnode_segment_count = 0;
+    pool->segment_alloc = NULL;
+    pool->segment_free = NULL;
+    pool->segment_ctx = NULL;
+    pool->free_list = KTREE_INVALID_NODE;
+    pool->bnode_free_list = KTREE_INVALID_NODE;
+#else
+    /* Инициализация цепочек свободных узлов */
+    ktree_pool_link_free(pool, 0, KTREE_MAX_NODES, KTREE_INVALID_NODE);
+    ktree_pool_link_free_bnodes(pool, 0, KTREE_MAX_BNODES, KTREE_INVALID_NODE);
+    pool->free_list = 0;
+    pool->bnode_free_list = 0;
+#endif
     
-    /* Последний узел */
-    pool->nodes[KTREE_MAX_NODES - 1].left = KTREE_INVALID_NODE;
-    pool->nodes[KTREE_MAX_NODES - 1].right = KTREE_INVALID_NODE;
-    pool->nodes[KTREE_MAX_NODES - 1].parent = KTREE_INVALID_NODE;
-    pool->nodes[KTREE_MAX_NODES - 1].height = 0;
-    pool->nodes[KTREE_MAX_NODES - 1].flags = 0;
+    for (i = 0; i < KTREE_MAX_CPUS; i++) {
+        ktree_spinlock_init(&pool->pcpu[i].lock);
+        pool->pcpu[i].count = 0;
+        pool->pcpu[i].allocated = 0;
+    }
+    
+#if KTREE_STATS
+    for (i = 0; i < KTREE_MAX_CPUS; i++) {
+        ktree_pcpu_stats_t* stats = &pool->stats[i];
+        uint32_t d;
+        
+        stats->lock_spins = 0;
+        stats->lock_failures = 0;
+        stats->alloc_failures = 0;
+        for (d = 0; d <= KTREE_MAX_DEPTH; d++)
+            stats->insert_path[d] = 0;
+    }
+#endif
     
-    pool->free_list = 0;
     ktree_atomic_set(&pool->node_count, 0);
+    ktree_atomic_set(&pool->bnode_count, 0);
     ktree_spinlock_init(&pool->pool_lock);
 }
 
-/* Выделение узла из пула */
+#ifdef KTREE_SEGMENTED_POOL
+/*
+ * Подключение аллокатора сегментов. Вызывается после ktree_pool_init и
+ * до первого выделения узла. Аллокатор вызывается под pool_lock и не
+ * должен засыпать.
+ */
+KTREE_INLINE void ktree_pool_set_allocator(ktree_node_pool_t* pool,
+                                         ktree_segment_alloc_fn alloc,
+                                         ktree_segment_free_fn release,
+                                         void* ctx) {
+    ktree_lock_wait(pool, &pool->pool_lock);
+    pool->segment_alloc = alloc;
+    pool->segment_free = release;
+    pool->segment_ctx = ctx;
+    ktree_spinlock_unlock(&pool->pool_lock);
+}
+
+/* Возврат всех сегментов аллокатору; деревья пула должны быть не нужны */
+KTREE_INLINE void ktree_pool_destroy(ktree_node_pool_t* pool) {
+    uint32_t i;
+    
+    ktree_lock_wait(pool, &pool->pool_lock);
+    
+    for (i = 0; i < pool->segment_count; i++) {
+        if (pool->segment_free)
+            pool->segment_free(pool->segments[i],
+                               KTREE_SEGMENT_NODES * sizeof(ktree_node_t),
+                               pool->segment_ctx);
+        pool->segments[i] = NULL;
+    }
+    for (i = 0; i < pool->bnode_segment_count; i++) {
+        if (pool->segment_free)
+            pool->segment_free(pool->bnode_segments[i],
+                               KTREE_SEGMENT_NODES * sizeof(ktree_bnode_t),
+                               pool->segment_ctx);
+        pool->bnode_segments[i] = NULL;
+    }
+    
+    pool->segment_count = 0;
+    pool->bnode_segment_count = 0;
+    pool->free_list = KTREE_INVALID_NODE;
+    pool->bnode_free_list = KTREE_INVALID_NODE;
+    ktree_atomic_set(&pool->bnode_count, 0);
+    
+    ktree_spinlock_unlock(&pool->pool_lock);
+}
+#endif
+
+/*
+ * Рост пула сегментами, пока не добавится хотя бы count узлов; вызывается
+ * под pool_lock, когда свободных узлов не хватает. Новые узлы встают в
+ * голову цепочки. Указатель сегмента публикуется до счетчика, поэтому
+ * читатель, прошедший ktree_pool_node_valid, видит уже записанный сегмент.
+ */
+KTREE_INLINE ktree_error_t ktree_pool_grow(ktree_node_pool_t* pool, uint32_t count) {
+#ifdef KTREE_SEGMENTED_POOL
+    uint32_t added, seg;
+    ktree_node_t* nodes;
+    
+    for (added = 0; added < count; added += KTREE_SEGMENT_NODES) {
+        seg = pool->segment_count;
+        if (KTREE_UNLIKELY(seg >= KTREE_MAX_SEGMENTS))
+            return KTREE_ERR_FULL;
+        if (KTREE_UNLIKELY(!pool->segment_alloc))
+            return KTREE_ERR_OOM;
+        
+        nodes = (ktree_node_t*)pool->segment_alloc(KTREE_SEGMENT_NODES * sizeof(ktree_node_t),
+                                                   pool->segment_ctx);
+        if (KTREE_UNLIKELY(!nodes))
+            return KTREE_ERR_OOM;
+        
+        pool->segments[seg] = nodes;
+        __atomic_store_n(&pool->segment_count, seg + 1, __ATOMIC_RELEASE);
+        
+        ktree_pool_link_free(pool, seg << KTREE_SEGMENT_SHIFT, KTREE_SEGMENT_NODES,
+                             pool->free_list);
+        pool->free_list = seg << KTREE_SEGMENT_SHIFT;
+    }
+    return KTREE_SUCCESS;
+#else
+    (void)pool;
+    (void)count;
+    return KTREE_ERR_FULL;
+#endif
+}
+
+/* То же для узлов B+-дерева */
+KTREE_INLINE ktree_error_t ktree_pool_grow_bnodes(ktree_node_pool_t* pool, uint32_t count) {
+#ifdef KTREE_SEGMENTED_POOL
+    uint32_t added, seg;
+    ktree_bnode_t* bnodes;
+    
+    for (added = 0; added < count; added += KTREE_SEGMENT_NODES) {
+        seg = pool->bnode_segment_count;
+        if (KTREE_UNLIKELY(seg >= KTREE_MAX_SEGMENTS))
+            return KTREE_ERR_FULL;
+        if (KTREE_UNLIKELY(!pool->segment_alloc))
+            return KTREE_ERR_OOM;
+        
+        bnodes = (ktree_bnode_t*)pool->segment_alloc(KTREE_SEGMENT_NODES * sizeof(ktree_bnode_t),
+                                                     pool->segment_ctx);
+        if (KTREE_UNLIKELY(!bnodes))
+            return KTREE_ERR_OOM;
+        
+        pool->bnode_segments[seg] = bnodes;
+        __atomic_store_n(&pool->bnode_segment_count, seg + 1, __ATOMIC_RELEASE);
+        
+        ktree_pool_link_free_bnodes(pool, seg << KTREE_SEGMENT_SHIFT, KTREE_SEGMENT_NODES,
+                                    pool->bnode_free_list);
+        pool->bnode_free_list = seg << KTREE_SEGMENT_SHIFT;
+    }
+    return KTREE_SUCCESS;
+#else
+    (void)pool;
+    (void)count;
+    return KTREE_ERR_FULL;
+#endif
+}
+
+/*
+ * Пополнение пер-CPU кэша пачкой узлов за один захват pool_lock. С grow
+ * пустая цепочка пополняется новым сегментом пула.
+ */
+KTREE_INLINE uint32_t ktree_pcpu_refill(ktree_node_pool_t* pool,
+                                      ktree_pcpu_cache_t* cache,
+                                      bool grow) {
+    uint32_t moved = 0;
+    
+    if (KTREE_UNLIKELY(ktree_lock(pool, &pool->pool_lock) != KTREE_SUCCESS))
+        return 0;
+    
+    if (grow && pool->free_list == KTREE_INVALID_NODE)
+        ktree_pool_grow(pool, KTREE_PCPU_BATCH);
+    
+    while (moved < KTREE_PCPU_BATCH && pool->free_list != KTREE_INVALID_NODE) {
+        cache->idx[cache->count++] = pool->free_list;
+        pool->free_list = KTREE_NODE(pool, pool->free_list)->left;
+        moved++;
+    }
+    
+    ktree_spinlock_unlock(&pool->pool_lock);
+    return moved;
+}
+
+/* Возврат count узлов из вершины кэша в общий пул за один захват pool_lock */
+KTREE_INLINE void ktree_pcpu_drain(ktree_node_pool_t* pool,
+                                 ktree_pcpu_cache_t* cache,
+                                 uint32_t count) {
+    ktree_node_idx_t head = KTREE_INVALID_NODE, tail = KTREE_INVALID_NODE;
+    uint32_t i;
+    
+    if (count > cache->count)
+        count = cache->count;
+    if (count == 0)
+        return;
+    
+    /* Цепочку собираем вне pool_lock */
+    for (i = 0; i < count; i++) {
+        ktree_node_idx_t idx = cache->idx[--cache->count];
+        
+        KTREE_NODE(pool, idx)->left = head;
+        head = idx;
+        if (tail == KTREE_INVALID_NODE)
+            tail = idx;
+    }
+    
+    ktree_lock_wait(pool, &pool->pool_lock);
+    KTREE_NODE(pool, tail)->left = pool->free_list;
+    pool->free_list = head;
+    ktree_spinlock_unlock(&pool->pool_lock);
+}
+
+/* Сброс кэша CPU в общий пул (при простое CPU или нехватке памяти) */
+KTREE_INLINE void ktree_pool_drain_cpu(ktree_node_pool_t* pool, uint32_t cpu) {
+    ktree_pcpu_cache_t* cache;
+    
+    if (KTREE_UNLIKELY(cpu >= KTREE_MAX_CPUS))
+        return;
+    
+    cache = &pool->pcpu[cpu];
+    ktree_lock_wait(pool, &cache->lock);
+    ktree_pcpu_drain(pool, cache, cache->count);
+    ktree_spinlock_unlock(&cache->lock);
+}
+
+/* Сброс кэшей всех CPU */
+KTREE_INLINE void ktree_pool_drain_all(ktree_node_pool_t* pool) {
+    uint32_t cpu;
+    
+    for (cpu = 0; cpu < KTREE_MAX_CPUS; cpu++) {
+        if (__atomic_load_n(&pool->pcpu[cpu].count, __ATOMIC_RELAXED))
+            ktree_pool_drain_cpu(pool, cpu);
+    }
+}
+
+/* Выделение узла из пула через кэш текущего CPU */
 KTREE_INLINE ktree_error_t ktree_pool_alloc_node(ktree_node_pool_t* pool, 
                                                ktree_node_idx_t* idx) {
-    ktree_error_t err = KTREE_SUCCESS;
+    ktree_pcpu_cache_t* cache = &pool->pcpu[KTREE_CPU_ID() % KTREE_MAX_CPUS];
     ktree_node_idx_t new_idx;
     
-    if (KTREE_UNLIKELY(ktree_spinlock_lock(&pool->pool_lock) != KTREE_SUCCESS))
+    if (KTREE_UNLIKELY(ktree_lock(pool, &cache->lock) != KTREE_SUCCESS))
         return KTREE_ERR_LOCK_FAILED;
     
-    if (KTREE_UNLIKELY(pool->free_list == KTREE_INVALID_NODE)) {
-        err = KTREE_ERR_FULL;
-        goto unlock;
+    if (KTREE_UNLIKELY(cache->count == 0 && ktree_pcpu_refill(pool, cache, false) == 0)) {
+        ktree_spinlock_unlock(&cache->lock);
+        
+        /*
+         * Общий пул пуст - свободные узлы могут лежать в кэшах других CPU;
+         * расти пулу только если их нет и там
+         */
+        ktree_pool_drain_all(pool);
+        
+        if (KTREE_UNLIKELY(ktree_lock(pool, &cache->lock) != KTREE_SUCCESS))
+            return KTREE_ERR_LOCK_FAILED;
+        
+        if (cache->count == 0 && ktree_pcpu_refill(pool, cache, true) == 0) {
+            ktree_spinlock_unlock(&cache->lock);
+            KTREE_STAT_ADD(pool, alloc_failures, 1);
+            return KTREE_ERR_FULL;
+        }
     }
     
-    new_idx = pool->free_list;
-    pool->free_list = pool->nodes[new_idx].left;
+    new_idx = cache->idx[--cache->count];
+    cache->allocated++;
+    ktree_spinlock_unlock(&cache->lock);
     
     /* Подготавливаем узел */
-    pool->nodes[new_idx].left = KTREE_INVALID_NODE;
-    pool->nodes[new_idx].right = KTREE_INVALID_NODE;
-    pool->nodes[new_idx].parent = KTREE_INVALID_NODE;
-    pool->nodes[new_idx].height = 1;
-    pool->nodes[new_idx].flags = 0;
+    KTREE_NODE(pool, new_idx)->left = KTREE_INVALID_NODE;
+    KTREE_NODE(pool, new_idx)->right = KTREE_INVALID_NODE;
+    KTREE_NODE(pool, new_idx)->parent = KTREE_INVALID_NODE;
+    KTREE_NODE(pool, new_idx)->height = 1;
+    KTREE_NODE(pool, new_idx)->flags = 0;
     
-    ktree_atomic_inc(&pool->node_count);
     *idx = new_idx;
+    return KTREE_SUCCESS;
+}
+
+/* Хэш ключа (финализатор MurmurHash3) */
+KTREE_CONST KTREE_INLINE ktree_hash_t ktree_hash_data(ktree_data_t data) {
+    uint32_t h = (uint32_t)data;
     
-unlock:
-    ktree_spinlock_unlock(&pool->pool_lock);
-    return err;
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
 }
 
 /* Инициализация узла с данными */
 KTREE_INLINE void ktree_node_init(ktree_node_pool_t* pool, 
                                 ktree_node_idx_t idx, 
                                 ktree_data_t data) {
-    ktree_node_t* node = &pool->nodes[idx];
+    ktree_node_t* node = KTREE_NODE(pool, idx);
     node->data = data;
-    node->hash = (ktree_hash_t)data; /* Простой хэш для примера */
+    node->hash = ktree_hash_data(data);
 }
 
-/* Освобождение узла и возврат в пул */
+/* Освобождение узла и возврат в пул через кэш текущего CPU */
 KTREE_INLINE void ktree_pool_free_node(ktree_node_pool_t* pool, 
                                      ktree_node_idx_t idx) {
+    uint32_t cpu = KTREE_CPU_ID() % KTREE_MAX_CPUS;
+    ktree_pcpu_cache_t* cache = &pool->pcpu[cpu];
+    
     if (KTREE_UNLIKELY(idx == KTREE_INVALID_NODE))
         return;
     
-    ktree_spinlock_lock(&pool->pool_lock);
+    KTREE_NODE(pool, idx)->right = KTREE_INVALID_NODE;
+    KTREE_NODE(pool, idx)->parent = KTREE_INVALID_NODE;
+    KTREE_NODE(pool, idx)->flags = 0;
     
-    /* Возврат в список свободных */
-    pool->nodes[idx].left = pool->free_list;
-    pool->nodes[idx].right = KTREE_INVALID_NODE;
-    pool->nodes[idx].parent = KTREE_INVALID_NODE;
-    pool->nodes[idx].flags = 0;
-    pool->free_list = idx;
+#if KTREE_NUMA_AWARE
+    /* Чужие для NUMA-узла CPU узлы сразу уходят в общий пул */
+    if (KTREE_IDX_NUMA_NODE(idx) != KTREE_CPU_NUMA_NODE(cpu)) {
+        ktree_lock_wait(pool, &pool->pool_lock);
+        KTREE_NODE(pool, idx)->left = pool->free_list;
+        pool->free_list = idx;
+        ktree_atomic_dec(&pool->node_count);
+        ktree_spinlock_unlock(&pool->pool_lock);
+        return;
+    }
+#endif
     
-    ktree_atomic_dec(&pool->node_count);
+    ktree_lock_wait(pool, &cache->lock);
     
-    ktree_spinlock_unlock(&pool->pool_lock);
+    if (KTREE_UNLIKELY(cache->count == KTREE_PCPU_CACHE_SIZE))
+        ktree_pcpu_drain(pool, cache, KTREE_PCPU_BATCH);
+    
+    cache->idx[cache->count++] = idx;
+    cache->allocated--;
+    
+    ktree_spinlock_unlock(&cache->lock);
 }
 
 /* Получение узла по индексу */
@@ -523,120 +1143,2533 @@ KTREE_INLINE ktree_node_t* ktree_pool_get_node(ktree_node_pool_t* pool,
     if (KTREE_UNLIKELY(idx == KTREE_INVALID_NODE))
         return NULL;
     
-    KTREE_PREFETCH(&pool->nodes[idx]);
-    return &pool->nodes[idx];
-}
-
-/* Получить количество активных узлов */
-KTREE_PURE KTREE_INLINE uint32_t ktree_pool_node_count(ktree_node_pool_t* pool) {
-    return ktree_atomic_read(&pool->node_count);
+    KTREE_PREFETCH(KTREE_NODE(pool, idx));
+    return KTREE_NODE(pool, idx);
 }
 
-/*
- * ============================================================================
- * ОПЕРАЦИИ С ДЕРЕВЬЯМИ
- * ============================================================================
- */
-
-/* Инициализация дерева */
-KTREE_INLINE void ktree_init(ktree_tree_t* tree, uint32_t flags) {
-    tree->root = KTREE_INVALID_NODE;
-    ktree_atomic_set(&tree->size, 0);
-    ktree_spinlock_init(&tree->tree_lock);
-    tree->flags = flags;
-    tree->height = 0;
+/* Проверка, что в цепочке есть count узлов B+-дерева, с ростом пула (под pool_lock) */
+KTREE_INLINE ktree_error_t ktree_pool_reserve_bnodes(ktree_node_pool_t* pool,
+                                                   uint32_t count) {
+    ktree_node_idx_t curr = pool->bnode_free_list;
+    uint32_t avail = 0;
+    
+    while (avail < count && curr != KTREE_INVALID_NODE) {
+        curr = KTREE_BNODE(pool, curr)->children[0];
+        avail++;
+    }
+    
+    if (avail == count)
+        return KTREE_SUCCESS;
+    
+    if (KTREE_UNLIKELY(ktree_pool_grow_bnodes(pool, count - avail) != KTREE_SUCCESS)) {
+        KTREE_STAT_ADD(pool, alloc_failures, 1);
+        return KTREE_ERR_FULL;
+    }
+    return KTREE_SUCCESS;
 }
 
-/* Создание нового дерева в менеджере */
-KTREE_INLINE ktree_error_t ktree_manager_create_tree(ktree_manager_t* mgr, 
-                                                  uint32_t flags, 
-                                                  uint32_t* tree_id) {
+/* Выделение count узлов B+-дерева за один захват блокировки (все или ничего) */
+KTREE_INLINE ktree_error_t ktree_pool_alloc_bnodes(ktree_node_pool_t* pool,
+                                                 ktree_node_idx_t* idx,
+                                                 uint32_t count) {
+    ktree_node_idx_t head;
     uint32_t i;
-    ktree_error_t err = KTREE_SUCCESS;
     
-    if (KTREE_UNLIKELY(ktree_spinlock_lock(&mgr->mgr_lock) != KTREE_SUCCESS))
+    if (KTREE_UNLIKELY(ktree_lock(pool, &pool->pool_lock) != KTREE_SUCCESS))
         return KTREE_ERR_LOCK_FAILED;
     
-    uint32_t count = ktree_atomic_read(&mgr->tree_count);
-    if (KTREE_UNLIKELY(count >= KTREE_MAX_TREES)) {
+    if (KTREE_UNLIKELY(ktree_pool_reserve_bnodes(pool, count) != KTREE_SUCCESS)) {
+        ktree_spinlock_unlock(&pool->pool_lock);
+        return KTREE_ERR_FULL;
+    }
+    
+    head = pool->bnode_free_list;
+    for (i = 0; i < count; i++) {
+        idx[i] = head;
+        head = KTREE_BNODE(pool, head)->children[0];
+    }
+    pool->bnode_free_list = head;
+    __atomic_add_fetch(&pool->bnode_count.counter, count, __ATOMIC_RELAXED);
+    
+    ktree_spinlock_unlock(&pool->pool_lock);
+    
+    for (i = 0; i < count; i++) {
+        KTREE_BNODE(pool, idx[i])->next = KTREE_INVALID_NODE;
+        KTREE_BNODE(pool, idx[i])->count = 0;
+        KTREE_BNODE(pool, idx[i])->flags = 0;
+    }
+    
+    return KTREE_SUCCESS;
+}
+
+/*
+ * Выделение count узлов за один захват pool_lock. Узлы возвращаются
+ * цепочкой через поле left (как в списке свободных), хвост помечен
+ * KTREE_INVALID_NODE. Поля узлов не инициализируются.
+ */
+KTREE_INLINE ktree_error_t ktree_pool_alloc_batch(ktree_node_pool_t* pool,
+                                                uint32_t count,
+                                                ktree_node_idx_t* head) {
+    ktree_node_idx_t tail;
+    bool drained;
+    uint32_t i;
+    
+    if (count == 0) {
+        *head = KTREE_INVALID_NODE;
+        return KTREE_SUCCESS;
+    }
+    
+    for (drained = false; ; drained = true) {
+        if (KTREE_UNLIKELY(ktree_lock(pool, &pool->pool_lock) != KTREE_SUCCESS))
+            return KTREE_ERR_LOCK_FAILED;
+        
+        tail = pool->free_list;
+        for (i = 1; i < count && tail != KTREE_INVALID_NODE; i++)
+            tail = KTREE_NODE(pool, tail)->left;
+        
+        /* После сброса кэшей недостачу покрывают новые сегменты */
+        if (tail == KTREE_INVALID_NODE && drained &&
+            ktree_pool_grow(pool, pool->free_list == KTREE_INVALID_NODE
+                                  ? count : count - (i - 1)) == KTREE_SUCCESS) {
+            tail = pool->free_list;
+            for (i = 1; i < count; i++)
+                tail = KTREE_NODE(pool, tail)->left;
+        }
+        
+        if (KTREE_LIKELY(tail != KTREE_INVALID_NODE))
+            break;
+        
+        ktree_spinlock_unlock(&pool->pool_lock);
+        
+        /* Недостающие узлы могут лежать в пер-CPU кэшах */
+        if (drained) {
+            KTREE_STAT_ADD(pool, alloc_failures, 1);
+            return KTREE_ERR_FULL;
+        }
+        ktree_pool_drain_all(pool);
+    }
+    
+    *head = pool->free_list;
+    pool->free_list = KTREE_NODE(pool, tail)->left;
+    KTREE_NODE(pool, tail)->left = KTREE_INVALID_NODE;
+    __atomic_add_fetch(&pool->node_count.counter, count, __ATOMIC_SEQ_CST);
+    
+    ktree_spinlock_unlock(&pool->pool_lock);
+    return KTREE_SUCCESS;
+}
+
+/* Возврат цепочки узлов (связанных через left) за один захват pool_lock */
+KTREE_INLINE void ktree_pool_free_chain(ktree_node_pool_t* pool,
+                                      ktree_node_idx_t head,
+                                      ktree_node_idx_t tail,
+                                      uint32_t count) {
+    if (KTREE_UNLIKELY(head == KTREE_INVALID_NODE))
+        return;
+    
+    ktree_lock_wait(pool, &pool->pool_lock);
+    
+    KTREE_NODE(pool, tail)->left = pool->free_list;
+    pool->free_list = head;
+    __atomic_sub_fetch(&pool->node_count.counter, count, __ATOMIC_SEQ_CST);
+    
+    ktree_spinlock_unlock(&pool->pool_lock);
+}
+
+/*
+ * Выделение count узлов B+-дерева цепочкой через next за один захват
+ * pool_lock (все или ничего).
+ */
+KTREE_INLINE ktree_error_t ktree_pool_alloc_bnode_chain(ktree_node_pool_t* pool,
+                                                      uint32_t count,
+                                                      ktree_node_idx_t* head) {
+    ktree_node_idx_t curr;
+    uint32_t i;
+    
+    if (KTREE_UNLIKELY(ktree_lock(pool, &pool->pool_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
+    
+    /* Сначала убеждаемся, что узлов хватит */
+    if (KTREE_UNLIKELY(ktree_pool_reserve_bnodes(pool, count) != KTREE_SUCCESS)) {
+        ktree_spinlock_unlock(&pool->pool_lock);
+        return KTREE_ERR_FULL;
+    }
+    
+    *head = curr = pool->bnode_free_list;
+    for (i = 0; i < count; i++) {
+        ktree_node_idx_t next = KTREE_BNODE(pool, curr)->children[0];
+        
+        KTREE_BNODE(pool, curr)->next = i + 1 < count ? next : KTREE_INVALID_NODE;
+        KTREE_BNODE(pool, curr)->count = 0;
+        KTREE_BNODE(pool, curr)->flags = 0;
+        curr = next;
+    }
+    pool->bnode_free_list = curr;
+    __atomic_add_fetch(&pool->bnode_count.counter, count, __ATOMIC_RELAXED);
+    
+    ktree_spinlock_unlock(&pool->pool_lock);
+    return KTREE_SUCCESS;
+}
+
+/* Освобождение узла B+-дерева */
+KTREE_INLINE void ktree_pool_free_bnode(ktree_node_pool_t* pool,
+                                      ktree_node_idx_t idx) {
+    if (KTREE_UNLIKELY(idx == KTREE_INVALID_NODE))
+        return;
+    
+    ktree_lock_wait(pool, &pool->pool_lock);
+    
+    KTREE_BNODE(pool, idx)->children[0] = pool->bnode_free_list;
+    KTREE_BNODE(pool, idx)->count = 0;
+    KTREE_BNODE(pool, idx)->flags = 0;
+    pool->bnode_free_list = idx;
+    __atomic_sub_fetch(&pool->bnode_count.counter, 1, __ATOMIC_RELAXED);
+    
+    ktree_spinlock_unlock(&pool->pool_lock);
+}
+
+/* Освобождение всего поддерева B+-дерева (обход в глубину на стеке) */
+KTREE_INLINE void ktree_pool_free_bnode_tree(ktree_node_pool_t* pool,
+                                           ktree_node_idx_t idx) {
+    ktree_node_idx_t stack[KTREE_MAX_DEPTH * KTREE_BNODE_KEYS + 1];
+    uint32_t top = 0, i;
+    
+    stack[top++] = idx;
+    while (top > 0) {
+        ktree_node_idx_t curr = stack[--top];
+        ktree_bnode_t* bnode = KTREE_BNODE(pool, curr);
+        
+        if (!(bnode->flags & KTREE_BNODE_LEAF)) {
+            for (i = 0; i <= bnode->count; i++)
+                stack[top++] = bnode->children[i];
+        }
+        
+        ktree_pool_free_bnode(pool, curr);
+    }
+}
+
+/* Получить количество активных узлов (общий счетчик плюс пер-CPU дельты) */
+KTREE_PURE KTREE_INLINE uint32_t ktree_pool_node_count(ktree_node_pool_t* pool) {
+    int32_t count = (int32_t)ktree_atomic_read(&pool->node_count);
+    uint32_t cpu;
+    
+    for (cpu = 0; cpu < KTREE_MAX_CPUS; cpu++)
+        count += __atomic_load_n(&pool->pcpu[cpu].allocated, __ATOMIC_RELAXED);
+    
+    return count > 0 ? (uint32_t)count : 0;
+}
+
+/*
+ * ============================================================================
+ * БАЛАНСИРОВКА (АВЛ И КРАСНО-ЧЕРНЫЕ ДЕРЕВЬЯ)
+ * ============================================================================
+ *
+ * Все функции этого раздела вызываются под tree_lock внутри секции записи
+ * seqlock. Отсутствующий потомок (KTREE_INVALID_NODE) считается черным
+ * листом высоты 0.
+ */
+
+/* Высота поддерева (0 для пустого) */
+KTREE_INLINE uint8_t ktree_node_height(const ktree_node_pool_t* pool,
+                                     ktree_node_idx_t idx) {
+    return idx == KTREE_INVALID_NODE ? 0 : KTREE_NODE(pool, idx)->height;
+}
+
+/* Пересчет высоты узла по потомкам */
+KTREE_INLINE void ktree_node_update_height(ktree_node_pool_t* pool,
+                                         ktree_node_idx_t idx) {
+    ktree_node_t* node = KTREE_NODE(pool, idx);
+    uint8_t lh = ktree_node_height(pool, node->left);
+    uint8_t rh = ktree_node_height(pool, node->right);
+    
+    node->height = (uint8_t)((lh > rh ? lh : rh) + 1);
+}
+
+/* Баланс-фактор АВЛ: высота левого минус высота правого */
+KTREE_INLINE int32_t ktree_node_balance(const ktree_node_pool_t* pool,
+                                      ktree_node_idx_t idx) {
+    const ktree_node_t* node = KTREE_NODE(pool, idx);
+    return (int32_t)ktree_node_height(pool, node->left) -
+           (int32_t)ktree_node_height(pool, node->right);
+}
+
+/* Проверка цвета узла */
+KTREE_INLINE bool ktree_node_is_red(const ktree_node_pool_t* pool,
+                                  ktree_node_idx_t idx) {
+    return idx != KTREE_INVALID_NODE &&
+           (KTREE_NODE(pool, idx)->flags & KTREE_FLAG_RED);
+}
+
+/* Установка цвета узла */
+KTREE_INLINE void ktree_node_set_red(ktree_node_pool_t* pool,
+                                   ktree_node_idx_t idx,
+                                   bool red) {
+    if (idx == KTREE_INVALID_NODE)
+        return;
+    
+    if (red)
+        KTREE_NODE(pool, idx)->flags |= KTREE_FLAG_RED;
+    else
+        KTREE_NODE(pool, idx)->flags &= ~KTREE_FLAG_RED;
+}
+
+/* Замена потомка old_idx у parent_idx на new_idx (или смена корня) */
+KTREE_INLINE void ktree_replace_child(ktree_node_pool_t* pool,
+                                    ktree_tree_t* tree,
+                                    ktree_node_idx_t parent_idx,
+                                    ktree_node_idx_t old_idx,
+                                    ktree_node_idx_t new_idx) {
+    if (parent_idx == KTREE_INVALID_NODE) {
+        if (old_idx != KTREE_INVALID_NODE)
+            KTREE_NODE(pool, old_idx)->flags &= ~KTREE_FLAG_ROOT;
+        if (new_idx != KTREE_INVALID_NODE)
+            KTREE_NODE(pool, new_idx)->flags |= KTREE_FLAG_ROOT;
+        tree->root = new_idx;
+    } else if (KTREE_NODE(pool, parent_idx)->left == old_idx) {
+        KTREE_NODE(pool, parent_idx)->left = new_idx;
+    } else {
+        KTREE_NODE(pool, parent_idx)->right = new_idx;
+    }
+    
+    if (new_idx != KTREE_INVALID_NODE)
+        KTREE_NODE(pool, new_idx)->parent = parent_idx;
+}
+
+/* Левый поворот вокруг x; возвращает новый корень поддерева */
+KTREE_INLINE ktree_node_idx_t ktree_rotate_left(ktree_node_pool_t* pool,
+                                              ktree_tree_t* tree,
+                                              ktree_node_idx_t x) {
+    ktree_node_idx_t y = KTREE_NODE(pool, x)->right;
+    ktree_node_idx_t beta = KTREE_NODE(pool, y)->left;
+    
+    KTREE_NODE(pool, x)->right = beta;
+    if (beta != KTREE_INVALID_NODE)
+        KTREE_NODE(pool, beta)->parent = x;
+    
+    ktree_replace_child(pool, tree, KTREE_NODE(pool, x)->parent, x, y);
+    KTREE_NODE(pool, y)->left = x;
+    KTREE_NODE(pool, x)->parent = y;
+    
+    ktree_node_update_height(pool, x);
+    ktree_node_update_height(pool, y);
+    return y;
+}
+
+/* Правый поворот вокруг x; возвращает новый корень поддерева */
+KTREE_INLINE ktree_node_idx_t ktree_rotate_right(ktree_node_pool_t* pool,
+                                               ktree_tree_t* tree,
+                                               ktree_node_idx_t x) {
+    ktree_node_idx_t y = KTREE_NODE(pool, x)->left;
+    ktree_node_idx_t beta = KTREE_NODE(pool, y)->right;
+    
+    KTREE_NODE(pool, x)->left = beta;
+    if (beta != KTREE_INVALID_NODE)
+        KTREE_NODE(pool, beta)->parent = x;
+    
+    ktree_replace_child(pool, tree, KTREE_NODE(pool, x)->parent, x, y);
+    KTREE_NODE(pool, y)->right = x;
+    KTREE_NODE(pool, x)->parent = y;
+    
+    ktree_node_update_height(pool, x);
+    ktree_node_update_height(pool, y);
+    return y;
+}
+
+/*
+ * Восстановление АВЛ-инварианта от idx вверх. Подъем прекращается, как
+ * только высота поддерева осталась прежней: выше ничего не изменилось.
+ */
+KTREE_INLINE void ktree_avl_rebalance(ktree_node_pool_t* pool,
+                                    ktree_tree_t* tree,
+                                    ktree_node_idx_t idx) {
+    while (idx != KTREE_INVALID_NODE) {
+        ktree_node_idx_t parent_idx = KTREE_NODE(pool, idx)->parent;
+        ktree_node_idx_t top = idx;
+        uint8_t old_height = KTREE_NODE(pool, idx)->height;
+        int32_t balance;
+        
+        ktree_node_update_height(pool, idx);
+        balance = ktree_node_balance(pool, idx);
+        
+        if (balance > 1) {
+            if (ktree_node_balance(pool, KTREE_NODE(pool, idx)->left) < 0)
+                ktree_rotate_left(pool, tree, KTREE_NODE(pool, idx)->left);
+            top = ktree_rotate_right(pool, tree, idx);
+        } else if (balance < -1) {
+            if (ktree_node_balance(pool, KTREE_NODE(pool, idx)->right) > 0)
+                ktree_rotate_right(pool, tree, KTREE_NODE(pool, idx)->right);
+            top = ktree_rotate_left(pool, tree, idx);
+        }
+        
+        if (KTREE_NODE(pool, top)->height == old_height)
+            break;
+        
+        idx = parent_idx;
+    }
+    
+    tree->height = ktree_node_height(pool, tree->root);
+}
+
+/* Восстановление красно-черных свойств после вставки красного узла z */
+KTREE_INLINE void ktree_rb_insert_fixup(ktree_node_pool_t* pool,
+                                      ktree_tree_t* tree,
+                                      ktree_node_idx_t z) {
+    while (ktree_node_is_red(pool, KTREE_NODE(pool, z)->parent)) {
+        ktree_node_idx_t p = KTREE_NODE(pool, z)->parent;
+        ktree_node_idx_t g = KTREE_NODE(pool, p)->parent;
+        ktree_node_idx_t u;
+        
+        if (p == KTREE_NODE(pool, g)->left) {
+            u = KTREE_NODE(pool, g)->right;
+            if (ktree_node_is_red(pool, u)) {
+                ktree_node_set_red(pool, p, false);
+                ktree_node_set_red(pool, u, false);
+                ktree_node_set_red(pool, g, true);
+                z = g;
+                continue;
+            }
+            
+            if (z == KTREE_NODE(pool, p)->right) {
+                z = p;
+                ktree_rotate_left(pool, tree, z);
+                p = KTREE_NODE(pool, z)->parent;
+            }
+            
+            ktree_node_set_red(pool, p, false);
+            ktree_node_set_red(pool, g, true);
+            ktree_rotate_right(pool, tree, g);
+        } else {
+            u = KTREE_NODE(pool, g)->left;
+            if (ktree_node_is_red(pool, u)) {
+                ktree_node_set_red(pool, p, false);
+                ktree_node_set_red(pool, u, false);
+                ktree_node_set_red(pool, g, true);
+                z = g;
+                continue;
+            }
+            
+            if (z == KTREE_NODE(pool, p)->left) {
+                z = p;
+                ktree_rotate_right(pool, tree, z);
+                p = KTREE_NODE(pool, z)->parent;
+            }
+            
+            ktree_node_set_red(pool, p, false);
+            ktree_node_set_red(pool, g, true);
+            ktree_rotate_left(pool, tree, g);
+        }
+    }
+    
+    ktree_node_set_red(pool, tree->root, false);
+}
+
+/* Восстановление красно-черных свойств после удаления черного узла */
+KTREE_INLINE void ktree_rb_delete_fixup(ktree_node_pool_t* pool,
+                                      ktree_tree_t* tree,
+                                      ktree_node_idx_t x,
+                                      ktree_node_idx_t x_parent) {
+    while (x != tree->root && x_parent != KTREE_INVALID_NODE &&
+           !ktree_node_is_red(pool, x)) {
+        ktree_node_idx_t w;
+        
+        if (x == KTREE_NODE(pool, x_parent)->left) {
+            w = KTREE_NODE(pool, x_parent)->right;
+            if (ktree_node_is_red(pool, w)) {
+                ktree_node_set_red(pool, w, false);
+                ktree_node_set_red(pool, x_parent, true);
+                ktree_rotate_left(pool, tree, x_parent);
+                w = KTREE_NODE(pool, x_parent)->right;
+            }
+            
+            if (!ktree_node_is_red(pool, KTREE_NODE(pool, w)->left) &&
+                !ktree_node_is_red(pool, KTREE_NODE(pool, w)->right)) {
+                ktree_node_set_red(pool, w, true);
+                x = x_parent;
+                x_parent = KTREE_NODE(pool, x)->parent;
+                continue;
+            }
+            
+            if (!ktree_node_is_red(pool, KTREE_NODE(pool, w)->right)) {
+                ktree_node_set_red(pool, KTREE_NODE(pool, w)->left, false);
+                ktree_node_set_red(pool, w, true);
+                ktree_rotate_right(pool, tree, w);
+                w = KTREE_NODE(pool, x_parent)->right;
+            }
+            
+            ktree_node_set_red(pool, w, ktree_node_is_red(pool, x_parent));
+            ktree_node_set_red(pool, x_parent, false);
+            ktree_node_set_red(pool, KTREE_NODE(pool, w)->right, false);
+            ktree_rotate_left(pool, tree, x_parent);
+        } else {
+            w = KTREE_NODE(pool, x_parent)->left;
+            if (ktree_node_is_red(pool, w)) {
+                ktree_node_set_red(pool, w, false);
+                ktree_node_set_red(pool, x_parent, true);
+                ktree_rotate_right(pool, tree, x_parent);
+                w = KTREE_NODE(pool, x_parent)->left;
+            }
+            
+            if (!ktree_node_is_red(pool, KTREE_NODE(pool, w)->left) &&
+                !ktree_node_is_red(pool, KTREE_NODE(pool, w)->right)) {
+                ktree_node_set_red(pool, w, true);
+                x = x_parent;
+                x_parent = KTREE_NODE(pool, x)->parent;
+                continue;
+            }
+            
+            if (!ktree_node_is_red(pool, KTREE_NODE(pool, w)->left)) {
+                ktree_node_set_red(pool, KTREE_NODE(pool, w)->right, false);
+                ktree_node_set_red(pool, w, true);
+                ktree_rotate_left(pool, tree, w);
+                w = KTREE_NODE(pool, x_parent)->left;
+            }
+            
+            ktree_node_set_red(pool, w, ktree_node_is_red(pool, x_parent));
+            ktree_node_set_red(pool, x_parent, false);
+            ktree_node_set_red(pool, KTREE_NODE(pool, w)->left, false);
+            ktree_rotate_right(pool, tree, x_parent);
+        }
+        
+        x = tree->root;
+    }
+    
+    ktree_node_set_red(pool, x, false);
+}
+
+/* Следующий узел прямого обхода по ссылкам parent */
+KTREE_INLINE ktree_node_idx_t ktree_preorder_next(const ktree_node_pool_t* pool,
+                                                ktree_node_idx_t idx) {
+    const ktree_node_t* node = KTREE_NODE(pool, idx);
+    
+    if (node->left != KTREE_INVALID_NODE)
+        return node->left;
+    if (node->right != KTREE_INVALID_NODE)
+        return node->right;
+    
+    while (KTREE_NODE(pool, idx)->parent != KTREE_INVALID_NODE) {
+        ktree_node_idx_t parent_idx = KTREE_NODE(pool, idx)->parent;
+        
+        if (KTREE_NODE(pool, parent_idx)->left == idx &&
+            KTREE_NODE(pool, parent_idx)->right != KTREE_INVALID_NODE)
+            return KTREE_NODE(pool, parent_idx)->right;
+        idx = parent_idx;
+    }
+    
+    return KTREE_INVALID_NODE;
+}
+
+/* Балансировка после привязки нового узла к дереву */
+KTREE_INLINE void ktree_rebalance_after_insert(ktree_node_pool_t* pool,
+                                             ktree_tree_t* tree,
+                                             ktree_node_idx_t idx) {
+    if (tree->flags & KTREE_TREE_FLAG_AVL) {
+        ktree_avl_rebalance(pool, tree, KTREE_NODE(pool, idx)->parent);
+    } else if (tree->flags & KTREE_TREE_FLAG_RB) {
+        ktree_node_set_red(pool, idx, true);
+        ktree_rb_insert_fixup(pool, tree, idx);
+    }
+}
+
+/*
+ * ============================================================================
+ * B+-ДЕРЕВО С УПАКОВАННЫМИ УЗЛАМИ (KTREE_TREE_FLAG_BPLUS)
+ * ============================================================================
+ *
+ * Узел занимает ровно одну кэш-линию, поэтому каждый уровень спуска - один
+ * промах кэша вместо одного промаха на каждый бинарный уровень. Ключи во
+ * внутренних узлах - разделители: children[i] содержит ключи < keys[i],
+ * children[i + 1] - ключи >= keys[i]. Ключи хранятся только в листьях,
+ * листья связаны через next. tree->root хранит индекс в pool->bnodes.
+ */
+
+/* Количество ключей узла, не превышающих data (SIMD-сравнение всех слотов) */
+KTREE_HOT KTREE_INLINE uint32_t ktree_bnode_rank(const ktree_bnode_t* bnode,
+                                               uint32_t count,
+                                               ktree_data_t data) {
+    uint32_t valid = (1u << count) - 1;
+    uint32_t gt;
+    
+#if defined(KTREE_ARCH_X86_64) && defined(__AVX2__)
+    __m256i keys = _mm256_load_si256((const __m256i*)bnode->keys);
+    __m256i needle = _mm256_set1_epi32(data);
+    gt = (uint32_t)_mm256_movemask_ps(
+             _mm256_castsi256_ps(_mm256_cmpgt_epi32(keys, needle)));
+#elif defined(KTREE_ARCH_X86_64)
+    __m128i needle = _mm_set1_epi32(data);
+    __m128i lo = _mm_load_si128((const __m128i*)&bnode->keys[0]);
+    __m128i hi = _mm_load_si128((const __m128i*)&bnode->keys[4]);
+    gt = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(lo, needle))) |
+         ((uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(hi, needle))) << 4);
+#elif defined(KTREE_ARCH_ARM64)
+    static const uint32_t lane_bits[4] = { 1, 2, 4, 8 };
+    uint32x4_t bits = vld1q_u32(lane_bits);
+    int32x4_t needle = vdupq_n_s32(data);
+    uint32x4_t lo = vcgtq_s32(vld1q_s32(&bnode->keys[0]), needle);
+    uint32x4_t hi = vcgtq_s32(vld1q_s32(&bnode->keys[4]), needle);
+    gt = vaddvq_u32(vandq_u32(lo, bits)) |
+         (vaddvq_u32(vandq_u32(hi, bits)) << 4);
+#else
+    uint32_t i;
+    gt = 0;
+    for (i = 0; i < KTREE_BNODE_KEYS; i++)
+        gt |= (uint32_t)(bnode->keys[i] > data) << i;
+#endif
+    
+    return (uint32_t)__builtin_popcount(~gt & valid);
+}
+
+/* Спуск по B+-дереву без блокировки; возвращает лист с ключом */
+KTREE_INLINE ktree_node_idx_t ktree_bplus_lookup_raw(ktree_node_pool_t* pool,
+                                                   const ktree_tree_t* tree,
+                                                   ktree_data_t data) {
+    ktree_node_idx_t curr_idx = __atomic_load_n(&tree->root, __ATOMIC_RELAXED);
+    uint32_t steps, count, rank;
+    
+    for (steps = 0; steps < KTREE_MAX_DEPTH; steps++) {
+        if (!ktree_pool_bnode_valid(pool, curr_idx))
+            return KTREE_INVALID_NODE;
+        
+        const ktree_bnode_t* bnode = KTREE_BNODE(pool, curr_idx);
+        count = __atomic_load_n(&bnode->count, __ATOMIC_RELAXED);
+        if (count > KTREE_BNODE_KEYS)
+            count = KTREE_BNODE_KEYS;
+        
+        rank = ktree_bnode_rank(bnode, count, data);
+        
+        if (__atomic_load_n(&bnode->flags, __ATOMIC_RELAXED) & KTREE_BNODE_LEAF) {
+            if (rank > 0 && bnode->keys[rank - 1] == data)
+                return curr_idx;
+            return KTREE_INVALID_NODE;
+        }
+        
+        curr_idx = __atomic_load_n(&bnode->children[rank], __ATOMIC_RELAXED);
+        if (ktree_pool_bnode_valid(pool, curr_idx))
+            KTREE_PREFETCH(KTREE_BNODE(pool, curr_idx));
+    }
+    
+    return KTREE_INVALID_NODE;
+}
+
+/* Вставка ключа и правого потомка в позицию pos узла с запасом места */
+KTREE_INLINE void ktree_bnode_insert_at(ktree_bnode_t* bnode,
+                                      uint32_t pos,
+                                      ktree_data_t key,
+                                      ktree_node_idx_t right_child) {
+    uint32_t i;
+    
+    for (i = bnode->count; i > pos; i--) {
+        bnode->keys[i] = bnode->keys[i - 1];
+        bnode->children[i + 1] = bnode->children[i];
+    }
+    
+    bnode->keys[pos] = key;
+    bnode->children[pos + 1] = right_child;
+    bnode->count++;
+}
+
+/* Вставка в B+-дерево (вызывается под tree_lock) */
+KTREE_INLINE ktree_error_t ktree_bplus_insert(ktree_node_pool_t* pool,
+                                            ktree_tree_t* tree,
+                                            ktree_data_t data) {
+    ktree_node_idx_t path[KTREE_MAX_DEPTH];
+    ktree_node_idx_t spare[KTREE_MAX_DEPTH + 1];
+    ktree_node_idx_t curr_idx, right_idx;
+    ktree_bnode_t *bnode, *right;
+    ktree_data_t sep;
+    uint32_t depth = 0, needed, used = 0, pos, rank, i;
+    int32_t level;
+    ktree_error_t err;
+    
+    /* Пустое дерево: корень - единственный лист */
+    if (tree->root == KTREE_INVALID_NODE) {
+        err = ktree_pool_alloc_bnodes(pool, spare, 1);
+        if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
+            return err;
+        
+        bnode = KTREE_BNODE(pool, spare[0]);
+        bnode->flags = KTREE_BNODE_LEAF;
+        bnode->keys[0] = data;
+        bnode->count = 1;
+        
+        ktree_write_seqbegin(&tree->seq);
+        tree->root = spare[0];
+        ktree_write_seqend(&tree->seq);
+        
+        tree->height = 1;
+        return KTREE_SUCCESS;
+    }
+    
+    /* Спуск до листа с запоминанием пути */
+    curr_idx = tree->root;
+    for (;;) {
+        bnode = KTREE_BNODE(pool, curr_idx);
+        path[depth++] = curr_idx;
+        rank = ktree_bnode_rank(bnode, bnode->count, data);
+        
+        if (bnode->flags & KTREE_BNODE_LEAF)
+            break;
+        
+        if (KTREE_UNLIKELY(depth >= KTREE_MAX_DEPTH))
+            return KTREE_ERR_MAX_DEPTH;
+        curr_idx = bnode->children[rank];
+    }
+    
+    if (rank > 0 && bnode->keys[rank - 1] == data)
+        return KTREE_ERR_EXISTS;
+    
+    /* Заранее выделяем узлы под все расщепления, чтобы не откатываться */
+    needed = 0;
+    while (needed < depth &&
+           KTREE_BNODE(pool, path[depth - 1 - needed])->count == KTREE_BNODE_KEYS)
+        needed++;
+    if (needed == depth)
+        needed++; /* Новый корень */
+    
+    if (needed > 0) {
+        err = ktree_pool_alloc_bnodes(pool, spare, needed);
+        if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
+            return err;
+    }
+    
+    ktree_write_seqbegin(&tree->seq);
+    
+    /* Вставка в лист */
+    if (bnode->count < KTREE_BNODE_KEYS) {
+        for (i = bnode->count; i > rank; i--)
+            bnode->keys[i] = bnode->keys[i - 1];
+        bnode->keys[rank] = data;
+        bnode->count++;
+        goto done;
+    }
+    
+    /* Расщепление листа: правая половина уходит в новый узел */
+    right_idx = spare[used++];
+    right = KTREE_BNODE(pool, right_idx);
+    right->flags = KTREE_BNODE_LEAF;
+    right->count = 0;
+    
+    for (i = KTREE_BNODE_KEYS / 2; i < KTREE_BNODE_KEYS; i++)
+        right->keys[right->count++] = bnode->keys[i];
+    bnode->count = KTREE_BNODE_KEYS / 2;
+    
+    right->next = bnode->next;
+    bnode->next = right_idx;
+    
+    if (rank <= KTREE_BNODE_KEYS / 2) {
+        for (i = bnode->count; i > rank; i--)
+            bnode->keys[i] = bnode->keys[i - 1];
+        bnode->keys[rank] = data;
+        bnode->count++;
+    } else {
+        pos = rank - KTREE_BNODE_KEYS / 2;
+        for (i = right->count; i > pos; i--)
+            right->keys[i] = right->keys[i - 1];
+        right->keys[pos] = data;
+        right->count++;
+    }
+    
+    sep = right->keys[0];
+    
+    /* Подъем разделителя по пути к корню */
+    for (level = (int32_t)depth - 2; level >= 0; level--) {
+        ktree_data_t keys[KTREE_BNODE_KEYS + 1];
+        ktree_node_idx_t children[KTREE_BNODE_KEYS + 2];
+        ktree_node_idx_t new_idx;
+        ktree_bnode_t* new_node;
+        uint32_t mid;
+        
+        bnode = KTREE_BNODE(pool, path[level]);
+        pos = ktree_bnode_rank(bnode, bnode->count, sep);
+        
+        if (bnode->count < KTREE_BNODE_KEYS) {
+            ktree_bnode_insert_at(bnode, pos, sep, right_idx);
+            goto done;
+        }
+        
+        /* Расщепление внутреннего узла через временный буфер */
+        for (i = 0; i < KTREE_BNODE_KEYS; i++)
+            keys[i < pos ? i : i + 1] = bnode->keys[i];
+        keys[pos] = sep;
+        
+        for (i = 0; i <= KTREE_BNODE_KEYS; i++)
+            children[i <= pos ? i : i + 1] = bnode->children[i];
+        children[pos + 1] = right_idx;
+        
+        new_idx = spare[used++];
+        new_node = KTREE_BNODE(pool, new_idx);
+        new_node->flags = 0;
+        new_node->next = KTREE_INVALID_NODE;
+        
+        mid = (KTREE_BNODE_KEYS + 1) / 2;
+        bnode->count = (uint8_t)mid;
+        new_node->count = (uint8_t)(KTREE_BNODE_KEYS - mid);
+        
+        for (i = 0; i < mid; i++)
+            bnode->keys[i] = keys[i];
+        for (i = 0; i < new_node->count; i++)
+            new_node->keys[i] = keys[mid + 1 + i];
+        for (i = 0; i <= mid; i++)
+            bnode->children[i] = children[i];
+        for (i = 0; i <= new_node->count; i++)
+            new_node->children[i] = children[mid + 1 + i];
+        
+        sep = keys[mid];
+        right_idx = new_idx;
+    }
+    
+    /* Расщепился корень - дерево растет вверх */
+    {
+        ktree_node_idx_t root_idx = spare[used++];
+        ktree_bnode_t* root = KTREE_BNODE(pool, root_idx);
+        
+        root->flags = 0;
+        root->next = KTREE_INVALID_NODE;
+        root->count = 1;
+        root->keys[0] = sep;
+        root->children[0] = tree->root;
+        root->children[1] = right_idx;
+        
+        tree->root = root_idx;
+        tree->height++;
+    }
+    
+done:
+    ktree_write_seqend(&tree->seq);
+    return KTREE_SUCCESS;
+}
+
+/*
+ * Удаление из B+-дерева (вызывается под tree_lock). Недозаполненные листья
+ * не сливаются: разделители остаются корректными границами, а опустевшее
+ * дерево целиком возвращается в пул.
+ */
+KTREE_INLINE ktree_error_t ktree_bplus_remove(ktree_node_pool_t* pool,
+                                            ktree_tree_t* tree,
+                                            ktree_data_t data) {
+    ktree_node_idx_t leaf_idx = ktree_bplus_lookup_raw(pool, tree, data);
+    ktree_bnode_t* leaf;
+    uint32_t rank, i;
+    
+    if (leaf_idx == KTREE_INVALID_NODE)
+        return KTREE_ERR_NOT_FOUND;
+    
+    leaf = KTREE_BNODE(pool, leaf_idx);
+    rank = ktree_bnode_rank(leaf, leaf->count, data);
+    
+    ktree_write_seqbegin(&tree->seq);
+    
+    for (i = rank - 1; i + 1 < leaf->count; i++)
+        leaf->keys[i] = leaf->keys[i + 1];
+    leaf->count--;
+    
+    if (ktree_atomic_read(&tree->size) == 1) {
+        ktree_node_idx_t root = tree->root;
+        tree->root = KTREE_INVALID_NODE;
+        tree->height = 0;
+        ktree_write_seqend(&tree->seq);
+        ktree_pool_free_bnode_tree(pool, root);
+        return KTREE_SUCCESS;
+    }
+    
+    ktree_write_seqend(&tree->seq);
+    return KTREE_SUCCESS;
+}
+
+/*
+ * ============================================================================
+ * ХЭШ-ИНДЕКС ДЛЯ ТОЧНОГО ПОИСКА (KTREE_TREE_FLAG_HASHED)
+ * ============================================================================
+ *
+ * Таблица с открытой адресацией и линейным пробированием хранит индексы
+ * узлов дерева по полю hash. Удаление сдвигает хвост кластера назад, так
+ * что надгробий нет и длина проб не деградирует. Таблица меняется только
+ * под tree_lock внутри секции записи seqlock дерева, поэтому читатели
+ * ktree_find проверяют тот же счетчик, что и ktree_lookup.
+ */
+
+/* Хэш-таблица дерева, если она есть */
+KTREE_INLINE ktree_hash_index_t* ktree_tree_index(ktree_manager_t* mgr,
+                                                const ktree_tree_t* tree) {
+    if (tree->hash_slot == KTREE_NO_HASH_INDEX)
+        return NULL;
+    return &mgr->hash_index[tree->hash_slot];
+}
+
+/* Очистка таблицы */
+KTREE_INLINE void ktree_hash_clear(ktree_hash_index_t* index) {
+    uint32_t i;
+    
+    for (i = 0; i < KTREE_HASH_SLOTS; i++)
+        index->slots[i] = KTREE_INVALID_NODE;
+}
+
+/* Добавление узла в таблицу */
+KTREE_INLINE void ktree_hash_insert(ktree_hash_index_t* index,
+                                  const ktree_node_pool_t* pool,
+                                  ktree_node_idx_t idx) {
+    uint32_t i = KTREE_NODE(pool, idx)->hash & (KTREE_HASH_SLOTS - 1);
+    
+    while (index->slots[i] != KTREE_INVALID_NODE)
+        i = (i + 1) & (KTREE_HASH_SLOTS - 1);
+    
+    index->slots[i] = idx;
+}
+
+/* Удаление узла из таблицы со сдвигом хвоста кластера */
+KTREE_INLINE void ktree_hash_remove(ktree_hash_index_t* index,
+                                  const ktree_node_pool_t* pool,
+                                  ktree_node_idx_t idx) {
+    uint32_t i = KTREE_NODE(pool, idx)->hash & (KTREE_HASH_SLOTS - 1);
+    uint32_t j, home;
+    
+    while (index->slots[i] != idx) {
+        if (KTREE_UNLIKELY(index->slots[i] == KTREE_INVALID_NODE))
+            return;
+        i = (i + 1) & (KTREE_HASH_SLOTS - 1);
+    }
+    
+    index->slots[i] = KTREE_INVALID_NODE;
+    
+    for (j = (i + 1) & (KTREE_HASH_SLOTS - 1);
+         index->slots[j] != KTREE_INVALID_NODE;
+         j = (j + 1) & (KTREE_HASH_SLOTS - 1)) {
+        home = KTREE_NODE(pool, index->slots[j])->hash & (KTREE_HASH_SLOTS - 1);
+        
+        /* Элемент остается, если его домашний слот лежит в (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        
+        index->slots[i] = index->slots[j];
+        index->slots[j] = KTREE_INVALID_NODE;
+        i = j;
+    }
+}
+
+/* Поиск по таблице без блокировки; не проверяет согласованность */
+KTREE_INLINE ktree_node_idx_t ktree_hash_lookup_raw(const ktree_hash_index_t* index,
+                                                  const ktree_node_pool_t* pool,
+                                                  ktree_data_t data) {
+    ktree_hash_t hash = ktree_hash_data(data);
+    uint32_t i = hash & (KTREE_HASH_SLOTS - 1);
+    uint32_t probes;
+    
+    for (probes = 0; probes < KTREE_HASH_SLOTS; probes++) {
+        ktree_node_idx_t idx = KTREE_READ_ONCE(index->slots[i]);
+        
+        if (idx == KTREE_INVALID_NODE || !ktree_pool_node_valid(pool, idx))
+            return KTREE_INVALID_NODE;
+        
+        if (KTREE_READ_ONCE(KTREE_NODE(pool, idx)->hash) == hash &&
+            KTREE_READ_ONCE(KTREE_NODE(pool, idx)->data) == data)
+            return idx;
+        
+        i = (i + 1) & (KTREE_HASH_SLOTS - 1);
+    }
+    
+    return KTREE_INVALID_NODE;
+}
+
+/* Перестройка таблицы по всему дереву (обход по ссылкам parent) */
+KTREE_INLINE void ktree_hash_rebuild(ktree_hash_index_t* index,
+                                   const ktree_node_pool_t* pool,
+                                   ktree_node_idx_t root) {
+    ktree_node_idx_t idx;
+    
+    ktree_hash_clear(index);
+    for (idx = root; idx != KTREE_INVALID_NODE; idx = ktree_preorder_next(pool, idx))
+        ktree_hash_insert(index, pool, idx);
+}
+
+/*
+ * ============================================================================
+ * ОПЕРАЦИИ С ДЕРЕВЬЯМИ
+ * ============================================================================
+ */
+
+/* Инициализация дерева */
+KTREE_INLINE void ktree_init(ktree_tree_t* tree, uint32_t flags) {
+    tree->root = KTREE_INVALID_NODE;
+    ktree_atomic_set(&tree->size, 0);
+    ktree_spinlock_init(&tree->tree_lock);
+    ktree_seqcount_init(&tree->seq);
+    tree->flags = flags;
+    tree->height = 0;
+    tree->hash_slot = KTREE_NO_HASH_INDEX;
+}
+
+/* Создание нового дерева в менеджере */
+KTREE_INLINE ktree_error_t ktree_manager_create_tree(ktree_manager_t* mgr, 
+                                                  uint32_t flags, 
+                                                  uint32_t* tree_id) {
+    uint32_t i;
+    int32_t hash_slot = -1;
+    ktree_error_t err = KTREE_SUCCESS;
+    
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &mgr->mgr_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
+    
+    uint32_t count = ktree_atomic_read(&mgr->tree_count);
+    if (KTREE_UNLIKELY(count >= KTREE_MAX_TREES)) {
+        err = KTREE_ERR_FULL;
+        goto unlock;
+    }
+    
+    /* Хэш-индекс хранит индексы бинарных узлов и B+-дереву не подходит */
+    if (flags & KTREE_TREE_FLAG_HASHED) {
+        if (KTREE_UNLIKELY(flags & KTREE_TREE_FLAG_BPLUS)) {
+            err = KTREE_ERR_INVALID;
+            goto unlock;
+        }
+        
+        hash_slot = __builtin_ffs((int)~mgr->hash_index_used) - 1;
+        if (KTREE_UNLIKELY(hash_slot < 0 || hash_slot >= KTREE_MAX_HASHED_TREES)) {
+            err = KTREE_ERR_FULL;
+            goto unlock;
+        }
+    }
+    
+    /* Находим свободный слот */
+    for (i = 0; i < KTREE_MAX_TREES; i++) {
+        if (!(mgr->trees[i].flags & KTREE_TREE_FLAG_IN_USE)) {
+            ktree_init(&mgr->trees[i], flags | KTREE_TREE_FLAG_IN_USE);
+            
+            if (hash_slot >= 0) {
+                ktree_hash_clear(&mgr->hash_index[hash_slot]);
+                mgr->hash_index_used |= 1u << hash_slot;
+                mgr->trees[i].hash_slot = (uint8_t)hash_slot;
+            }
+            
+            ktree_atomic_inc(&mgr->tree_count);
+            *tree_id = i;
+            goto unlock;
+        }
+    }
+    
+    err = KTREE_ERR_FULL;
+    
+unlock:
+    ktree_spinlock_unlock(&mgr->mgr_lock);
+    return err;
+}
+
+/* Инициализация менеджера деревьев */
+KTREE_INLINE void ktree_manager_init(ktree_manager_t* mgr) {
+    uint32_t i;
+    
+    ktree_pool_init(&mgr->node_pool);
+    
+    for (i = 0; i < KTREE_MAX_TREES; i++)
+        ktree_init(&mgr->trees[i], 0);
+    
+    ktree_atomic_set(&mgr->tree_count, 0);
+    mgr->hash_index_used = 0;
+    ktree_spinlock_init(&mgr->mgr_lock);
+    mgr->flags = 0;
+}
+
+/* Добавление узла в дерево (BST, АВЛ или RB - по флагам дерева) */
+KTREE_INLINE ktree_error_t ktree_insert(ktree_manager_t* mgr,
+                                      uint32_t tree_id,
+                                      ktree_data_t data) {
+    ktree_node_idx_t new_idx, parent_idx, curr_idx;
+    ktree_error_t err;
+    ktree_hash_index_t* index;
+    ktree_tree_t* tree;
+    ktree_node_t* parent;
+    uint32_t depth = 0;
+    
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES))
+        return KTREE_ERR_INVALID;
+    
+    tree = &mgr->trees[tree_id];
+    index = ktree_tree_index(mgr, tree);
+    
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &tree->tree_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
+    
+    if (tree->flags & KTREE_TREE_FLAG_BPLUS) {
+        err = ktree_bplus_insert(&mgr->node_pool, tree, data);
+        if (err == KTREE_SUCCESS)
+            ktree_atomic_inc(&tree->size);
+        goto unlock_tree;
+    }
+    
+    /* Хэш-индекс заполняется не больше чем наполовину */
+    if (KTREE_UNLIKELY(index && ktree_atomic_read(&tree->size) >= KTREE_HASH_SLOTS / 2)) {
         err = KTREE_ERR_FULL;
+        goto unlock_tree;
+    }
+    
+    /* Выделяем новый узел */
+    err = ktree_pool_alloc_node(&mgr->node_pool, &new_idx);
+    if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
+        goto unlock_tree;
+    
+    ktree_node_init(&mgr->node_pool, new_idx, data);
+    
+    /* Если дерево пустое, устанавливаем корень */
+    if (KTREE_UNLIKELY(tree->root == KTREE_INVALID_NODE)) {
+        ktree_node_t* root_node = ktree_pool_get_node(&mgr->node_pool, new_idx);
+        root_node->flags |= KTREE_FLAG_ROOT;
+        
+        ktree_write_seqbegin(&tree->seq);
+        tree->root = new_idx;
+        if (index)
+            ktree_hash_insert(index, &mgr->node_pool, new_idx);
+        ktree_write_seqend(&tree->seq);
+        
+        ktree_atomic_set(&tree->size, 1);
+        tree->height = 1;
+        
+        goto unlock_tree;
+    }
+    
+    /* Вставка в непустое дерево */
+    curr_idx = tree->root;
+    parent_idx = KTREE_INVALID_NODE;
+    
+    while (curr_idx != KTREE_INVALID_NODE) {
+        ktree_node_t* curr = ktree_pool_get_node(&mgr->node_pool, curr_idx);
+        
+        parent_idx = curr_idx;
+        
+        if (data < curr->data) {
+            curr_idx = curr->left;
+        } else if (data > curr->data) {
+            curr_idx = curr->right;
+        } else {
+            /* Дубликаты не допускаются */
+            ktree_pool_free_node(&mgr->node_pool, new_idx);
+            err = KTREE_ERR_EXISTS;
+            goto unlock_tree;
+        }
+        
+        if (KTREE_UNLIKELY(++depth >= KTREE_MAX_DEPTH)) {
+            ktree_pool_free_node(&mgr->node_pool, new_idx);
+            err = KTREE_ERR_MAX_DEPTH;
+            goto unlock_tree;
+        }
+    }
+    
+    KTREE_STAT_ADD(&mgr->node_pool, insert_path[depth], 1);
+    
+    /* Публикуем узел: читатели видят либо старое, либо новое дерево */
+    ktree_write_seqbegin(&tree->seq);
+    
+    parent = ktree_pool_get_node(&mgr->node_pool, parent_idx);
+    ktree_pool_get_node(&mgr->node_pool, new_idx)->parent = parent_idx;
+    
+    if (data < parent->data)
+        parent->left = new_idx;
+    else
+        parent->right = new_idx;
+    
+    if (depth + 1 > tree->height)
+        tree->height = (uint8_t)(depth + 1);
+    
+    ktree_rebalance_after_insert(&mgr->node_pool, tree, new_idx);
+    
+    if (index)
+        ktree_hash_insert(index, &mgr->node_pool, new_idx);
+    
+    ktree_write_seqend(&tree->seq);
+    
+    ktree_atomic_inc(&tree->size);
+    
+unlock_tree:
+    ktree_spinlock_unlock(&tree->tree_lock);
+    return err;
+}
+
+/*
+ * ============================================================================
+ * ПОИСК БЕЗ БЛОКИРОВКИ (SEQLOCK)
+ * ============================================================================
+ *
+ * Писатели по-прежнему сериализуются на tree_lock и оборачивают изменение
+ * связей в ktree_write_seqbegin/ktree_write_seqend. Читатели спускаются по
+ * дереву без блокировки и повторяют проход, если счетчик изменился. Узлы
+ * живут в статическом пуле, поэтому устаревший индекс никогда не указывает
+ * за пределы памяти - в худшем случае проход просто будет отброшен.
+ */
+
+/*
+ * Спуск по дереву без блокировки; не проверяет согласованность.
+ * Для B+-дерева возвращает индекс листа в pool->bnodes.
+ */
+KTREE_INLINE ktree_node_idx_t ktree_lookup_raw(ktree_node_pool_t* pool,
+                                             const ktree_tree_t* tree,
+                                             ktree_data_t data) {
+    ktree_node_idx_t curr_idx = __atomic_load_n(&tree->root, __ATOMIC_RELAXED);
+    uint32_t steps;
+    
+    if (tree->flags & KTREE_TREE_FLAG_BPLUS)
+        return ktree_bplus_lookup_raw(pool, tree, data);
+    
+    /* Ограничение шагов защищает от циклов при чтении во время записи */
+    for (steps = 0; steps < KTREE_MAX_DEPTH; steps++) {
+        if (curr_idx == KTREE_INVALID_NODE || !ktree_pool_node_valid(pool, curr_idx))
+            return KTREE_INVALID_NODE;
+        
+        const ktree_node_t* curr = KTREE_NODE(pool, curr_idx);
+        ktree_data_t key = __atomic_load_n(&curr->data, __ATOMIC_RELAXED);
+        
+        if (data == key)
+            return curr_idx;
+        
+        curr_idx = data < key
+            ? __atomic_load_n(&curr->left, __ATOMIC_RELAXED)
+            : __atomic_load_n(&curr->right, __ATOMIC_RELAXED);
+        
+        if (ktree_pool_node_valid(pool, curr_idx))
+            KTREE_PREFETCH(KTREE_NODE(pool, curr_idx));
+    }
+    
+    return KTREE_INVALID_NODE;
+}
+
+/* Поиск под tree_lock - запасной путь при постоянных конфликтах с писателями */
+KTREE_INLINE ktree_error_t ktree_lookup_locked(ktree_manager_t* mgr,
+                                             uint32_t tree_id,
+                                             ktree_data_t data,
+                                             ktree_node_idx_t* idx) {
+    ktree_tree_t* tree;
+    ktree_node_idx_t found;
+    
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES))
+        return KTREE_ERR_INVALID;
+    
+    tree = &mgr->trees[tree_id];
+    
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &tree->tree_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
+    
+    found = ktree_lookup_raw(&mgr->node_pool, tree, data);
+    
+    ktree_spinlock_unlock(&tree->tree_lock);
+    
+    if (found == KTREE_INVALID_NODE)
+        return KTREE_ERR_NOT_FOUND;
+    
+    if (idx)
+        *idx = found;
+    return KTREE_SUCCESS;
+}
+
+/* Поиск узла по ключу без захвата tree_lock */
+KTREE_HOT KTREE_INLINE ktree_error_t ktree_lookup(ktree_manager_t* mgr,
+                                                uint32_t tree_id,
+                                                ktree_data_t data,
+                                                ktree_node_idx_t* idx) {
+    ktree_tree_t* tree;
+    ktree_node_idx_t found;
+    uint32_t seq, retries;
+    
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES))
+        return KTREE_ERR_INVALID;
+    
+    tree = &mgr->trees[tree_id];
+    
+    for (retries = 0; retries < KTREE_SPINLOCK_RETRIES; retries++) {
+        seq = ktree_read_seqbegin(&tree->seq);
+        found = ktree_lookup_raw(&mgr->node_pool, tree, data);
+        
+        if (KTREE_LIKELY(!ktree_read_seqretry(&tree->seq, seq))) {
+            if (found == KTREE_INVALID_NODE)
+                return KTREE_ERR_NOT_FOUND;
+            
+            if (idx)
+                *idx = found;
+            return KTREE_SUCCESS;
+        }
+    }
+    
+    /* Писатели не дают завершить чтение - встаем в очередь за блокировкой */
+    return ktree_lookup_locked(mgr, tree_id, data, idx);
+}
+
+/* Проверка наличия ключа в дереве без захвата tree_lock */
+KTREE_HOT KTREE_INLINE bool ktree_contains(ktree_manager_t* mgr,
+                                         uint32_t tree_id,
+                                         ktree_data_t data) {
+    return ktree_lookup(mgr, tree_id, data, NULL) == KTREE_SUCCESS;
+}
+
+/*
+ * Точный поиск за O(1) через хэш-индекс без захвата tree_lock. Для
+ * деревьев без KTREE_TREE_FLAG_HASHED сводится к ktree_lookup.
+ */
+KTREE_HOT KTREE_INLINE ktree_error_t ktree_find(ktree_manager_t* mgr,
+                                              uint32_t tree_id,
+                                              ktree_data_t data,
+                                              ktree_node_idx_t* idx) {
+    const ktree_hash_index_t* index;
+    ktree_tree_t* tree;
+    ktree_node_idx_t found;
+    uint32_t seq, retries;
+    
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES))
+        return KTREE_ERR_INVALID;
+    
+    tree = &mgr->trees[tree_id];
+    index = ktree_tree_index(mgr, tree);
+    if (!index)
+        return ktree_lookup(mgr, tree_id, data, idx);
+    
+    for (retries = 0; retries < KTREE_SPINLOCK_RETRIES; retries++) {
+        seq = ktree_read_seqbegin(&tree->seq);
+        found = ktree_hash_lookup_raw(index, &mgr->node_pool, data);
+        
+        if (KTREE_LIKELY(!ktree_read_seqretry(&tree->seq, seq))) {
+            if (found == KTREE_INVALID_NODE)
+                return KTREE_ERR_NOT_FOUND;
+            
+            if (idx)
+                *idx = found;
+            return KTREE_SUCCESS;
+        }
+    }
+    
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &tree->tree_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
+    
+    found = ktree_hash_lookup_raw(index, &mgr->node_pool, data);
+    
+    ktree_spinlock_unlock(&tree->tree_lock);
+    
+    if (found == KTREE_INVALID_NODE)
+        return KTREE_ERR_NOT_FOUND;
+    
+    if (idx)
+        *idx = found;
+    return KTREE_SUCCESS;
+}
+
+/*
+ * ============================================================================
+ * УДАЛЕНИЕ
+ * ============================================================================
+ */
+
+/* Минимальный узел поддерева */
+KTREE_INLINE ktree_node_idx_t ktree_subtree_min(const ktree_node_pool_t* pool,
+                                              ktree_node_idx_t idx) {
+    while (KTREE_NODE(pool, idx)->left != KTREE_INVALID_NODE)
+        idx = KTREE_NODE(pool, idx)->left;
+    return idx;
+}
+
+/* Удаление узла из дерева (BST, АВЛ или RB - по флагам дерева) */
+KTREE_INLINE ktree_error_t ktree_delete(ktree_manager_t* mgr,
+                                      uint32_t tree_id,
+                                      ktree_data_t data) {
+    ktree_node_pool_t* pool = &mgr->node_pool;
+    ktree_node_idx_t z, y, x, x_parent, fix_from;
+    ktree_hash_index_t* index;
+    ktree_tree_t* tree;
+    ktree_error_t err;
+    bool removed_red;
+    
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES))
+        return KTREE_ERR_INVALID;
+    
+    tree = &mgr->trees[tree_id];
+    
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &tree->tree_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
+    
+    if (tree->flags & KTREE_TREE_FLAG_BPLUS) {
+        err = ktree_bplus_remove(pool, tree, data);
+        if (err == KTREE_SUCCESS)
+            ktree_atomic_dec(&tree->size);
+        ktree_spinlock_unlock(&tree->tree_lock);
+        return err;
+    }
+    
+    z = ktree_lookup_raw(pool, tree, data);
+    if (z == KTREE_INVALID_NODE) {
+        ktree_spinlock_unlock(&tree->tree_lock);
+        return KTREE_ERR_NOT_FOUND;
+    }
+    
+    ktree_write_seqbegin(&tree->seq);
+    
+    index = ktree_tree_index(mgr, tree);
+    if (index)
+        ktree_hash_remove(index, pool, z);
+    
+    /*
+     * Узел перевязывается, а не копируются данные преемника: индексы,
+     * выданные ktree_lookup, остаются действительными для прочих узлов.
+     */
+    y = z;
+    removed_red = ktree_node_is_red(pool, z);
+    
+    if (KTREE_NODE(pool, z)->left == KTREE_INVALID_NODE) {
+        x = KTREE_NODE(pool, z)->right;
+        x_parent = KTREE_NODE(pool, z)->parent;
+        ktree_replace_child(pool, tree, x_parent, z, x);
+        fix_from = x_parent;
+    } else if (KTREE_NODE(pool, z)->right == KTREE_INVALID_NODE) {
+        x = KTREE_NODE(pool, z)->left;
+        x_parent = KTREE_NODE(pool, z)->parent;
+        ktree_replace_child(pool, tree, x_parent, z, x);
+        fix_from = x_parent;
+    } else {
+        y = ktree_subtree_min(pool, KTREE_NODE(pool, z)->right);
+        removed_red = ktree_node_is_red(pool, y);
+        x = KTREE_NODE(pool, y)->right;
+        
+        if (KTREE_NODE(pool, y)->parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = KTREE_NODE(pool, y)->parent;
+            ktree_replace_child(pool, tree, x_parent, y, x);
+            KTREE_NODE(pool, y)->right = KTREE_NODE(pool, z)->right;
+            KTREE_NODE(pool, KTREE_NODE(pool, y)->right)->parent = y;
+        }
+        
+        ktree_replace_child(pool, tree, KTREE_NODE(pool, z)->parent, z, y);
+        KTREE_NODE(pool, y)->left = KTREE_NODE(pool, z)->left;
+        KTREE_NODE(pool, KTREE_NODE(pool, y)->left)->parent = y;
+        KTREE_NODE(pool, y)->height = KTREE_NODE(pool, z)->height;
+        ktree_node_set_red(pool, y, ktree_node_is_red(pool, z));
+        fix_from = x_parent;
+    }
+    
+    if (tree->flags & KTREE_TREE_FLAG_AVL) {
+        ktree_avl_rebalance(pool, tree, fix_from);
+    } else if ((tree->flags & KTREE_TREE_FLAG_RB) && !removed_red) {
+        if (x_parent == KTREE_INVALID_NODE)
+            ktree_node_set_red(pool, x, false);
+        else
+            ktree_rb_delete_fixup(pool, tree, x, x_parent);
+    }
+    
+    if (tree->root == KTREE_INVALID_NODE)
+        tree->height = 0;
+    
+    ktree_write_seqend(&tree->seq);
+    
+    ktree_atomic_dec(&tree->size);
+    ktree_spinlock_unlock(&tree->tree_lock);
+    
+    /* Возврат в пул после секции записи: опоздавшие читатели уйдут на повтор */
+    ktree_pool_free_node(pool, z);
+    return KTREE_SUCCESS;
+}
+
+/*
+ * ============================================================================
+ * ПАКЕТНАЯ ЗАГРУЗКА ИЗ ОТСОРТИРОВАННОГО МАССИВА
+ * ============================================================================
+ *
+ * Бинарные деревья строятся как полное дерево в порядке обхода в ширину:
+ * позиция p (с единицы) имеет потомков 2p и 2p + 1, а ключ позиции
+ * вычисляется по ее симметричному рангу за O(1). Узлы позиций раздаются
+ * по возрастанию индекса в пуле, поэтому на свежем пуле дерево занимает
+ * непрерывный диапазон и верхние уровни лежат в соседних кэш-линиях.
+ */
+
+/* Симметричный ранг позиции p в полном дереве из count узлов */
+KTREE_CONST KTREE_INLINE uint32_t ktree_complete_rank(uint32_t p, uint32_t count) {
+    uint32_t last = 31 - __builtin_clz(count);      /* Глубина нижнего уровня */
+    uint32_t depth = 31 - __builtin_clz(p);
+    uint32_t in_last = count - ((1u << last) - 1);  /* Узлов на нижнем уровне */
+    uint32_t rank = (2 * (p - (1u << depth)) + 1) * (1u << (last - depth)) - 1;
+    uint32_t below = (rank + 1) / 2;                 /* Слоты нижнего уровня левее */
+    
+    return below > in_last ? rank - (below - in_last) : rank;
+}
+
+/* Следующий установленный бит карты начиная с bit (KTREE_MAX_NODES, если нет) */
+KTREE_INLINE uint32_t ktree_bitmap_next(const ktree_bitmap_t* bitmap, uint32_t bit) {
+    uint32_t idx = bit >> 6;
+    uint64_t word;
+    
+    if (bit >= KTREE_MAX_NODES)
+        return KTREE_MAX_NODES;
+    
+    word = bitmap->bits[idx] & (~0ULL << (bit & 0x3F));
+    while (word == 0) {
+        if (++idx >= sizeof(bitmap->bits) / sizeof(bitmap->bits[0]))
+            return KTREE_MAX_NODES;
+        word = bitmap->bits[idx];
+    }
+    
+    return (idx << 6) + (uint32_t)__builtin_ctzll(word);
+}
+
+/* Разрушающий обход бинарного дерева с возвратом узлов в пул одной цепочкой */
+KTREE_INLINE void ktree_free_subtree(ktree_node_pool_t* pool, ktree_node_idx_t root) {
+    ktree_node_idx_t curr = root, head = KTREE_INVALID_NODE, tail = KTREE_INVALID_NODE;
+    uint32_t count = 0;
+    
+    while (curr != KTREE_INVALID_NODE) {
+        ktree_node_t* node = KTREE_NODE(pool, curr);
+        ktree_node_idx_t parent_idx;
+        
+        if (node->left != KTREE_INVALID_NODE) {
+            curr = node->left;
+            continue;
+        }
+        if (node->right != KTREE_INVALID_NODE) {
+            curr = node->right;
+            continue;
+        }
+        
+        /* Лист: отцепляем от родителя и добавляем в цепочку */
+        parent_idx = curr == root ? KTREE_INVALID_NODE : node->parent;
+        if (parent_idx != KTREE_INVALID_NODE) {
+            if (KTREE_NODE(pool, parent_idx)->left == curr)
+                KTREE_NODE(pool, parent_idx)->left = KTREE_INVALID_NODE;
+            else
+                KTREE_NODE(pool, parent_idx)->right = KTREE_INVALID_NODE;
+        }
+        
+        node->parent = KTREE_INVALID_NODE;
+        node->flags = 0;
+        node->left = head;
+        head = curr;
+        if (tail == KTREE_INVALID_NODE)
+            tail = curr;
+        count++;
+        
+        curr = parent_idx;
+    }
+    
+    ktree_pool_free_chain(pool, head, tail, count);
+}
+
+/*
+ * Порядок раздачи выданных узлов позициям. Статический пул сортирует
+ * индексы битовой картой; карта сегментированного пула на стек не
+ * помещается, и узлы идут в порядке цепочки (на свежих сегментах она и
+ * так возрастает). Следующий узел цепочки читается до перезаписи left.
+ */
+#ifdef KTREE_SEGMENTED_POOL
+  #define KTREE_BULK_FIRST(pool, order, head) (head)
+  #define KTREE_BULK_NEXT(pool, order, idx)   (KTREE_NODE(pool, idx)->left)
+#else
+  #define KTREE_BULK_FIRST(pool, order, head) ktree_bitmap_next(order, 0)
+  #define KTREE_BULK_NEXT(pool, order, idx)   ktree_bitmap_next(order, (idx) + 1)
+#endif
+
+/* Построение бинарного дерева; возвращает новый корень */
+KTREE_INLINE ktree_error_t ktree_bulk_build_binary(ktree_node_pool_t* pool,
+                                                 uint32_t tree_flags,
+                                                 const ktree_data_t* data,
+                                                 uint32_t count,
+                                                 ktree_node_idx_t* root) {
+#ifndef KTREE_SEGMENTED_POOL
+    ktree_bitmap_t order;
+    ktree_node_idx_t curr;
+#endif
+    ktree_node_idx_t head;
+    uint32_t last, full, p, self, child;
+    ktree_error_t err;
+    
+    err = ktree_pool_alloc_batch(pool, count, &head);
+    if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
+        return err;
+    
+#ifndef KTREE_SEGMENTED_POOL
+    /* Сортируем выданные индексы, чтобы позиции шли по возрастанию адресов */
+    ktree_bitmap_init(&order);
+    for (curr = head; curr != KTREE_INVALID_NODE; curr = KTREE_NODE(pool, curr)->left)
+        ktree_bitmap_set(&order, curr);
+#endif
+    
+    last = 31 - __builtin_clz(count);
+    full = count == (2u << last) - 1;
+    
+    self = KTREE_BULK_FIRST(pool, &order, head);
+    child = KTREE_BULK_NEXT(pool, &order, self);
+    *root = (ktree_node_idx_t)self;
+    KTREE_NODE(pool, self)->parent = KTREE_INVALID_NODE;
+    
+    for (p = 1; p <= count; p++) {
+        ktree_node_t* node = KTREE_NODE(pool, self);
+        uint32_t depth = 31 - __builtin_clz(p);
+        uint32_t next_self = p < count ? KTREE_BULK_NEXT(pool, &order, self) : 0;
+        
+        node->data = data[ktree_complete_rank(p, count)];
+        node->hash = ktree_hash_data(node->data);
+        node->height = (uint8_t)(32 - __builtin_clz(count / p));
+        node->flags = p == 1 ? KTREE_FLAG_ROOT : 0;
+        node->left = node->right = KTREE_INVALID_NODE;
+        
+        /* Нижний неполный уровень красный - черная высота всех путей равна */
+        if ((tree_flags & KTREE_TREE_FLAG_RB) && depth == last && !full)
+            node->flags |= KTREE_FLAG_RED;
+        
+        if (2 * p <= count) {
+            node->left = (ktree_node_idx_t)child;
+            KTREE_NODE(pool, child)->parent = (ktree_node_idx_t)self;
+            if (2 * p < count)
+                child = KTREE_BULK_NEXT(pool, &order, child);
+        }
+        if (2 * p + 1 <= count) {
+            node->right = (ktree_node_idx_t)child;
+            KTREE_NODE(pool, child)->parent = (ktree_node_idx_t)self;
+            if (2 * p + 1 < count)
+                child = KTREE_BULK_NEXT(pool, &order, child);
+        }
+        
+        self = next_self;
+    }
+    
+    return KTREE_SUCCESS;
+}
+
+/* Минимальный ключ поддерева B+-дерева */
+KTREE_INLINE ktree_data_t ktree_bnode_subtree_min(const ktree_node_pool_t* pool,
+                                                ktree_node_idx_t idx) {
+    while (!(KTREE_BNODE(pool, idx)->flags & KTREE_BNODE_LEAF))
+        idx = KTREE_BNODE(pool, idx)->children[0];
+    return KTREE_BNODE(pool, idx)->keys[0];
+}
+
+/* Построение B+-дерева снизу вверх; возвращает корень и высоту */
+KTREE_INLINE ktree_error_t ktree_bulk_build_bplus(ktree_node_pool_t* pool,
+                                                const ktree_data_t* data,
+                                                uint32_t count,
+                                                ktree_node_idx_t* root,
+                                                uint8_t* height) {
+    ktree_node_idx_t level_head, parent_head, child, parent;
+    uint32_t nodes, parents, per, extra, i, j, used = 0, total = 0;
+    ktree_error_t err;
+    
+    /* Общее число узлов всех уровней - чтобы не откатываться на полпути */
+    nodes = (count + KTREE_BNODE_KEYS - 1) / KTREE_BNODE_KEYS;
+    for (parents = nodes; ; parents = (parents + KTREE_BNODE_KEYS) / (KTREE_BNODE_KEYS + 1)) {
+        total += parents;
+        if (parents == 1)
+            break;
+    }
+    
+    err = ktree_pool_alloc_bnode_chain(pool, total, &level_head);
+    if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
+        return err;
+    
+    /* Листья: ключи распределяются равномерно, цепочка next уже готова */
+    per = count / nodes;
+    extra = count % nodes;
+    for (i = 0, child = level_head; i < nodes; i++) {
+        ktree_bnode_t* leaf = KTREE_BNODE(pool, child);
+        uint32_t n = per + (i < extra);
+        
+        leaf->flags = KTREE_BNODE_LEAF;
+        for (j = 0; j < n; j++)
+            leaf->keys[j] = data[used++];
+        leaf->count = (uint8_t)n;
+        child = leaf->next;
+    }
+    
+    /* Остаток цепочки - внутренние узлы; отрезаем его от последнего листа */
+    parent_head = child;
+    for (child = level_head, i = 1; i < nodes; i++)
+        child = KTREE_BNODE(pool, child)->next;
+    KTREE_BNODE(pool, child)->next = KTREE_INVALID_NODE;
+    
+    *height = 1;
+    while (nodes > 1) {
+        ktree_node_idx_t level_first = parent_head;
+        
+        parents = (nodes + KTREE_BNODE_KEYS) / (KTREE_BNODE_KEYS + 1);
+        per = nodes / parents;
+        extra = nodes % parents;
+        
+        child = level_head;
+        parent = parent_head;
+        for (i = 0; i < parents; i++) {
+            ktree_bnode_t* bnode = KTREE_BNODE(pool, parent);
+            uint32_t n = per + (i < extra);
+            
+            for (j = 0; j < n; j++) {
+                ktree_node_idx_t next = KTREE_BNODE(pool, child)->next;
+                
+                bnode->children[j] = child;
+                if (j > 0)
+                    bnode->keys[j - 1] = ktree_bnode_subtree_min(pool, child);
+                
+                /* Связи next нужны только листьям */
+                if (*height > 1)
+                    KTREE_BNODE(pool, child)->next = KTREE_INVALID_NODE;
+                child = next;
+            }
+            bnode->count = (uint8_t)(n - 1);
+            
+            /* Последний узел уровня отрезает от цепочки узлы верхних уровней */
+            if (i + 1 == parents) {
+                parent_head = bnode->next;
+                bnode->next = KTREE_INVALID_NODE;
+            } else {
+                parent = bnode->next;
+            }
+        }
+        
+        level_head = level_first;
+        nodes = parents;
+        (*height)++;
+    }
+    
+    *root = level_head;
+    return KTREE_SUCCESS;
+}
+
+/*
+ * Замена содержимого дерева сбалансированным деревом из строго
+ * возрастающего массива за O(n). Новое дерево строится вне секции записи
+ * и публикуется одной сменой корня: читатели видят либо старое, либо новое
+ * содержимое. Старые узлы возвращаются в пул после публикации.
+ */
+KTREE_INLINE ktree_error_t ktree_bulk_load(ktree_manager_t* mgr,
+                                         uint32_t tree_id,
+                                         const ktree_data_t* data,
+                                         uint32_t count) {
+    ktree_node_pool_t* pool = &mgr->node_pool;
+    ktree_node_idx_t new_root = KTREE_INVALID_NODE, old_root;
+    ktree_hash_index_t* index;
+    ktree_tree_t* tree;
+    ktree_error_t err = KTREE_SUCCESS;
+    uint8_t height = 0;
+    uint32_t i;
+    
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES || (!data && count)))
+        return KTREE_ERR_INVALID;
+    
+    /* Вход должен быть отсортирован и без дубликатов */
+    for (i = 1; i < count; i++) {
+        if (KTREE_UNLIKELY(data[i - 1] >= data[i]))
+            return KTREE_ERR_INVALID;
+    }
+    
+    tree = &mgr->trees[tree_id];
+    index = ktree_tree_index(mgr, tree);
+    if (KTREE_UNLIKELY(index && count > KTREE_HASH_SLOTS / 2))
+        return KTREE_ERR_FULL;
+    
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &tree->tree_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
+    
+    if (count > 0) {
+        if (tree->flags & KTREE_TREE_FLAG_BPLUS) {
+            err = ktree_bulk_build_bplus(pool, data, count, &new_root, &height);
+        } else {
+            err = ktree_bulk_build_binary(pool, tree->flags, data, count, &new_root);
+            height = (uint8_t)(32 - __builtin_clz(count));
+        }
+        
+        if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
+            goto unlock;
+    }
+    
+    old_root = tree->root;
+    
+    ktree_write_seqbegin(&tree->seq);
+    tree->root = new_root;
+    tree->height = height;
+    if (index)
+        ktree_hash_rebuild(index, pool, new_root);
+    ktree_write_seqend(&tree->seq);
+    
+    ktree_atomic_set(&tree->size, count);
+    
+    if (old_root != KTREE_INVALID_NODE) {
+        if (tree->flags & KTREE_TREE_FLAG_BPLUS)
+            ktree_pool_free_bnode_tree(pool, old_root);
+        else
+            ktree_free_subtree(pool, old_root);
+    }
+    
+unlock:
+    ktree_spinlock_unlock(&tree->tree_lock);
+    return err;
+}
+
+/*
+ * ============================================================================
+ * ПАКЕТНАЯ ВСТАВКА
+ * ============================================================================
+ *
+ * Вход сортируется порциями по KTREE_INSERT_BATCH_CHUNK ключей на стеке.
+ * Внутри порции ключи возрастают, и спуск для очередного ключа начинается
+ * не от корня, а от ближайшего предка предыдущего вставленного узла, чье
+ * поддерево может содержать новый ключ. Поиск предка идет по ссылкам
+ * parent, которые остаются верными после поворотов балансировки.
+ * Несбалансированное дерево от возрастающих ключей выродилось бы в список,
+ * поэтому в него порция вставляется в порядке полного дерева (медианы
+ * вперед) со спуском от корня.
+ */
+
+/* Пирамидальная сортировка ключей порции по возрастанию */
+KTREE_INLINE void ktree_sort_keys(ktree_data_t* keys, uint32_t count) {
+    uint32_t start, end, root, child;
+    ktree_data_t tmp;
+    
+    if (count < 2)
+        return;
+    
+    for (start = count / 2, end = count; end > 1; ) {
+        if (start > 0) {
+            start--;
+        } else {
+            end--;
+            tmp = keys[0];
+            keys[0] = keys[end];
+            keys[end] = tmp;
+        }
+        
+        /* Просеивание вниз */
+        for (root = start; (child = 2 * root + 1) < end; root = child) {
+            if (child + 1 < end && keys[child] < keys[child + 1])
+                child++;
+            if (keys[root] >= keys[child])
+                break;
+            
+            tmp = keys[root];
+            keys[root] = keys[child];
+            keys[child] = tmp;
+        }
+    }
+}
+
+/* Уровень узла (корень - 1) по ссылкам parent */
+KTREE_INLINE uint32_t ktree_node_level(const ktree_node_pool_t* pool,
+                                     ktree_node_idx_t idx) {
+    uint32_t level = 0;
+    
+    for (; idx != KTREE_INVALID_NODE; idx = KTREE_NODE(pool, idx)->parent)
+        level++;
+    
+    return level;
+}
+
+/*
+ * Ближайший предок finger (или он сам), чье поддерево содержит data >
+ * ключа finger. level - уровень finger на входе и найденного узла на
+ * выходе; это верхняя оценка, так как повороты только поднимают узлы.
+ */
+KTREE_INLINE ktree_node_idx_t ktree_batch_climb(const ktree_node_pool_t* pool,
+                                              ktree_node_idx_t finger,
+                                              ktree_data_t data,
+                                              uint32_t* level) {
+    ktree_node_idx_t x = finger, cand = KTREE_INVALID_NODE, parent_idx;
+    uint32_t x_level = *level, cand_level = 0;
+    
+    while ((parent_idx = KTREE_NODE(pool, x)->parent) != KTREE_INVALID_NODE) {
+        const ktree_node_t* parent = KTREE_NODE(pool, parent_idx);
+        
+        if (parent->left == x) {
+            /* Верхняя граница поддерева x - ключ родителя */
+            if (data < parent->data)
+                break;
+            cand = KTREE_INVALID_NODE;
+        } else if (cand == KTREE_INVALID_NODE) {
+            /* Граница правого потомка та же, что у родителя */
+            cand = x;
+            cand_level = x_level;
+        }
+        
+        x = parent_idx;
+        if (x_level > 1)
+            x_level--;
+    }
+    
+    /* Цепочка правых потомков под x ограничена тем же ключом, что и x */
+    if (cand != KTREE_INVALID_NODE) {
+        *level = cand_level;
+        return cand;
+    }
+    
+    *level = x_level;
+    return x;
+}
+
+/*
+ * Вставка n ключей за один захват tree_lock; узлы на порцию берутся из
+ * пула одним захватом pool_lock (по числу разных ключей в ней), а если
+ * столько не нашлось - по одному. Ключи, которые уже есть в дереве или
+ * повторяются во входе, пропускаются, и тогда возвращается
+ * KTREE_ERR_EXISTS. При
+ * KTREE_ERR_MAX_DEPTH или KTREE_ERR_FULL вставка останавливается; уже
+ * вставленные ключи остаются в дереве.
+ */
+KTREE_INLINE ktree_error_t ktree_insert_batch(ktree_manager_t* mgr,
+                                            uint32_t tree_id,
+                                            const ktree_data_t* data,
+                                            uint32_t count) {
+    ktree_data_t keys[KTREE_INSERT_BATCH_CHUNK];
+    ktree_node_pool_t* pool = &mgr->node_pool;
+    ktree_node_idx_t spare = KTREE_INVALID_NODE, extra, tail;
+    ktree_hash_index_t* index;
+    ktree_tree_t* tree;
+    ktree_error_t err = KTREE_SUCCESS, res;
+    bool skipped = false;
+    uint32_t base, n, i, j, spare_count = 0;
+    bool balanced;
+    
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES || (!data && count)))
+        return KTREE_ERR_INVALID;
+    
+    if (count == 0)
+        return KTREE_SUCCESS;
+    
+    tree = &mgr->trees[tree_id];
+    index = ktree_tree_index(mgr, tree);
+    
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &tree->tree_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
+    
+    if (tree->flags & KTREE_TREE_FLAG_BPLUS) {
+        for (i = 0; i < count; i++) {
+            res = ktree_bplus_insert(pool, tree, data[i]);
+            if (res == KTREE_SUCCESS) {
+                ktree_atomic_inc(&tree->size);
+            } else if (res == KTREE_ERR_EXISTS) {
+                skipped = true;
+            } else {
+                err = res;
+                break;
+            }
+        }
         goto unlock;
     }
     
-    /* Находим свободный слот */
-    for (i = 0; i < KTREE_MAX_TREES; i++) {
-        if (mgr->trees[i].root == KTREE_INVALID_NODE && 
-            ktree_atomic_read(&mgr->trees[i].size) == 0) {
+    balanced = (tree->flags & (KTREE_TREE_FLAG_AVL | KTREE_TREE_FLAG_RB)) != 0;
+    
+    for (base = 0; base < count && err == KTREE_SUCCESS; base += n) {
+        ktree_node_idx_t finger = KTREE_INVALID_NODE;
+        uint32_t finger_level = 0;
+        
+        n = count - base < KTREE_INSERT_BATCH_CHUNK ? count - base : KTREE_INSERT_BATCH_CHUNK;
+        for (i = 0; i < n; i++)
+            keys[i] = data[base + i];
+        ktree_sort_keys(keys, n);
+        
+        /* Повторы внутри порции */
+        for (i = 1, j = 1; i < n; i++) {
+            if (keys[i] != keys[j - 1])
+                keys[j++] = keys[i];
+        }
+        if (j < n)
+            skipped = true;
+        
+        /* Запас дополняется до числа разных ключей порции */
+        if (spare_count < j && ktree_pool_alloc_batch(pool, j - spare_count, &extra) == KTREE_SUCCESS) {
+            for (tail = extra; KTREE_NODE(pool, tail)->left != KTREE_INVALID_NODE; )
+                tail = KTREE_NODE(pool, tail)->left;
+            KTREE_NODE(pool, tail)->left = spare;
+            spare = extra;
+            spare_count = j;
+        }
+        
+        ktree_write_seqbegin(&tree->seq);
+        
+        for (i = 0; i < j; i++) {
+            ktree_node_idx_t new_idx, parent_idx = KTREE_INVALID_NODE, curr_idx;
+            ktree_data_t key = balanced ? keys[i] : keys[ktree_complete_rank(i + 1, j)];
+            ktree_node_t* node;
+            uint32_t level;
+            uint32_t start_level KTREE_UNUSED;  /* Только для статистики */
             
-            ktree_init(&mgr->trees[i], flags);
-            ktree_atomic_inc(&mgr->tree_count);
-            *tree_id = i;
-            goto unlock;
+            if (KTREE_UNLIKELY(index && ktree_atomic_read(&tree->size) >= KTREE_HASH_SLOTS / 2)) {
+                err = KTREE_ERR_FULL;
+                break;
+            }
+            
+            /* Спуск от предка предыдущего узла или от корня */
+            if (balanced && finger != KTREE_INVALID_NODE) {
+                level = finger_level;
+                curr_idx = ktree_batch_climb(pool, finger, key, &level);
+            } else {
+                level = 1;
+                curr_idx = tree->root;
+            }
+            start_level = level;
+            
+            for (; curr_idx != KTREE_INVALID_NODE; level++) {
+                ktree_node_t* curr = KTREE_NODE(pool, curr_idx);
+                
+                if (key == curr->data)
+                    break;
+                
+                parent_idx = curr_idx;
+                curr_idx = key < curr->data ? curr->left : curr->right;
+            }
+            
+            if (curr_idx != KTREE_INVALID_NODE) {
+                finger = curr_idx;
+                finger_level = level;
+                skipped = true;
+                continue;
+            }
+            
+            /* Для пакета в гистограмму идет путь от начала спуска */
+            KTREE_STAT_ADD(pool, insert_path[level - start_level < KTREE_MAX_DEPTH
+                                             ? level - start_level : KTREE_MAX_DEPTH], 1);
+            
+            /* Оценка уровня завышена после поворотов - уточняем по parent */
+            if (KTREE_UNLIKELY(level > KTREE_MAX_DEPTH)) {
+                level = ktree_node_level(pool, parent_idx) + 1;
+                if (level > KTREE_MAX_DEPTH) {
+                    err = KTREE_ERR_MAX_DEPTH;
+                    break;
+                }
+            }
+            
+            if (KTREE_LIKELY(spare != KTREE_INVALID_NODE)) {
+                new_idx = spare;
+                spare = KTREE_NODE(pool, new_idx)->left;
+                spare_count--;
+            } else {
+                /* Пакетом узлов не хватило - часть ключей порции есть в дереве */
+                err = ktree_pool_alloc_node(pool, &new_idx);
+                if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
+                    break;
+            }
+            node = KTREE_NODE(pool, new_idx);
+            
+            node->left = KTREE_INVALID_NODE;
+            node->right = KTREE_INVALID_NODE;
+            node->parent = parent_idx;
+            node->height = 1;
+            node->flags = 0;
+            ktree_node_init(pool, new_idx, key);
+            
+            if (parent_idx == KTREE_INVALID_NODE) {
+                node->flags |= KTREE_FLAG_ROOT;
+                tree->root = new_idx;
+            } else if (key < KTREE_NODE(pool, parent_idx)->data) {
+                KTREE_NODE(pool, parent_idx)->left = new_idx;
+            } else {
+                KTREE_NODE(pool, parent_idx)->right = new_idx;
+            }
+            
+            if (level > tree->height)
+                tree->height = (uint8_t)level;
+            
+            ktree_rebalance_after_insert(pool, tree, new_idx);
+            
+            if (index)
+                ktree_hash_insert(index, pool, new_idx);
+            
+            ktree_atomic_inc(&tree->size);
+            finger = new_idx;
+            finger_level = level;
         }
+        
+        ktree_write_seqend(&tree->seq);
     }
     
-    err = KTREE_ERR_FULL;
+    /* Неиспользованные узлы возвращаются одной цепочкой */
+    if (spare != KTREE_INVALID_NODE) {
+        for (tail = spare; KTREE_NODE(pool, tail)->left != KTREE_INVALID_NODE; )
+            tail = KTREE_NODE(pool, tail)->left;
+        ktree_pool_free_chain(pool, spare, tail, spare_count);
+    }
     
 unlock:
-    ktree_spinlock_unlock(&mgr->mgr_lock);
+    ktree_spinlock_unlock(&tree->tree_lock);
+    
+    if (err == KTREE_SUCCESS && skipped)
+        err = KTREE_ERR_EXISTS;
     return err;
 }
 
-/* Инициализация менеджера деревьев */
-KTREE_INLINE void ktree_manager_init(ktree_manager_t* mgr) {
-    uint32_t i;
+/*
+ * ============================================================================
+ * ИТЕРАТОРЫ И ДИАПАЗОННЫЕ ЗАПРОСЫ
+ * ============================================================================
+ *
+ * Итератор не берет блокировок: вызывающий держит tree_lock либо
+ * гарантирует отсутствие писателей. Симметричный обход использует стек
+ * итератора; прямой, обратный и поуровневый обходы идут по ссылкам parent
+ * и не зависят от глубины стека. Для B+-дерева поддерживается только
+ * симметричный порядок: current - текущий лист, top - позиция в нем.
+ */
+
+/* Спуск по левой ветви с сохранением пути в стеке итератора */
+KTREE_INLINE ktree_error_t ktree_iter_push_left(ktree_iterator_t* it,
+                                              ktree_node_idx_t idx) {
+    while (idx != KTREE_INVALID_NODE) {
+        if (KTREE_UNLIKELY(!ktree_pool_node_valid(it->pool, idx) || it->top + 1 >= KTREE_MAX_DEPTH))
+            return KTREE_ERR_CORRUPTED;
+        
+        it->stack[++it->top] = idx;
+        idx = KTREE_READ_ONCE(KTREE_NODE(it->pool, idx)->left);
+    }
     
-    ktree_pool_init(&mgr->node_pool);
+    /* Следующий возвращаемый узел - вершина стека */
+    if (it->top >= 0)
+        KTREE_PREFETCH(KTREE_NODE(it->pool, it->stack[it->top]));
+    return KTREE_SUCCESS;
+}
+
+/* Позиционирование симметричного итератора на первый ключ >= lo */
+KTREE_INLINE ktree_error_t ktree_iter_seek(ktree_iterator_t* it, ktree_data_t lo) {
+    ktree_node_idx_t idx = KTREE_READ_ONCE(it->tree->root);
+    uint32_t steps, rank, count;
     
-    for (i = 0; i < KTREE_MAX_TREES; i++)
-        ktree_init(&mgr->trees[i], 0);
+    if (KTREE_UNLIKELY(it->flags != KTREE_ITER_FLAG_INORDER))
+        return KTREE_ERR_INVALID;
     
-    ktree_atomic_set(&mgr->tree_count, 0);
-    ktree_spinlock_init(&mgr->mgr_lock);
-    mgr->flags = 0;
+    it->top = -1;
+    it->current = KTREE_INVALID_NODE;
+    
+    if (it->tree->flags & KTREE_TREE_FLAG_BPLUS) {
+        for (steps = 0; idx != KTREE_INVALID_NODE; steps++) {
+            const ktree_bnode_t* bnode;
+            
+            if (KTREE_UNLIKELY(!ktree_pool_bnode_valid(it->pool, idx) || steps >= KTREE_MAX_DEPTH))
+                return KTREE_ERR_CORRUPTED;
+            
+            bnode = KTREE_BNODE(it->pool, idx);
+            count = KTREE_READ_ONCE(bnode->count);
+            if (count > KTREE_BNODE_KEYS)
+                count = KTREE_BNODE_KEYS;
+            rank = ktree_bnode_rank(bnode, count, lo);
+            
+            if (KTREE_READ_ONCE(bnode->flags) & KTREE_BNODE_LEAF) {
+                it->current = idx;
+                it->top = (int32_t)rank - (rank > 0 && bnode->keys[rank - 1] == lo);
+                return KTREE_SUCCESS;
+            }
+            
+            idx = KTREE_READ_ONCE(bnode->children[rank]);
+        }
+        return KTREE_SUCCESS;
+    }
+    
+    /* В стек попадают узлы, где спуск ушел влево, - это и есть путь обхода */
+    while (idx != KTREE_INVALID_NODE) {
+        const ktree_node_t* node;
+        
+        if (KTREE_UNLIKELY(!ktree_pool_node_valid(it->pool, idx) || it->top + 1 >= KTREE_MAX_DEPTH))
+            return KTREE_ERR_CORRUPTED;
+        
+        node = KTREE_NODE(it->pool, idx);
+        if (KTREE_READ_ONCE(node->data) >= lo) {
+            it->stack[++it->top] = idx;
+            idx = KTREE_READ_ONCE(node->left);
+        } else {
+            idx = KTREE_READ_ONCE(node->right);
+        }
+    }
+    
+    if (it->top >= 0)
+        KTREE_PREFETCH(KTREE_NODE(it->pool, it->stack[it->top]));
+    return KTREE_SUCCESS;
 }
 
-/* Добавление узла в дерево (базовая BST вставка) */
-KTREE_INLINE ktree_error_t ktree_insert(ktree_manager_t* mgr,
-                                      uint32_t tree_id,
-                                      ktree_data_t data) {
-    ktree_node_idx_t new_idx, parent_idx, curr_idx;
-    ktree_error_t err;
+/* Инициализация итератора для одного из порядков KTREE_ITER_FLAG_* */
+KTREE_INLINE ktree_error_t ktree_iter_init(ktree_iterator_t* it,
+                                         ktree_manager_t* mgr,
+                                         uint32_t tree_id,
+                                         uint32_t order) {
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES))
+        return KTREE_ERR_INVALID;
+    
+    if (KTREE_UNLIKELY(order != KTREE_ITER_FLAG_PREORDER &&
+                       order != KTREE_ITER_FLAG_INORDER &&
+                       order != KTREE_ITER_FLAG_POSTORDER &&
+                       order != KTREE_ITER_FLAG_LEVELORDER))
+        return KTREE_ERR_INVALID;
+    
+    if (KTREE_UNLIKELY((mgr->trees[tree_id].flags & KTREE_TREE_FLAG_BPLUS) &&
+                       order != KTREE_ITER_FLAG_INORDER))
+        return KTREE_ERR_INVALID;
+    
+    it->pool = &mgr->node_pool;
+    it->tree = &mgr->trees[tree_id];
+    it->flags = order;
+    it->top = -1;
+    it->current = KTREE_INVALID_NODE;
+    
+    if (order == KTREE_ITER_FLAG_INORDER)
+        return ktree_iter_seek(it, INT32_MIN);
+    
+    return KTREE_SUCCESS;
+}
+
+/* Первый узел обратного обхода: самый глубокий, предпочитая левые ветви */
+KTREE_INLINE ktree_node_idx_t ktree_iter_postorder_first(const ktree_node_pool_t* pool,
+                                                       ktree_node_idx_t idx) {
+    for (;;) {
+        if (KTREE_NODE(pool, idx)->left != KTREE_INVALID_NODE)
+            idx = KTREE_NODE(pool, idx)->left;
+        else if (KTREE_NODE(pool, idx)->right != KTREE_INVALID_NODE)
+            idx = KTREE_NODE(pool, idx)->right;
+        else
+            return idx;
+    }
+}
+
+/*
+ * Следующий узел прямого обхода с отсечением глубже target (для
+ * поуровневого обхода). Возвращает false, когда обход исчерпан.
+ */
+KTREE_INLINE bool ktree_iter_level_advance(const ktree_node_pool_t* pool,
+                                         ktree_node_idx_t* idx,
+                                         int32_t* depth,
+                                         int32_t target) {
+    ktree_node_idx_t curr = *idx;
+    const ktree_node_t* node = KTREE_NODE(pool, curr);
+    
+    if (*depth < target) {
+        if (node->left != KTREE_INVALID_NODE) {
+            *idx = node->left;
+            (*depth)++;
+            return true;
+        }
+        if (node->right != KTREE_INVALID_NODE) {
+            *idx = node->right;
+            (*depth)++;
+            return true;
+        }
+    }
+    
+    while (KTREE_NODE(pool, curr)->parent != KTREE_INVALID_NODE) {
+        ktree_node_idx_t parent_idx = KTREE_NODE(pool, curr)->parent;
+        
+        (*depth)--;
+        if (KTREE_NODE(pool, parent_idx)->left == curr &&
+            KTREE_NODE(pool, parent_idx)->right != KTREE_INVALID_NODE) {
+            *idx = KTREE_NODE(pool, parent_idx)->right;
+            (*depth)++;
+            return true;
+        }
+        curr = parent_idx;
+    }
+    
+    return false;
+}
+
+/* Симметричный шаг по листьям B+-дерева */
+KTREE_INLINE ktree_error_t ktree_iter_next_bplus(ktree_iterator_t* it,
+                                               ktree_data_t* data) {
+    uint32_t hops, count;
+    
+    for (hops = 0; hops < KTREE_BNODE_CAPACITY; hops++) {
+        const ktree_bnode_t* leaf;
+        ktree_node_idx_t next;
+        
+        if (it->current == KTREE_INVALID_NODE ||
+            !ktree_pool_bnode_valid(it->pool, it->current))
+            return KTREE_ERR_EMPTY;
+        
+        leaf = KTREE_BNODE(it->pool, it->current);
+        count = KTREE_READ_ONCE(leaf->count);
+        if (count > KTREE_BNODE_KEYS)
+            count = KTREE_BNODE_KEYS;
+        
+        if ((uint32_t)it->top < count) {
+            *data = KTREE_READ_ONCE(leaf->keys[it->top]);
+            it->top++;
+            return KTREE_SUCCESS;
+        }
+        
+        /* Переход к следующему листу с предвыборкой листа за ним */
+        next = KTREE_READ_ONCE(leaf->next);
+        it->current = next;
+        it->top = 0;
+        if (ktree_pool_bnode_valid(it->pool, next)) {
+            ktree_node_idx_t ahead = KTREE_READ_ONCE(KTREE_BNODE(it->pool, next)->next);
+            if (ktree_pool_bnode_valid(it->pool, ahead))
+                KTREE_PREFETCH(KTREE_BNODE(it->pool, ahead));
+        }
+    }
+    
+    return KTREE_ERR_CORRUPTED;
+}
+
+/* Получение следующего ключа; KTREE_ERR_EMPTY по окончании обхода */
+KTREE_INLINE ktree_error_t ktree_iter_next(ktree_iterator_t* it, ktree_data_t* data) {
+    const ktree_node_pool_t* pool = it->pool;
+    ktree_node_idx_t root = it->tree->root;
+    ktree_node_idx_t idx = KTREE_INVALID_NODE;
+    
+    switch (it->flags) {
+    case KTREE_ITER_FLAG_INORDER: {
+        ktree_error_t err;
+        
+        if (it->tree->flags & KTREE_TREE_FLAG_BPLUS)
+            return ktree_iter_next_bplus(it, data);
+        
+        if (it->top < 0) {
+            it->current = KTREE_INVALID_NODE;
+            return KTREE_ERR_EMPTY;
+        }
+        
+        idx = it->stack[it->top--];
+        *data = KTREE_READ_ONCE(KTREE_NODE(pool, idx)->data);
+        it->current = idx;
+        
+        err = ktree_iter_push_left(it, KTREE_READ_ONCE(KTREE_NODE(pool, idx)->right));
+        return err;
+    }
+    
+    case KTREE_ITER_FLAG_PREORDER:
+        if (it->top < 0) {
+            /* Первый вызов: начинаем с корня */
+            idx = root;
+            it->top = 0;
+        } else if (it->current != KTREE_INVALID_NODE) {
+            idx = ktree_preorder_next(pool, it->current);
+        }
+        break;
+    
+    case KTREE_ITER_FLAG_POSTORDER:
+        if (it->top < 0) {
+            it->top = 0;
+            if (root != KTREE_INVALID_NODE)
+                idx = ktree_iter_postorder_first(pool, root);
+        } else if (it->current != KTREE_INVALID_NODE) {
+            ktree_node_idx_t parent_idx = KTREE_NODE(pool, it->current)->parent;
+            
+            if (parent_idx != KTREE_INVALID_NODE) {
+                if (KTREE_NODE(pool, parent_idx)->left == it->current &&
+                    KTREE_NODE(pool, parent_idx)->right != KTREE_INVALID_NODE)
+                    idx = ktree_iter_postorder_first(pool, KTREE_NODE(pool, parent_idx)->right);
+                else
+                    idx = parent_idx;
+            }
+        }
+        break;
+    
+    case KTREE_ITER_FLAG_LEVELORDER:
+        /* top хранит глубину текущего узла; уровни обходятся сверху вниз */
+        if (it->top < 0) {
+            idx = root;
+            it->top = 0;
+        } else if (it->current != KTREE_INVALID_NODE) {
+            int32_t target = it->top, depth = it->top;
+            bool restarted = false;
+            
+            idx = it->current;
+            for (;;) {
+                if (!ktree_iter_level_advance(pool, &idx, &depth, target)) {
+                    /* Уровень исчерпан: следующий ищем заново от корня */
+                    if (restarted || target + 1 >= KTREE_MAX_DEPTH) {
+                        idx = KTREE_INVALID_NODE;
+                        break;
+                    }
+                    target++;
+                    idx = root;
+                    depth = 0;
+                    restarted = true;
+                    continue;
+                }
+                
+                if (depth == target) {
+                    it->top = target;
+                    break;
+                }
+            }
+        }
+        break;
+    
+    default:
+        return KTREE_ERR_INVALID;
+    }
+    
+    it->current = idx;
+    if (idx == KTREE_INVALID_NODE)
+        return KTREE_ERR_EMPTY;
+    
+    *data = KTREE_NODE(pool, idx)->data;
+    
+    /* Вероятные следующие узлы - потомки текущего */
+    if (KTREE_NODE(pool, idx)->left != KTREE_INVALID_NODE)
+        KTREE_PREFETCH(KTREE_NODE(pool, KTREE_NODE(pool, idx)->left));
+    if (KTREE_NODE(pool, idx)->right != KTREE_INVALID_NODE)
+        KTREE_PREFETCH(KTREE_NODE(pool, KTREE_NODE(pool, idx)->right));
+    
+    return KTREE_SUCCESS;
+}
+
+/* Обход ключей из [lo, hi] по возрастанию под tree_lock */
+KTREE_INLINE ktree_error_t ktree_range_scan(ktree_manager_t* mgr,
+                                          uint32_t tree_id,
+                                          ktree_data_t lo,
+                                          ktree_data_t hi,
+                                          ktree_visit_fn visit,
+                                          void* ctx) {
+    ktree_iterator_t it;
     ktree_tree_t* tree;
+    ktree_data_t data;
+    ktree_error_t err;
     
-    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES))
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES || !visit || lo > hi))
         return KTREE_ERR_INVALID;
     
     tree = &mgr->trees[tree_id];
+    it.pool = &mgr->node_pool;
+    it.tree = tree;
+    it.flags = KTREE_ITER_FLAG_INORDER;
     
-    if (KTREE_UNLIKELY(ktree_spinlock_lock(&tree->tree_lock) != KTREE_SUCCESS))
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &tree->tree_lock) != KTREE_SUCCESS))
         return KTREE_ERR_LOCK_FAILED;
     
-    /* Выделяем новый узел */
-    err = ktree_pool_alloc_node(&mgr->node_pool, &new_idx);
-    if (KTREE_UNLIKELY(err != KTREE_SUCCESS))
-        goto unlock_tree;
+    err = ktree_iter_seek(&it, lo);
+    while (err == KTREE_SUCCESS) {
+        err = ktree_iter_next(&it, &data);
+        if (err != KTREE_SUCCESS || data > hi || !visit(data, ctx))
+            break;
+    }
     
-    ktree_node_init(&mgr->node_pool, new_idx, data);
+    ktree_spinlock_unlock(&tree->tree_lock);
+    return err == KTREE_ERR_EMPTY ? KTREE_SUCCESS : err;
+}
+
+/* Сбор ключей диапазона в буфер; KTREE_ERR_FULL, если буфер кончился раньше */
+KTREE_INLINE ktree_error_t ktree_range_collect_raw(ktree_iterator_t* it,
+                                                 ktree_data_t lo,
+                                                 ktree_data_t hi,
+                                                 ktree_data_t* out,
+                                                 uint32_t max,
+                                                 uint32_t* count) {
+    ktree_data_t data;
+    ktree_error_t err;
+    uint32_t n = 0;
     
-    /* Если дерево пустое, устанавливаем корень */
-    if (KTREE_UNLIKELY(tree->root == KTREE_INVALID_NODE)) {
-        tree->root = new_idx;
-        ktree_atomic_set(&tree->size, 1);
-        tree->height = 1;
+    err = ktree_iter_seek(it, lo);
+    while (err == KTREE_SUCCESS) {
+        err = ktree_iter_next(it, &data);
+        if (err != KTREE_SUCCESS || data > hi)
+            break;
         
-        ktree_node_t* root_node = ktree_pool_get_node(&mgr->node_pool, new_idx);
-        root_node->flags |= KTREE_FLAG_ROOT;
+        if (n == max) {
+            err = KTREE_ERR_FULL;
+            break;
+        }
+        out[n++] = data;
+    }
+    
+    *count = n;
+    if (err == KTREE_ERR_EMPTY)
+        err = KTREE_SUCCESS;
+    return err;
+}
+
+/*
+ * Пакетный сбор ключей из [lo, hi] по возрастанию без захвата tree_lock.
+ * При KTREE_ERR_FULL буфер заполнен целиком, продолжать можно с
+ * out[max - 1] + 1.
+ */
+KTREE_INLINE ktree_error_t ktree_range_collect(ktree_manager_t* mgr,
+                                             uint32_t tree_id,
+                                             ktree_data_t lo,
+                                             ktree_data_t hi,
+                                             ktree_data_t* out,
+                                             uint32_t max,
+                                             uint32_t* count) {
+    ktree_iterator_t it;
+    ktree_tree_t* tree;
+    ktree_error_t err;
+    uint32_t seq, retries;
+    
+    if (KTREE_UNLIKELY(tree_id >= KTREE_MAX_TREES || !count || (!out && max)))
+        return KTREE_ERR_INVALID;
+    
+    *count = 0;
+    if (lo > hi)
+        return KTREE_SUCCESS;
+    
+    tree = &mgr->trees[tree_id];
+    it.pool = &mgr->node_pool;
+    it.tree = tree;
+    it.flags = KTREE_ITER_FLAG_INORDER;
+    
+    for (retries = 0; retries < KTREE_SPINLOCK_RETRIES; retries++) {
+        seq = ktree_read_seqbegin(&tree->seq);
+        err = ktree_range_collect_raw(&it, lo, hi, out, max, count);
         
-        goto unlock_tree;
+        if (KTREE_LIKELY(!ktree_read_seqretry(&tree->seq, seq)))
+            return err;
     }
     
-    /* Вставка в непустое дерево */
-    curr_idx = tree->root;
-    parent_idx = KTREE_INVALID_NODE;
+    if (KTREE_UNLIKELY(ktree_lock(&mgr->node_pool, &tree->tree_lock) != KTREE_SUCCESS))
+        return KTREE_ERR_LOCK_FAILED;
     
-    while (curr_idx != KTREE_INVALID_NODE) {
-        ktree_node_t* curr = ktree_pool_get_node(&mgr->node_pool, curr_idx);
+    err = ktree_range_collect_raw(&it, lo, hi, out, max, count);
+    
+    ktree_spinlock_unlock(&tree->tree_lock);
+    return err;
+}
+
+/*
+ * ============================================================================
+ * СТАТИСТИКА
+ * ============================================================================
+ */
+
+/*
+ * Сводка пер-CPU счетчиков и заполнения пула без блокировок: писатели не
+ * останавливаются, поэтому снимок может отставать на операции, идущие в
+ * момент чтения. Без KTREE_STATS заполнены только поля пула и высоты.
+ */
+KTREE_INLINE ktree_error_t ktree_stats_snapshot(ktree_manager_t* mgr,
+                                              ktree_stats_t* out) {
+    ktree_node_pool_t* pool;
+    uint32_t i, d;
+    
+    if (KTREE_UNLIKELY(!mgr || !out))
+        return KTREE_ERR_INVALID;
+    
+    pool = &mgr->node_pool;
+    out->lock_spins = 0;
+    out->lock_failures = 0;
+    out->alloc_failures = 0;
+    out->inserts = 0;
+    for (d = 0; d <= KTREE_MAX_DEPTH; d++)
+        out->insert_path[d] = 0;
+    
+#if KTREE_STATS
+    for (i = 0; i < KTREE_MAX_CPUS; i++) {
+        const ktree_pcpu_stats_t* stats = &pool->stats[i];
         
-        parent_idx = curr_idx;
-     
+        out->lock_spins += KTREE_READ_ONCE(stats->lock_spins);
+        out->lock_failures += KTREE_READ_ONCE(stats->lock_failures);
+        out->alloc_failures += KTREE_READ_ONCE(stats->alloc_failures);
+        for (d = 0; d <= KTREE_MAX_DEPTH; d++)
+            out->insert_path[d] += KTREE_READ_ONCE(stats->insert_path[d]);
+    }
+#endif
+    
+    for (d = 0; d <= KTREE_MAX_DEPTH; d++)
+        out->inserts += out->insert_path[d];
+    
+    out->max_height = 0;
+    for (i = 0; i < KTREE_MAX_TREES; i++) {
+        const ktree_tree_t* tree = &mgr->trees[i];
+        
+        if ((KTREE_READ_ONCE(tree->flags) & KTREE_TREE_FLAG_IN_USE) &&
+            KTREE_READ_ONCE(tree->height) > out->max_height)
+            out->max_height = KTREE_READ_ONCE(tree->height);
+    }
+    
+#ifdef KTREE_SEGMENTED_POOL
+    out->pool_capacity = __atomic_load_n(&pool->segment_count, __ATOMIC_RELAXED)
+                         << KTREE_SEGMENT_SHIFT;
+    out->bnode_capacity = __atomic_load_n(&pool->bnode_segment_count, __ATOMIC_RELAXED)
+                          << KTREE_SEGMENT_SHIFT;
+#else
+    out->pool_capacity = KTREE_MAX_NODES;
+    out->bnode_capacity = KTREE_MAX_BNODES;
+#endif
+    out->pool_used = ktree_pool_node_count(pool);
+    out->pool_free = out->pool_capacity > out->pool_used
+                     ? out->pool_capacity - out->pool_used : 0;
+    out->bnode_used = __atomic_load_n(&pool->bnode_count.counter, __ATOMIC_RELAXED);
+    out->bnode_free = out->bnode_capacity > out->bnode_used
+                      ? out->bnode_capacity - out->bnode_used : 0;
+    
+    return KTREE_SUCCESS;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _KERNEL_TREE_H */
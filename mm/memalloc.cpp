@@ -1,95 +1,147 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
 #define MEMORY_SIZE (1 << 20) // 1MB of memory
 #define BLOCK_SIZE 16 // minimum block size
 
+#define MIN_ORDER 4 // log2(BLOCK_SIZE)
+#define MAX_ORDER 20 // log2(MEMORY_SIZE)
+#define NUM_ORDERS (MAX_ORDER - MIN_ORDER + 1)
+#define NUM_BLOCKS (MEMORY_SIZE / BLOCK_SIZE)
+
+// Free blocks keep their list links inside the block itself
 struct memory_block {
-    size_t size;
-    bool is_free;
     struct memory_block* next;
-    struct memory_block* buddy;
+    struct memory_block* prev;
 };
 
-struct memory_block memory_blocks[MEMORY_SIZE / BLOCK_SIZE];
+static uint8_t memory_pool[MEMORY_SIZE] __attribute__((aligned(BLOCK_SIZE)));
 
-void init_memory() {
-    // Initialize all memory blocks as free
-    for (int i = 0; i < MEMORY_SIZE / BLOCK_SIZE; i++) {
-        memory_blocks[i].size = BLOCK_SIZE;
-        memory_blocks[i].is_free = true;
-        memory_blocks[i].next = NULL;
-        memory_blocks[i].buddy = NULL;
-    }
+// free_area[k] holds free blocks of 2^(k + MIN_ORDER) bytes
+static struct memory_block* free_area[NUM_ORDERS];
+static uint32_t free_area_mask; // Bit k set if free_area[k] is non-empty
 
-    // Set up buddy pointers
-    for (int i = 0; i < MEMORY_SIZE / BLOCK_SIZE; i++) {
-        if (i % 2 == 0) {
-            memory_blocks[i].buddy = &memory_blocks[i + 1];
-            memory_blocks[i + 1].buddy = &memory_blocks[i];
-        }
-    }
+// One bit per BLOCK_SIZE unit, set on the first unit of every allocated block
+static uint64_t alloc_bitmap[NUM_BLOCKS / 64];
 
-    // Combine all blocks into one large free block
-    struct memory_block* current = &memory_blocks[0];
-    for (int i = 1; i < MEMORY_SIZE / BLOCK_SIZE; i++) {
-        current->next = &memory_blocks[i];
-        current = current->next;
+// Order of the block starting at each unit. The first unit of a buddy is always the
+// start of some block (whole or split), so the entry there is always valid.
+static uint8_t block_order[NUM_BLOCKS];
+
+static inline size_t block_offset(void* ptr) {
+    return (size_t)((uint8_t*)ptr - memory_pool);
+}
+
+static inline bool is_allocated(size_t unit) {
+    return (alloc_bitmap[unit / 64] >> (unit % 64)) & 1;
+}
+
+static inline void set_allocated(size_t unit, bool allocated) {
+    if (allocated) {
+        alloc_bitmap[unit / 64] |= 1ull << (unit % 64);
+    } else {
+        alloc_bitmap[unit / 64] &= ~(1ull << (unit % 64));
     }
 }
 
-struct memory_block* find_free_block(size_t size) {
-    struct memory_block* current = &memory_blocks[0];
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
-            return current;
-        }
-        current = current->next;
+static void free_area_push(size_t offset, unsigned order) {
+    struct memory_block* block = (struct memory_block*)(memory_pool + offset);
+    unsigned k = order - MIN_ORDER;
+    block->prev = NULL;
+    block->next = free_area[k];
+    if (block->next) {
+        block->next->prev = block;
     }
-    return NULL;
+    free_area[k] = block;
+    free_area_mask |= 1u << k;
+    block_order[offset / BLOCK_SIZE] = (uint8_t)order;
 }
 
-void split_block(struct memory_block* block, size_t size) {
-    struct memory_block* new_block = (struct memory_block*)((uintptr_t)block + size);
-    new_block->size = block->size - size;
-    new_block->is_free = true;
-    new_block->next = block->next;
-    new_block->buddy = block->buddy;
-    block->size = size;
-    block->next = new_block;
-    block->buddy = new_block->buddy;
-    new_block->buddy->buddy = new_block;
+static void free_area_remove(struct memory_block* block, unsigned order) {
+    unsigned k = order - MIN_ORDER;
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        free_area[k] = block->next;
+        if (!free_area[k]) {
+            free_area_mask &= ~(1u << k);
+        }
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
 }
 
-void merge_blocks(struct memory_block* block) {
-    if (block->buddy->is_free) {
-        struct memory_block* buddy = block->buddy;
-        block->size += buddy->size;
-        block->next = buddy->next;
-        block->buddy = buddy->buddy;
-        block->buddy->buddy = block;
+void init_memory() {
+    for (int k = 0; k < NUM_ORDERS; k++) {
+        free_area[k] = NULL;
+    }
+    free_area_mask = 0;
+    for (int i = 0; i < NUM_BLOCKS / 64; i++) {
+        alloc_bitmap[i] = 0;
     }
+
+    // The whole pool starts out as one free block of the largest order
+    free_area_push(0, MAX_ORDER);
 }
 
 void* kmalloc(size_t size) {
-    // Round up to nearest power of 2
-    size_t rounded_size = 1;
-    while (rounded_size < size) {
-        rounded_size <<= 1;
+    if (size == 0 || size > MEMORY_SIZE) {
+        return NULL;
     }
 
-    struct memory_block* block = find_free_block(rounded_size);
-    if (block == NULL) {
+    // Round up to the nearest power of 2, but never below BLOCK_SIZE
+    unsigned order = MIN_ORDER;
+    if (size > BLOCK_SIZE) {
+        order = 64 - __builtin_clzll((unsigned long long)size - 1);
+    }
+
+    // Smallest non-empty free area that can hold the request
+    uint32_t candidates = free_area_mask & (~0u << (order - MIN_ORDER));
+    if (!candidates) {
         return NULL;
     }
+    unsigned current = __builtin_ctz(candidates) + MIN_ORDER;
+
+    struct memory_block* block = free_area[current - MIN_ORDER];
+    free_area_remove(block, current);
+    size_t offset = block_offset(block);
 
-    if (block->size > rounded_size) {
-        split_block(block, rounded_size);
+    // Split down, handing the upper halves back as free buddies
+    while (current > order) {
+        current--;
+        free_area_push(offset + ((size_t)1 << current), current);
     }
 
-    block->is_free = false;
+    block_order[offset / BLOCK_SIZE] = (uint8_t)order;
+    set_allocated(offset / BLOCK_SIZE, true);
     return block;
 }
 
 void kfree(void* ptr) {
-    struct memory_block* block = (struct memory_block*)ptr;
-    block->is_free = true;
-    merge_blocks(block);
+    if (ptr == NULL) {
+        return;
+    }
+
+    size_t offset = block_offset(ptr);
+    if (offset >= MEMORY_SIZE || offset % BLOCK_SIZE != 0 || !is_allocated(offset / BLOCK_SIZE)) {
+        return; // Not a block handed out by kmalloc (or already freed)
+    }
+    set_allocated(offset / BLOCK_SIZE, false);
+
+    // Merge upwards while the buddy (offset XOR block size) is free and whole
+    unsigned order = block_order[offset / BLOCK_SIZE];
+    while (order < MAX_ORDER) {
+        size_t buddy = offset ^ ((size_t)1 << order);
+        size_t buddy_unit = buddy / BLOCK_SIZE;
+        if (is_allocated(buddy_unit) || block_order[buddy_unit] != order) {
+            break;
+        }
+        free_area_remove((struct memory_block*)(memory_pool + buddy), order);
+        offset &= ~((size_t)1 << order);
+        order++;
+    }
+
+    free_area_push(offset, order);
 }